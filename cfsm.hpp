@@ -53,6 +53,10 @@
  * is not of the requested type, nullptr is returned. This can be used as a
  * test for the current state of a state machine.
  *
+ * State classes with empty entry or exit actions may inherit from the
+ * "no_entry_action" and "no_exit_action" tag types. Calls to the respective
+ * member functions are then elided at compile time.
+ *
  * @section transitions State transitions
  * Transitions between user defined states are represented by a struct
  * template named "transition". The template parameters are the types of
@@ -77,6 +81,15 @@
  *   void operator()(void *dataptr);
  *
  *
+ * A state can declare a completion transition, taken immediately after the
+ * state is entered, with the "CFSM_COMPLETION" helper macro. Chains of
+ * completion transitions are expanded at compile time and run under the lock
+ * of the call which entered the first state.
+ *
+ * The "go_to" member function template of the "state_machine" class drives
+ * the state machine to a target state along a shortest route of defined
+ * transitions. Routes are computed at compile time.
+ *
  * @section state_machine_types State machine types
  * State machines are classified based on their state object allocation scheme.
  * These are lazily allocated, externally preallocated and internally
@@ -104,6 +117,16 @@
  * state machine object. This scheme offers conveniece at the cost of reduced
  * flexibility.
  *
+ * @section inplace In-place state storage
+ * The state machine can construct the current state object inside itself, in
+ * storage sized for the largest state class. State objects are constructed on
+ * entry and destroyed after exit, no heap allocation takes place. In-place
+ * state machines also accept plain state classes which do not inherit from
+ * the base "state" class. Their "on_enter" and "on_exit" member functions may
+ * be static or non-virtual and are detected at compile time; both are
+ * optional. Such state objects carry no vtable pointer. The "base_state"
+ * template parameter shall be void when the states share no base class.
+ *
  * @section type_id Type identifier for derived state classes
  * The type identifier of a derived state class is an unsigned integer of type
  * as std::size_t. Provide a static member function named "type_id" to each
@@ -121,11 +144,74 @@
  */
 
 #include <type_traits>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include <new>
+#include <cstring>
+#include <array>
+#include <tuple>
 #include <atomic>
 #include <memory>
 #include <functional>
 #include <sstream>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <fstream>
+#include <cstdio>
+#include <string>
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#if __has_include(<unistd.h>)
+#include <unistd.h>
+#endif
+#if __has_include(<sys/uio.h>) && __has_include(<unistd.h>)
+#include <sys/uio.h>
+#include <climits>
+#endif
+#if __has_include(<sys/mman.h>) && __has_include(<fcntl.h>)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && \
+  __has_include(<nmmintrin.h>)
+#include <nmmintrin.h>
+#define CFSM_HAS_CRC32C_SSE42 1
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && \
+  (defined(__GNUC__) || defined(__clang__)) && __has_include(<x86intrin.h>)
+#include <x86intrin.h>
+#define CFSM_HAS_RDTSC 1
+#endif
+#if defined(CFSM_USDT) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CFSM_HAS_USDT 1
+#endif
+#endif
+
+/*
+ * Statically defined tracepoints of provider "cfsm", a nop unless a tracer
+ * attaches. Enabled by defining CFSM_USDT where <sys/sdt.h> is available.
+ */
+#ifdef CFSM_HAS_USDT
+#define CFSM_PROBE1(name, a1) STAP_PROBE1(cfsm, name, a1)
+#define CFSM_PROBE2(name, a1, a2) STAP_PROBE2(cfsm, name, a1, a2)
+#define CFSM_PROBE3(name, a1, a2, a3) STAP_PROBE3(cfsm, name, a1, a2, a3)
+#define CFSM_PROBE4(name, a1, a2, a3, a4) \
+  STAP_PROBE4(cfsm, name, a1, a2, a3, a4)
+#else
+#define CFSM_PROBE1(name, a1) ((void)0)
+#define CFSM_PROBE2(name, a1, a2) ((void)0)
+#define CFSM_PROBE3(name, a1, a2, a3) ((void)0)
+#define CFSM_PROBE4(name, a1, a2, a3, a4) ((void)0)
+#endif
 
 namespace cfsm {
 
@@ -206,7 +292,100 @@ namespace cfsm {
     /// Virtual destructor for safe polymorphic deletion.
     virtual ~state() = default;
   };
-  
+
+  /**
+   * @brief Tag type marking a state class without an entry action.
+   *
+   * A state class which inherits from this tag declares that its `on_enter`
+   * member function does nothing. The state machine does not call `on_enter`
+   * for such states.
+   */
+  struct no_entry_action {};
+
+  /**
+   * @brief Tag type marking a state class without an exit action.
+   *
+   * A state class which inherits from this tag declares that its `on_exit`
+   * member function does nothing. The state machine does not call `on_exit`
+   * for such states.
+   */
+  struct no_exit_action {};
+
+  /**
+   * @brief Detects an `on_enter` member function callable with a void
+   * pointer.
+   *
+   * Static and non-virtual member functions of plain state classes are
+   * detected as well as overrides of `state::on_enter`.
+   *
+   * @tparam state_type The state class.
+   */
+  template <typename state_type, typename = void>
+  struct has_on_enter : std::false_type {};
+
+  template <typename state_type>
+  struct has_on_enter<
+    state_type,
+    std::void_t<
+      decltype(std::declval<state_type&>().on_enter(std::declval<void*>()))
+    >
+  > : std::true_type {};
+
+  /**
+   * @brief Detects an `on_exit` member function callable with a void pointer.
+   *
+   * Static and non-virtual member functions of plain state classes are
+   * detected as well as overrides of `state::on_exit`.
+   *
+   * @tparam state_type The state class.
+   */
+  template <typename state_type, typename = void>
+  struct has_on_exit : std::false_type {};
+
+  template <typename state_type>
+  struct has_on_exit<
+    state_type,
+    std::void_t<
+      decltype(std::declval<state_type&>().on_exit(std::declval<void*>()))
+    >
+  > : std::true_type {};
+
+  /**
+   * @brief Trait telling whether the state machine calls `on_enter` for a
+   * state class.
+   *
+   * Evaluates to false for state classes derived from `no_entry_action` and
+   * for plain state classes without an `on_enter` member function. It can be
+   * specialized for state classes which can not use the tag.
+   *
+   * @tparam state_type The state class.
+   */
+  template <typename state_type>
+  struct has_entry_action
+    : std::integral_constant<
+        bool,
+        has_on_enter<state_type>::value &&
+        !std::is_base_of<no_entry_action, state_type>::value
+      > {};
+
+  /**
+   * @brief Trait telling whether the state machine calls `on_exit` for a
+   * state class.
+   *
+   * Evaluates to false for state classes derived from `no_exit_action` and
+   * for plain state classes without an `on_exit` member function. It can be
+   * specialized for state classes which can not use the tag.
+   *
+   * @tparam state_type The state class.
+   */
+  template <typename state_type>
+  struct has_exit_action
+    : std::integral_constant<
+        bool,
+        has_on_exit<state_type>::value &&
+        !std::is_base_of<no_exit_action, state_type>::value
+      > {};
+
   /* Transition functor (generic fallback) */
   /**
    * @brief Functor template to handle state transitions.
@@ -248,6 +427,49 @@ namespace cfsm {
     }; \
     void cfsm::transition<from, to>::operator()(void *dataptr)
 
+  /**
+   * @brief Trait declaring the completion transition of a state.
+   *
+   * A specialization for a state class provides the member type `type`, the
+   * state class which the state machine moves to immediately after entering
+   * the state. The transition functor for the pair of state classes shall be
+   * defined. Without a specialization the state has no completion transition.
+   *
+   * @tparam state_type The state class.
+   */
+  template <typename state_type>
+  struct completion;
+
+  /**
+   * @brief Checks if a state class has a completion transition.
+   *
+   * @tparam state_type The state class.
+   */
+  template <typename state_type>
+  struct has_completion
+    : std::integral_constant<
+        bool,
+        is_type_complete_v<completion<state_type>>
+      > {};
+
+  /**
+   * @brief Helper macro to declare the completion transition from `from` to
+   * `to` state and begin definition of its transition functor.
+   *
+   * User needs to implement the `operator()` member function.
+   *
+   * CFSM_COMPLETION(from, to) {
+   *
+   * }
+   *
+   */
+  #define CFSM_COMPLETION(from, to) \
+    template <> \
+    struct cfsm::completion<from> { \
+      using type = to; \
+    }; \
+    CFSM_TRANSITION(from, to)
+
   /**
    * @brief Enum which specifies state objects allocation scheme for a state
    * machine.
@@ -256,628 +478,5746 @@ namespace cfsm {
     LAZY,         ///< Lazily allocated state objects
     PREALLOCED,   ///< User managed preallocated state objects array
     INTERNAL,     ///< Self managed preallocated state objects array
-    STATIC        ///< Self managed static preallocated state objects array
+    STATIC,       ///< Self managed static preallocated state objects array
+    INPLACE       ///< State object constructed inside the state machine
   };
 
-  /* Finite state machine class */
+#if __cplusplus >= 201703L
 
-#if __cplusplus >= 201402L
+  /* Snapshot encoding */
+
+  /// Magic number at the beginning of a snapshot, "CFSM" in little endian.
+  constexpr std::uint32_t snapshot_magic = 0x4d534643;
+
+  /// Version of the snapshot format.
+  constexpr std::uint8_t snapshot_version = 3;
+
+  /// Largest size of an unsigned LEB128 encoded 64 bit integer.
+  constexpr std::size_t varint_max_size = 10;
+
+  /// Size of a CRC32C checksum.
+  constexpr std::size_t crc_size = sizeof(std::uint32_t);
 
   /**
-   * @brief Template class representing a finite state machine.
-   * 
-   * This state machine class manages transitions between states and calls
-   * appropriate `on_enter` and `on_exit` member functions for the states.
-   * States must derive from a base state class.
-   * 
-   * @tparam base_state The base class from which all state types must derive.
-   * @tparam type Enum specifying the state object allocation scheme.
-   * @tparam state_pool Array of pointers to base state class objects.
-   * @tparam states List of state classes present in the state machine.
+   * @brief Largest size of a snapshot header.
+   *
+   * Magic number, version, flags, schema hash, start time, count of state
+   * machines and the checksum of these fields. Deltas add the number of
+   * entries.
    */
-  template <
-    typename base_state,
-    enum alloc_type type = alloc_type::LAZY,
-    base_state* state_pool[] = nullptr,
-    typename... states
-  >
+  constexpr std::size_t snapshot_header_max_size =
+    sizeof(std::uint32_t) + 2 + 2 * sizeof(std::uint64_t) + varint_max_size +
+    crc_size;
 
-#else /* __cplusplus >= 201402L */
+  /**
+   * @brief Returns the current time of snapshots and journal records.
+   *
+   * @return Nanoseconds since the epoch of the system clock.
+   */
+  inline std::uint64_t timestamp_now() {
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count());
+  }
+
+  /// Number of records in a snapshot frame, the last frame may hold less.
+  constexpr std::size_t snapshot_frame_records = 4096;
+
+  /// Size of the length prefix and the checksum of a snapshot frame.
+  constexpr std::size_t snapshot_frame_overhead =
+    sizeof(std::uint32_t) + crc_size;
 
   /**
-   * @brief Template class representing a finite state machine.
-   * 
-   * This state machine class manages transitions between states and calls
-   * appropriate * `on_enter` and `on_exit` member functions for the states.
-   * States must derive from a base state class.
-   * 
-   * @tparam base_state The base class from which all state types must derive.
-   * @tparam type Enum specifying the state object allocation scheme.
-   * @tparam state_pool Array of pointers to base state class objects.
-   * @tparam state_count Number of states present in the state machine.
+   * @brief Returns the number of frames holding given number of records.
+   *
+   * @param records Number of records.
    */
-  template <
-    typename base_state,
-    enum alloc_type type = alloc_type::LAZY,
-    base_state* state_pool[] = nullptr,
-    std::size_t state_count = 0
-  >
+  constexpr std::size_t snapshot_frames(std::size_t records) {
+    return (records + snapshot_frame_records - 1) / snapshot_frame_records;
+  }
 
-#endif /* __cplusplus >= 201402L */
+  /// FNV-1a 64 bit offset basis.
+  constexpr std::uint64_t fnv1a_offset = 14695981039346656037ULL;
 
-  class state_machine {
-    using base_state_pointer_type = base_state*;
+  /// FNV-1a 64 bit prime.
+  constexpr std::uint64_t fnv1a_prime = 1099511628211ULL;
 
-    struct state_deleter {
+  /**
+   * @brief Computes the FNV-1a hash of a character range.
+   *
+   * @param first Pointer to the first character.
+   * @param last Pointer past the last character.
+   * @param hash Hash to continue from.
+   * @return The 64 bit hash.
+   */
+  constexpr std::uint64_t fnv1a(const char *first, const char *last,
+      std::uint64_t hash = fnv1a_offset) {
+    for (; first != last; ++first) {
+      hash = (hash ^ static_cast<unsigned char>(*first)) * fnv1a_prime;
+    }
+    return hash;
+  }
 
-      template <
-        enum alloc_type type_ = type
-      >
-      typename std::enable_if<type_ != alloc_type::LAZY, void>::type
-      operator()(base_state_pointer_type ptr) const {}
+  /**
+   * @brief Returns the name of a type at compile time.
+   *
+   * The name is taken from the signature of this function. With GCC and
+   * Clang only the part naming the template argument is kept, so the name
+   * does not depend on the compiler; other compilers give the whole
+   * signature.
+   *
+   * @tparam state_type The type.
+   * @return View of a string with static storage duration.
+   */
+  template <typename state_type>
+  constexpr std::string_view type_name() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    std::string_view name = __FUNCSIG__;
+#else
+    std::string_view name = __PRETTY_FUNCTION__;
+#endif
+    constexpr std::string_view key = "state_type = ";
 
-      template <
-        enum alloc_type type_ = type
-      >
-      typename std::enable_if<type_ == alloc_type::LAZY, void>::type
-      operator()(base_state_pointer_type ptr) const {
-        delete ptr;
+    std::size_t first = name.find(key);
+    if (first == std::string_view::npos) {
+      return name;
+    }
+    first += key.size();
+    std::size_t last = name.find_first_of(";]", first);
+    return name.substr(first, last == std::string_view::npos ?
+        std::string_view::npos : last - first);
+  }
+
+  /**
+   * @brief Computes a hash of the name of a type at compile time.
+   *
+   * @tparam state_type The type.
+   * @return The 64 bit hash.
+   * @see type_name()
+   */
+  template <typename state_type>
+  constexpr std::uint64_t type_name_hash() {
+    constexpr std::string_view name = type_name<state_type>();
+    return fnv1a(name.data(), name.data() + name.size());
+  }
+
+  /**
+   * @brief Returns the size of an unsigned LEB128 encoded integer.
+   *
+   * @param value The integer.
+   * @return Number of bytes.
+   */
+  constexpr std::size_t varint_size(std::uint64_t value) {
+    std::size_t size = 1;
+    while (value >= 0x80) {
+      value >>= 7;
+      ++size;
+    }
+    return size;
+  }
+
+  /**
+   * @brief Writes an unsigned LEB128 encoded integer.
+   *
+   * @param value The integer.
+   * @param pdata Pointer to char array.
+   * @param datalen Size of the char array.
+   * @return Number of bytes written, 0 if the array is too small.
+   */
+  inline std::size_t encode_varint(std::uint64_t value, char *pdata,
+      std::size_t datalen) {
+    std::size_t size = 0;
+    do {
+      if (size == datalen) {
+        return 0;
       }
-    };
+      std::uint8_t byte = value & 0x7f;
+      value >>= 7;
+      pdata[size++] = static_cast<char>(value ? byte | 0x80 : byte);
+    } while (value);
+    return size;
+  }
 
-    using base_state_type = std::unique_ptr<base_state, state_deleter>;
-    base_state_type p_current_state{nullptr}; ///< Pointer to the current state object.
- 
-    std::atomic<bool> lock{false}; ///< Atomic boolean flag to synchronize concurrent operations.
-  
-    /* Atomic lock acquire and release */
+  /**
+   * @brief Reads an unsigned LEB128 encoded integer.
+   *
+   * @param pdata Pointer to char array.
+   * @param datalen Size of the char array.
+   * @param value The decoded integer.
+   * @return Number of bytes read, 0 if the encoding is truncated or too long.
+   */
+  inline std::size_t decode_varint(const char *pdata, std::size_t datalen,
+      std::uint64_t &value) {
+    value = 0;
+    for (std::size_t i = 0; i < datalen && i < varint_max_size; ++i) {
+      std::uint8_t byte = static_cast<std::uint8_t>(pdata[i]);
+      value |= static_cast<std::uint64_t>(byte & 0x7f) << (7 * i);
+      if (!(byte & 0x80)) {
+        return i + 1;
+      }
+    }
+    return 0;
+  }
 
-    void lock_acquire() {
-      while(lock.exchange(true, std::memory_order_acquire)) {
-#if __cplusplus >= 202002L
-        lock.wait(true);
-#endif
+  /**
+   * @brief Writes an unsigned integer of given size in little endian byte
+   * order.
+   *
+   * @param value The integer.
+   * @param size Number of bytes.
+   * @param pdata Pointer to char array of at least `size` bytes.
+   */
+  inline void encode_fixed(std::uint64_t value, std::size_t size, char *pdata) {
+    for (std::size_t i = 0; i < size; ++i) {
+      pdata[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+  }
+
+  /**
+   * @brief Reads an unsigned integer of given size in little endian byte
+   * order.
+   *
+   * @param size Number of bytes.
+   * @param pdata Pointer to char array of at least `size` bytes.
+   * @return The integer.
+   */
+  inline std::uint64_t decode_fixed(std::size_t size, const char *pdata) {
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+      value |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(pdata[i]))
+        << (8 * i);
+    }
+    return value;
+  }
+
+  /* CRC32C checksums */
+
+  /**
+   * @brief Builds the lookup tables of the portable CRC32C implementation.
+   *
+   * Table 0 is the byte-wise table of the reflected Castagnoli polynomial,
+   * table `k` advances a byte by `k` further bytes for slicing by 8.
+   */
+  constexpr std::array<std::array<std::uint32_t, 256>, 8> crc32c_tables() {
+    std::array<std::array<std::uint32_t, 256>, 8> tables{};
+    for (std::uint32_t i = 0; i < 256; ++i) {
+      std::uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78u : 0);
+      }
+      tables[0][i] = crc;
+    }
+    for (std::size_t k = 1; k < 8; ++k) {
+      for (std::size_t i = 0; i < 256; ++i) {
+        std::uint32_t prev = tables[k - 1][i];
+        tables[k][i] = (prev >> 8) ^ tables[0][prev & 0xff];
       }
     }
+    return tables;
+  }
 
-    void lock_release() {
-      lock.store(false, std::memory_order_release);
-#if __cplusplus >= 202002L
-      lock.notify_one();
-#endif
+  /**
+   * @brief Updates a CRC32C register in software, slicing by 8 bytes.
+   *
+   * @param crc The register, inverted.
+   * @param pdata Pointer to char array.
+   * @param datalen Size of the char array.
+   * @return The updated register.
+   */
+  inline std::uint32_t crc32c_portable(std::uint32_t crc, const char *pdata,
+      std::size_t datalen) {
+    static constexpr std::array<std::array<std::uint32_t, 256>, 8> tables =
+      crc32c_tables();
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(pdata);
+
+    for (; datalen >= 8; datalen -= 8, p += 8) {
+      std::uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 |
+          static_cast<std::uint32_t>(p[3]) << 24);
+      crc = tables[7][lo & 0xff] ^ tables[6][(lo >> 8) & 0xff] ^
+        tables[5][(lo >> 16) & 0xff] ^ tables[4][lo >> 24] ^
+        tables[3][p[4]] ^ tables[2][p[5]] ^ tables[1][p[6]] ^
+        tables[0][p[7]];
     }
+    for (; datalen; --datalen, ++p) {
+      crc = (crc >> 8) ^ tables[0][(crc ^ *p) & 0xff];
+    }
+    return crc;
+  }
 
+#if defined(CFSM_HAS_CRC32C_SSE42)
 
-    /* Ensure the given state is valid */
+  /**
+   * @brief Updates a CRC32C register with the SSE4.2 `crc32` instruction.
+   *
+   * @param crc The register, inverted.
+   * @param pdata Pointer to char array.
+   * @param datalen Size of the char array.
+   * @return The updated register.
+   */
+  __attribute__((target("sse4.2")))
+  inline std::uint32_t crc32c_sse42(std::uint32_t crc, const char *pdata,
+      std::size_t datalen) {
+    std::uint64_t crc64 = crc;
+    for (; datalen >= 8; datalen -= 8, pdata += 8) {
+      std::uint64_t word;
+      std::memcpy(&word, pdata, sizeof(word));
+      crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<std::uint32_t>(crc64);
+    for (; datalen; --datalen, ++pdata) {
+      crc = _mm_crc32_u8(crc, static_cast<unsigned char>(*pdata));
+    }
+    return crc;
+  }
 
-#if __cplusplus >= 201402L
+#endif /* CFSM_HAS_CRC32C_SSE42 */
+
+  /**
+   * @brief Computes the CRC32C checksum of a char array.
+   *
+   * Uses the SSE4.2 `crc32` instruction when the CPU supports it and a
+   * table driven implementation otherwise.
+   *
+   * @param pdata Pointer to char array.
+   * @param datalen Size of the char array.
+   * @param crc Checksum of preceding data to continue from.
+   * @return The checksum.
+   */
+  inline std::uint32_t crc32c(const char *pdata, std::size_t datalen,
+      std::uint32_t crc = 0) {
+#if defined(CFSM_HAS_CRC32C_SSE42)
+#if defined(__SSE4_2__)
+    return ~crc32c_sse42(~crc, pdata, datalen);
+#else
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    return has_sse42 ? ~crc32c_sse42(~crc, pdata, datalen) :
+      ~crc32c_portable(~crc, pdata, datalen);
+#endif
+#else
+    return ~crc32c_portable(~crc, pdata, datalen);
+#endif
+  }
+
+  /* Snapshot frames */
+
+  /**
+   * @brief Groups records written to a char array into checksummed frames.
+   *
+   * A frame is the size of its records as a 32 bit integer, up to
+   * `snapshot_frame_records` records and the CRC32C checksum of the size and
+   * the records.
+   */
+  class frame_writer {
+  public:
 
     /**
-     * @brief Checks if a type is derived from a base class.
-     * 
-     * This struct evaluates whether a given type `derived` is derived from the
-     * specified base class `base`.
-     * 
-     * @tparam base The base class to check against.
-     * @tparam derived The type to check if it's derived from `base`.
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @param offset Position of the first frame.
      */
-    template <typename base, typename derived>
-    struct is_base_of_v {
-      /**
-       * @brief The boolean result indicating whether `derived` is derived from
-       * `base`.
-       */
-      static constexpr bool value = std::is_base_of<base, derived>::value;
-    };
-  
+    frame_writer(char *pdata, std::size_t datalen, std::size_t offset)
+      : pdata(pdata), datalen(datalen), offset(offset) {
+    }
+
     /**
-     * @brief Checks if all provided types are derived from the base class.
-     * 
-     * This structure checks if a variadic list of `derived` types are all
-     * derived from the specified base class `base` using conjunction.
-     * 
-     * @tparam base The base class to check against.
-     * @tparam derived The variadic template list of types to check.
+     * @brief Prepares writing a record, starting a frame if none is open.
+     *
+     * @return false if the array is too small.
      */
-    template <typename base, typename... derived>
-    struct are_valid_states {
-      /**
-       * @brief The boolean result indicating whether all `derived` types are
-       * derived from `base`.
-       */
-      static constexpr bool value =
-        conjunction_v<is_base_of_v<base, derived>...>;
-    };
-  
-    /**
-     * @brief Checks if a given type matches any type in the list of valid
-     * states.
+    bool begin_record() {
+      if (!records) {
+        if (datalen - offset < snapshot_frame_overhead) {
+          return false;
+        }
+        frame = offset;
+        offset += sizeof(std::uint32_t);
+      }
+      return true;
+    }
+
+    /// Position where the record is written.
+    char* data() const {
+      return pdata + offset;
+    }
+
+    /// Space left for the record, the checksum of the frame is reserved.
+    std::size_t space() const {
+      return datalen - offset - crc_size;
+    }
+
+    /**
+     * @brief Completes a record, sealing the frame once it is full.
+     *
+     * @param size Size of the record.
+     */
+    void end_record(std::size_t size) {
+      offset += size;
+      if (++records == snapshot_frame_records) {
+        seal();
+      }
+    }
+
+    /**
+     * @brief Seals the open frame, if any.
+     *
+     * @return Position past the last frame.
+     */
+    std::size_t finish() {
+      if (records) {
+        seal();
+      }
+      return offset;
+    }
+
+    /// Checks if no frame is open.
+    bool at_boundary() const {
+      return records == 0;
+    }
+
+    /**
+     * @brief Continues at another position with no frame open.
+     *
+     * @param new_offset The position.
+     */
+    void rewind(std::size_t new_offset) {
+      offset = new_offset;
+    }
+
+  private:
+
+    char *pdata;
+    std::size_t datalen;
+    std::size_t offset;
+    std::size_t frame = 0;
+    std::size_t records = 0;
+
+    void seal() {
+      encode_fixed(offset - frame - sizeof(std::uint32_t),
+          sizeof(std::uint32_t), pdata + frame);
+      encode_fixed(crc32c(pdata + frame, offset - frame), crc_size,
+          pdata + offset);
+      offset += crc_size;
+      records = 0;
+    }
+  };
+
+  /**
+   * @brief Reads records from checksummed frames.
+   *
+   * The checksum of a frame is verified before its first record is read.
+   *
+   * @see frame_writer
+   */
+  class frame_reader {
+  public:
+
+    /**
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @param offset Position of the first frame.
+     */
+    frame_reader(const char *pdata, std::size_t datalen, std::size_t offset)
+      : pdata(pdata), datalen(datalen), offset(offset) {
+    }
+
+    /**
+     * @brief Prepares reading a record, opening the next frame if none is
+     * open.
+     *
+     * @return false if the frame is truncated or its checksum does not
+     * match.
+     */
+    bool begin_record() {
+      if (!open) {
+        std::size_t size = frame_size(pdata, datalen, offset);
+        if (!size ||
+            crc32c(pdata + offset, size - crc_size) != decode_fixed(crc_size,
+              pdata + offset + size - crc_size)) {
+          return false;
+        }
+        frame_end = offset + size - crc_size;
+        offset += sizeof(std::uint32_t);
+        open = true;
+      }
+      return true;
+    }
+
+    /// Position of the record.
+    const char* data() const {
+      return pdata + offset;
+    }
+
+    /// Bytes left in the frame.
+    std::size_t space() const {
+      return frame_end - offset;
+    }
+
+    /**
+     * @brief Completes a record, closing the frame once it is full.
+     *
+     * @param size Size of the record.
+     * @param last Whether this is the last record of the snapshot.
+     * @return false if the frame does not end with its last record.
+     */
+    bool end_record(std::size_t size, bool last) {
+      offset += size;
+      if (++records == snapshot_frame_records || last) {
+        if (offset != frame_end) {
+          return false;
+        }
+        offset += crc_size;
+        records = 0;
+        open = false;
+      }
+      return true;
+    }
+
+    /// Position past the last closed frame.
+    std::size_t position() const {
+      return offset;
+    }
+
+    /**
+     * @brief Returns the size of the frame at a position without verifying
+     * its checksum.
+     *
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @param offset Position of the frame.
+     * @return Size including length prefix and checksum, 0 if truncated.
+     */
+    static
+    std::size_t frame_size(const char *pdata, std::size_t datalen,
+        std::size_t offset) {
+      if (datalen - offset < snapshot_frame_overhead) {
+        return 0;
+      }
+      std::uint64_t size = decode_fixed(sizeof(std::uint32_t), pdata + offset);
+      if (size > datalen - offset - snapshot_frame_overhead) {
+        return 0;
+      }
+      return snapshot_frame_overhead + size;
+    }
+
+  private:
+
+    const char *pdata;
+    std::size_t datalen;
+    std::size_t offset;
+    std::size_t frame_end = 0;
+    std::size_t records = 0;
+    bool open = false;
+  };
+
+  /* Compressed snapshot runs */
+
+  /// Snapshot flag of a run-length and bit-packed encoded snapshot.
+  constexpr std::uint8_t snapshot_flag_compressed = 0x02;
+
+  /// Number of values bit-packed together, a group takes `width` bytes.
+  constexpr std::size_t packed_group_size = 8;
+
+  /// Shortest run of equal values written as a repeated run.
+  constexpr std::size_t repeated_run_min = 8;
+
+  /// Largest number of groups of a bit-packed run.
+  constexpr std::size_t packed_run_max_groups = 64;
+
+  /**
+   * @brief Returns the number of bits needed for values up to a maximum.
+   *
+   * @param max_value The largest value.
+   */
+  constexpr std::size_t packed_width(std::uint64_t max_value) {
+    std::size_t width = 1;
+    while (width < 64 && (max_value >> width)) {
+      ++width;
+    }
+    return width;
+  }
+
+  /**
+   * @brief Bit-packs a group of `packed_group_size` values.
+   *
+   * Value `k` takes bits `k * width` to `(k + 1) * width - 1` of the group in
+   * little endian bit order.
+   *
+   * @param values Pointer to the values, each below `1 << width`.
+   * @param width Number of bits per value, at most 32.
+   * @param pdata Pointer to char array of at least `width` bytes.
+   */
+  template <typename value_type>
+  inline void pack_group(const value_type *values, std::size_t width,
+      char *pdata) {
+    char group[4 * sizeof(std::uint64_t) + sizeof(std::uint64_t)] = {};
+    for (std::size_t k = 0; k < packed_group_size; ++k) {
+      std::size_t bit = k * width;
+      std::uint64_t word = decode_fixed(sizeof(word), group + bit / 8);
+      word |= static_cast<std::uint64_t>(values[k]) << (bit % 8);
+      encode_fixed(word, sizeof(word), group + bit / 8);
+    }
+    std::memcpy(pdata, group, width);
+  }
+
+  /**
+   * @brief Unpacks a group of `packed_group_size` bit-packed values.
+   *
+   * The group is copied to a zero padded buffer first, so every value is
+   * extracted with the same load, shift and mask and the loop has no
+   * branches.
+   *
+   * @param pdata Pointer to char array of at least `width` bytes.
+   * @param width Number of bits per value, at most 32.
+   * @param values Pointer to `packed_group_size` values.
+   * @see pack_group()
+   */
+  template <typename value_type>
+  inline void unpack_group(const char *pdata, std::size_t width,
+      value_type *values) {
+    char group[4 * sizeof(std::uint64_t) + sizeof(std::uint64_t)] = {};
+    std::memcpy(group, pdata, width);
+    const std::uint64_t mask = (std::uint64_t(1) << width) - 1;
+    for (std::size_t k = 0; k < packed_group_size; ++k) {
+      std::size_t bit = k * width;
+      values[k] = static_cast<value_type>(
+          (decode_fixed(sizeof(std::uint64_t), group + bit / 8) >> (bit % 8)) &
+          mask);
+    }
+  }
+
+  /* State payload serialization */
+
+  /**
+   * @brief Trait serializing the data members of a state class into
+   * snapshots.
+   *
+   * Opt-in, without a specialization only the current state is saved. A
+   * specialization for a state class provides
+   *
+   * - `static constexpr std::size_t max_size`, the largest size of the
+   *   serialized data,
+   * - `static std::size_t save(const state_type &state, char *pdata,
+   *   std::size_t datalen)` returning the number of bytes written, 0 on error,
+   * - `static bool load(state_type &state, const char *pdata,
+   *   std::size_t datalen)` restoring the state object from exactly `datalen`
+   *   bytes.
+   *
+   * Only state machines with state objects of their own, `alloc_type::LAZY`
+   * and `alloc_type::INPLACE`, save payloads. Other allocation types share
+   * one state object per class among all state machines.
+   *
+   * @tparam state_type The state class.
+   */
+  template <typename state_type>
+  struct payload;
+
+  /**
+   * @brief Checks if a state class has a payload serialization trait.
+   *
+   * @tparam state_type The state class.
+   */
+  template <typename state_type>
+  struct has_payload
+    : std::integral_constant<
+        bool,
+        is_type_complete_v<payload<state_type>>
+      > {};
+
+  /**
+   * @brief Payload serialization copying the object representation of a
+   * trivially copyable state class.
+   *
+   * @tparam state_type The state class.
+   */
+  template <typename state_type>
+  struct trivial_payload {
+    static_assert(std::is_trivially_copyable<state_type>::value,
+        "State class is not trivially copyable");
+
+    static constexpr std::size_t max_size = sizeof(state_type);
+
+    static std::size_t save(const state_type &state, char *pdata,
+        std::size_t datalen) {
+      if (datalen < sizeof(state_type)) {
+        return 0;
+      }
+      std::memcpy(pdata, &state, sizeof(state_type));
+      return sizeof(state_type);
+    }
+
+    static bool load(state_type &state, const char *pdata,
+        std::size_t datalen) {
+      if (datalen != sizeof(state_type)) {
+        return false;
+      }
+      std::memcpy(&state, pdata, sizeof(state_type));
+      return true;
+    }
+  };
+
+  /**
+   * @brief Helper macro to save the data members of a trivially copyable
+   * state class in snapshots.
+   *
+   * CFSM_PAYLOAD(state);
+   *
+   */
+  #define CFSM_PAYLOAD(state) \
+    template <> \
+    struct cfsm::payload<state> : cfsm::trivial_payload<state> {}
+
+  /* Per-thread shards */
+
+  /**
+   * @brief Per-thread instances of a shard type, walked without locks.
+   *
+   * Every thread lazily obtains its own shard on first use, so writes to it
+   * do not contend with other threads. Shards are linked into a list which
+   * is only ever prepended to and never freed, so readers walk it without
+   * locks, even from a signal handler. The shard of an exited thread is
+   * handed to the next new thread after calling its `reclaim` member
+   * function.
+   *
+   * @tparam shard_type Default constructible type with a `void reclaim()`
+   * member function.
+   */
+  template <typename shard_type>
+  class thread_shards {
+  public:
+
+    /**
+     * @brief Returns the shard of the calling thread.
+     */
+    static
+    shard_type& local() {
+      return owner.claimed->shard;
+    }
+
+    /**
+     * @brief Calls a function for every shard.
+     *
+     * @param fn Callable as `fn(std::size_t number, shard_type &shard)`,
+     * `number` counting the shards in the order they were created.
+     */
+    template <typename fn_type>
+    static
+    void for_each(fn_type &&fn) {
+      for (node *n = nodes.load(std::memory_order_acquire); n; n = n->next) {
+        fn(n->number, n->shard);
+      }
+    }
+
+  private:
+
+    struct node {
+      shard_type shard;
+      std::atomic<bool> taken{true};
+      std::size_t number = 0;
+      node *next = nullptr;
+    };
+
+    /* Takes over the shard of an exited thread or links a new one */
+    struct node_owner {
+      node *claimed = nullptr;
+
+      node_owner() {
+        for (node *n = nodes.load(std::memory_order_acquire); n; n = n->next) {
+          bool taken = false;
+          if (n->taken.compare_exchange_strong(taken, true,
+                std::memory_order_acquire)) {
+            n->shard.reclaim();
+            claimed = n;
+            return;
+          }
+        }
+
+        claimed = new node;
+        claimed->number = node_count.fetch_add(1, std::memory_order_relaxed);
+        claimed->next = nodes.load(std::memory_order_relaxed);
+        while (!nodes.compare_exchange_weak(claimed->next, claimed,
+              std::memory_order_release, std::memory_order_relaxed)) {
+        }
+      }
+
+      ~node_owner() {
+        claimed->taken.store(false, std::memory_order_release);
+      }
+    };
+
+    static inline std::atomic<node*> nodes{nullptr};
+    static inline std::atomic<std::size_t> node_count{0};
+    static inline thread_local node_owner owner;
+  };
+
+  /* Write-ahead transition journal */
+
+  /// Size of a journal record.
+  constexpr std::size_t journal_record_size = 36;
+
+  /// State index of a stopped state machine in journal records.
+  constexpr std::uint32_t journal_stopped = UINT32_MAX;
+
+  /**
+   * @brief Journal record of a state machine transition.
+   *
+   * Encoded as the machine id, the source and target state indices, the
+   * timestamp and the sequence number in little endian byte order, followed
+   * by the CRC32C checksum of these fields.
+   *
+   * The timestamp is wall time, compared with the start time of a snapshot.
+   * Records are ordered by the sequence number, which keeps increasing when
+   * the system clock is set back.
+   */
+  struct journal_record {
+    std::uint64_t machine_id; ///< Position of the state machine in its array.
+    std::uint32_t from; ///< Index of the source state.
+    std::uint32_t to; ///< Index of the target state.
+    std::uint64_t timestamp; ///< Nanoseconds since the system clock epoch.
+    std::uint64_t sequence; ///< Order of the record, see `journal`.
+  };
+
+  /**
+   * @brief Writes a journal record.
+   *
+   * @param rec The record.
+   * @param pdata Pointer to char array of at least `journal_record_size`
+   * bytes.
+   */
+  inline void encode_journal_record(const journal_record &rec, char *pdata) {
+    encode_fixed(rec.machine_id, sizeof(std::uint64_t), pdata);
+    encode_fixed(rec.from, sizeof(std::uint32_t), pdata + 8);
+    encode_fixed(rec.to, sizeof(std::uint32_t), pdata + 12);
+    encode_fixed(rec.timestamp, sizeof(std::uint64_t), pdata + 16);
+    encode_fixed(rec.sequence, sizeof(std::uint64_t), pdata + 24);
+    encode_fixed(crc32c(pdata, 32), crc_size, pdata + 32);
+  }
+
+  /**
+   * @brief Checks the checksum of a journal record.
+   *
+   * @param pdata Pointer to char array of at least `journal_record_size`
+   * bytes.
+   * @return false if the record is corrupted.
+   */
+  inline bool check_journal_record(const char *pdata) {
+    return crc32c(pdata, 32) == decode_fixed(crc_size, pdata + 32);
+  }
+
+  /**
+   * @brief Reads a journal record.
+   *
+   * @param pdata Pointer to char array of at least `journal_record_size`
+   * bytes.
+   * @return The record.
+   */
+  inline journal_record decode_journal_record(const char *pdata) {
+    return journal_record{
+      decode_fixed(sizeof(std::uint64_t), pdata),
+      static_cast<std::uint32_t>(
+          decode_fixed(sizeof(std::uint32_t), pdata + 8)),
+      static_cast<std::uint32_t>(
+          decode_fixed(sizeof(std::uint32_t), pdata + 12)),
+      decode_fixed(sizeof(std::uint64_t), pdata + 16),
+      decode_fixed(sizeof(std::uint64_t), pdata + 24)
+    };
+  }
+
+  /**
+   * @brief Outcome of replaying journal records.
+   */
+  struct replay_result {
+    /// Journal bytes read, up to the first corrupted or partial record.
+    std::size_t bytes = 0;
+    /// Records applied to the state machines.
+    std::size_t applied = 0;
+    /// Records older than the snapshot or already reflected in it.
+    std::size_t skipped = 0;
+    /// Records whose machine id, source or target state did not match.
+    std::size_t mismatched = 0;
+  };
+
+#if __has_include(<sys/uio.h>) && __has_include(<unistd.h>)
+#define CFSM_HAS_JOURNAL 1
+#endif
+
+#ifdef CFSM_HAS_JOURNAL
+
+  /**
+   * @brief Append-only binary journal of state machine transitions.
+   *
+   * Every record holds the machine id, the source and target state indices,
+   * a timestamp and a sequence number, see `journal_record`.
+   * `journal_stopped` stands for the source state of a start and the target
+   * state of a stop. The sequence number is the steady clock in nanoseconds,
+   * offset to the system clock time the journal was started at: it orders
+   * the records of a journal even if the system clock is set back, and those
+   * of successive journals on one file unless the system clock went back
+   * between them.
+   *
+   * Appending copies the record into a batch of the calling thread and does
+   * no I/O. Batches are `thread_shards`, each guarded by a lock only the
+   * flusher competes for, so threads appending to the journal do not
+   * serialize on each other. A flusher thread takes the batches of all
+   * threads when one is full or the fsync interval has elapsed, orders their
+   * records by sequence number without copying them and commits them with
+   * `writev` calls, one iovec per run of records which follow each other in
+   * a batch, and syncs the file descriptor at most once per fsync interval.
+   * Records are durable once `sync` returns true.
+   */
+  class journal {
+  public:
+
+    /**
+     * @brief Starts a journal appending to an open file descriptor.
+     *
+     * @param fd File descriptor opened for writing, owned by the caller.
+     * @param batch_records Number of records in a batch.
+     * @param fsync_interval Largest time between two syncs of pending
+     * records, zero to sync on every commit.
+     */
+    explicit journal(
+        int fd,
+        std::size_t batch_records = 1024,
+        std::chrono::nanoseconds fsync_interval = std::chrono::milliseconds(10)
+    )
+      : fd(fd),
+        batch_size(std::max(batch_records, std::size_t(1)) *
+            journal_record_size),
+        fsync_interval(fsync_interval) {
+      flusher = std::thread([this] { flush_loop(); });
+    }
+
+    journal(const journal&) = delete;
+    journal& operator=(const journal&) = delete;
+
+    /**
+     * @brief Commits and syncs the pending records and stops the flusher
+     * thread.
+     */
+    ~journal() {
+      {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+      }
+      wakeup.notify_one();
+      flusher.join();
+      sync();
+
+      shards::for_each([this](std::size_t, shard &local) {
+        lock_shard(local);
+        local.batches.erase(std::remove_if(local.batches.begin(),
+              local.batches.end(), [this](const batch &b) {
+                return b.journal_id == id;
+              }), local.batches.end());
+        local.lock.store(false, std::memory_order_release);
+      });
+    }
+
+    /**
+     * @brief Returns the current time used for timestamps.
+     *
+     * @return Nanoseconds since the epoch of the system clock.
+     * @see timestamp_now()
+     */
+    static
+    std::uint64_t now() {
+      return timestamp_now();
+    }
+
+    /**
+     * @brief Returns the current sequence number.
+     *
+     * @return Nanoseconds of the steady clock since the journal was started,
+     * plus the system clock time it was started at.
+     */
+    std::uint64_t sequence() const {
+      return started + static_cast<std::uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - steady_started).count());
+    }
+
+    /**
+     * @brief Appends a record to the batch of the calling thread.
+     *
+     * @param machine_id Id of the state machine.
+     * @param from Index of the source state.
+     * @param to Index of the target state.
+     */
+    void append(std::uint64_t machine_id, std::uint32_t from,
+        std::uint32_t to) {
+      char data[journal_record_size];
+      encode_journal_record({machine_id, from, to, now(), sequence()}, data);
+
+      shard &local = shards::local();
+      lock_shard(local);
+      std::vector<char> &records = local.records_of(id);
+      records.insert(records.end(), data, data + journal_record_size);
+      bool full = records.size() >= batch_size;
+      local.lock.store(false, std::memory_order_release);
+
+      if (full && !flush_requested.exchange(true, std::memory_order_relaxed)) {
+        wakeup.notify_one();
+      }
+    }
+
+    /**
+     * @brief Writes the pending records to the file descriptor.
+     *
+     * Syncs the file descriptor if the fsync interval has elapsed since the
+     * last sync.
+     *
+     * @return false if writing or syncing failed.
+     */
+    bool commit() {
+      return write_pending(false);
+    }
+
+    /**
+     * @brief Writes the pending records and syncs the file descriptor.
+     *
+     * @return false if writing or syncing failed.
+     */
+    bool sync() {
+      return write_pending(true);
+    }
+
+    /**
+     * @brief Checks if writing or syncing has failed.
+     */
+    bool failed() const {
+      return error.load(std::memory_order_relaxed);
+    }
+
+  private:
+
+    /* Pending records of one journal appended by one thread */
+    struct batch {
+      std::uint64_t journal_id;
+      std::vector<char> records;
+    };
+
+    /* Batches of a thread, one per journal it appended to */
+    struct shard {
+      std::atomic<bool> lock{false}; ///< Held to append or take batches.
+      std::vector<batch> batches;
+
+      std::vector<char>& records_of(std::uint64_t journal_id) {
+        for (batch &b : batches) {
+          if (b.journal_id == journal_id) {
+            return b.records;
+          }
+        }
+        batches.push_back({journal_id, {}});
+        return batches.back().records;
+      }
+
+      /* Pending records of an exited thread are taken by the next flush */
+      void reclaim() {
+      }
+    };
+
+    using shards = thread_shards<shard>;
+
+    static inline std::atomic<std::uint64_t> next_id{0};
+
+    std::uint64_t id = next_id.fetch_add(1, std::memory_order_relaxed);
+    std::uint64_t started = timestamp_now();
+    std::chrono::steady_clock::time_point steady_started =
+      std::chrono::steady_clock::now();
+    int fd;
+    std::size_t batch_size;
+    std::chrono::nanoseconds fsync_interval;
+
+    std::mutex mutex; ///< Guards `stopping` for the flusher wakeup.
+    std::condition_variable wakeup;
+    bool stopping = false;
+    std::atomic<bool> flush_requested{false};
+
+    std::mutex write_mutex; ///< Serializes commits.
+    std::vector<std::vector<char>> spare; ///< Taken batches for reuse.
+    std::vector<struct iovec> runs; ///< Records of a commit in order.
+    std::chrono::steady_clock::time_point last_sync =
+      std::chrono::steady_clock::now();
+    bool unsynced = false; ///< Records written since the last sync.
+    std::atomic<bool> error{false};
+
+    std::thread flusher;
+
+    static void lock_shard(shard &local) {
+      while (local.lock.exchange(true, std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+    }
+
+    void flush_loop() {
+      std::unique_lock<std::mutex> guard(mutex);
+      while (!stopping) {
+        wakeup.wait_for(guard, fsync_interval.count() ?
+            fsync_interval : std::chrono::milliseconds(1),
+            [this] {
+              return stopping ||
+                flush_requested.load(std::memory_order_relaxed);
+            });
+        guard.unlock();
+        commit();
+        guard.lock();
+      }
+    }
+
+    /* Swaps the pending batches of every thread for spare ones, called with
+     * the write mutex held */
+    std::vector<std::vector<char>> take_batches() {
+      std::vector<std::vector<char>> taken;
+      shards::for_each([&](std::size_t, shard &local) {
+        std::vector<char> fresh;
+        if (!spare.empty()) {
+          fresh = std::move(spare.back());
+          spare.pop_back();
+          fresh.clear();
+        }
+
+        lock_shard(local);
+        for (batch &b : local.batches) {
+          if (b.journal_id == id && !b.records.empty()) {
+            b.records.swap(fresh);
+            break;
+          }
+        }
+        local.lock.store(false, std::memory_order_release);
+
+        if (fresh.empty()) {
+          spare.push_back(std::move(fresh));
+        } else {
+          taken.push_back(std::move(fresh));
+        }
+      });
+      return taken;
+    }
+
+    /* Orders the records of the taken batches by sequence number into runs
+     * of records which follow each other in a batch, the records of each
+     * batch are in order already */
+    void merge(const std::vector<std::vector<char>> &taken) {
+      std::vector<std::pair<std::uint64_t, const char*>> order;
+      for (const std::vector<char> &records : taken) {
+        for (std::size_t offset = 0; offset < records.size();
+            offset += journal_record_size) {
+          const char *rec = records.data() + offset;
+          order.emplace_back(decode_fixed(sizeof(std::uint64_t), rec + 24),
+              rec);
+        }
+      }
+      std::stable_sort(order.begin(), order.end(),
+          [](const auto &a, const auto &b) { return a.first < b.first; });
+
+      runs.clear();
+      for (const auto &entry : order) {
+        char *rec = const_cast<char*>(entry.second);
+        if (!runs.empty() && static_cast<char*>(runs.back().iov_base) +
+            runs.back().iov_len == rec) {
+          runs.back().iov_len += journal_record_size;
+        } else {
+          runs.push_back({rec, journal_record_size});
+        }
+      }
+    }
+
+    bool write_pending(bool force_sync) {
+      std::lock_guard<std::mutex> write_guard(write_mutex);
+      flush_requested.store(false, std::memory_order_relaxed);
+
+      std::vector<std::vector<char>> taken = take_batches();
+      bool ok = true;
+      if (!taken.empty()) {
+        merge(taken);
+        ok = write_all();
+        unsynced = true;
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      if (ok && unsynced &&
+          (force_sync || now - last_sync >= fsync_interval)) {
+#if defined(__linux__)
+        ok = ::fdatasync(fd) == 0;
+#else
+        ok = ::fsync(fd) == 0;
+#endif
+        unsynced = !ok;
+        last_sync = now;
+      }
+
+      for (auto &records : taken) {
+        spare.push_back(std::move(records));
+      }
+
+      if (!ok) {
+        error.store(true, std::memory_order_relaxed);
+      }
+      return ok;
+    }
+
+#ifdef IOV_MAX
+    static constexpr std::size_t iov_limit = IOV_MAX;
+#else
+    static constexpr std::size_t iov_limit = 1024;
+#endif
+
+    /* Writes the runs with writev, at most `iov_limit` at a time, resuming
+     * partial writes */
+    bool write_all() {
+      std::size_t first = 0;
+      while (first < runs.size()) {
+        int iovcnt = static_cast<int>(std::min(runs.size() - first,
+              iov_limit));
+        ssize_t written = ::writev(fd, runs.data() + first, iovcnt);
+        if (written < 0 && errno == EINTR) {
+          continue;
+        }
+        if (written <= 0) {
+          return false;
+        }
+        std::size_t left = static_cast<std::size_t>(written);
+        while (left && left >= runs[first].iov_len) {
+          left -= runs[first].iov_len;
+          ++first;
+        }
+        if (left) {
+          runs[first].iov_base = static_cast<char*>(runs[first].iov_base) +
+            left;
+          runs[first].iov_len -= left;
+        }
+      }
+      return true;
+    }
+  };
+
+#endif /* CFSM_HAS_JOURNAL */
+
+  /* Timestamp counter */
+
+  /**
+   * @brief Reads the CPU timestamp counter.
+   *
+   * Uses `rdtsc` on x86, falls back to a steady clock in nanoseconds
+   * elsewhere. Values are only comparable within one machine.
+   *
+   * @return The counter.
+   */
+  inline std::uint64_t read_tsc() {
+#ifdef CFSM_HAS_RDTSC
+    return __rdtsc();
+#else
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+  }
+
+#ifdef CFSM_FLIGHT_RECORDER
+
+  /* Flight recorder */
+
+#ifndef CFSM_FLIGHT_RECORDER_SIZE
+  /// Number of transitions kept per thread, a power of two.
+#define CFSM_FLIGHT_RECORDER_SIZE 1024
+#endif
+
+  /**
+   * @brief Transition kept by the flight recorder.
+   */
+  struct flight_record {
+    const void *machine; ///< Address of the state machine.
+    std::uint64_t tsc; ///< Timestamp counter, see `read_tsc`.
+    std::uint32_t from; ///< Index of the source state.
+    /// Index of the state the state machine came to rest in, after the
+    /// completion transitions of the target state.
+    std::uint32_t to;
+  };
+
+  /**
+   * @brief Per-thread rings of the most recent transitions.
+   *
+   * Enabled by defining `CFSM_FLIGHT_RECORDER` before including this header.
+   * Every thread writes the starts, transitions, `go_to` hops and stops it
+   * performs into its own ring of `CFSM_FLIGHT_RECORDER_SIZE` records, with
+   * no locks and no shared cache lines. `journal_stopped` stands for the
+   * source state of a start and the target state of a stop.
+   *
+   * Rings are `thread_shards`, so they can be walked from a signal handler.
+   * The ring of an exited thread keeps its records until another thread
+   * takes it over.
+   */
+  class flight_recorder {
+  public:
+
+    static_assert((CFSM_FLIGHT_RECORDER_SIZE &
+          (CFSM_FLIGHT_RECORDER_SIZE - 1)) == 0,
+        "CFSM_FLIGHT_RECORDER_SIZE shall be a power of two");
+
+    /// Number of records kept per thread.
+    static constexpr std::size_t ring_size = CFSM_FLIGHT_RECORDER_SIZE;
+
+    /**
+     * @brief Records a transition of the calling thread.
+     *
+     * @param machine Address of the state machine.
+     * @param from Index of the source state.
+     * @param to Index of the target state.
+     */
+    static
+    void record(const void *machine, std::uint32_t from, std::uint32_t to) {
+      ring &r = rings::local();
+      std::uint64_t head = r.head.load(std::memory_order_relaxed);
+      r.records[head & (ring_size - 1)] = {machine, read_tsc(), from, to};
+      r.head.store(head + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Calls a function for every kept record, oldest first per
+     * thread.
+     *
+     * Does not allocate or lock. Records written concurrently by their
+     * thread may be seen torn.
+     *
+     * @param fn Callable as `fn(std::size_t thread, const flight_record&)`,
+     * `thread` numbering the rings in the order they were created.
+     */
+    template <typename fn_type>
+    static
+    void for_each(fn_type &&fn) {
+      rings::for_each([&fn](std::size_t number, ring &r) {
+        std::uint64_t head = r.head.load(std::memory_order_acquire);
+        std::uint64_t first = head > ring_size ? head - ring_size : 0;
+        for (std::uint64_t i = first; i < head; ++i) {
+          fn(number, r.records[i & (ring_size - 1)]);
+        }
+      });
+    }
+
+    /**
+     * @brief Discards the kept records of all threads.
+     *
+     * Shall not be called while transitions are in progress.
+     */
+    static
+    void clear() {
+      rings::for_each([](std::size_t, ring &r) {
+        r.reclaim();
+      });
+    }
+
+#if __has_include(<unistd.h>)
+
+    /**
+     * @brief Writes the kept records as text lines to a file descriptor.
+     *
+     * One line per record, `thread <n> machine 0x<address> from <index> to
+     * <index> tsc <counter>`, with `-` for `journal_stopped`. Uses only
+     * `write` and no allocation, so it can be called from a signal or crash
+     * handler.
+     *
+     * @param fd File descriptor opened for writing.
+     * @return false if writing failed.
+     */
+    static
+    bool dump(int fd) {
+      bool ok = true;
+      for_each([fd, &ok](std::size_t thread, const flight_record &rec) {
+        char line[128];
+        std::size_t size = 0;
+        auto text = [&](const char *str) {
+          while (*str) {
+            line[size++] = *str++;
+          }
+        };
+        auto number = [&](std::uint64_t value, unsigned base) {
+          char digits[20];
+          std::size_t count = 0;
+          do {
+            digits[count++] = "0123456789abcdef"[value % base];
+            value /= base;
+          } while (value);
+          while (count) {
+            line[size++] = digits[--count];
+          }
+        };
+        auto index = [&](std::uint32_t value) {
+          if (value == journal_stopped) {
+            text("-");
+          } else {
+            number(value, 10);
+          }
+        };
+
+        text("thread ");
+        number(thread, 10);
+        text(" machine 0x");
+        number(reinterpret_cast<std::uintptr_t>(rec.machine), 16);
+        text(" from ");
+        index(rec.from);
+        text(" to ");
+        index(rec.to);
+        text(" tsc ");
+        number(rec.tsc, 10);
+        text("\n");
+
+        for (std::size_t offset = 0; ok && offset < size;) {
+          ssize_t written = ::write(fd, line + offset, size - offset);
+          if (written < 0 && errno == EINTR) {
+            continue;
+          }
+          ok = written > 0;
+          offset += ok ? static_cast<std::size_t>(written) : 0;
+        }
+      });
+      return ok;
+    }
+
+#endif /* __has_include(<unistd.h>) */
+
+  private:
+
+    struct ring {
+      std::atomic<std::uint64_t> head{0};
+      flight_record records[ring_size];
+
+      /* A thread taking over the ring starts afresh */
+      void reclaim() {
+        head.store(0, std::memory_order_release);
+      }
+    };
+
+    using rings = thread_shards<ring>;
+  };
+
+#endif /* CFSM_FLIGHT_RECORDER */
+
+#ifdef CFSM_STATS
+
+  /* Transition statistics */
+
+  /**
+   * @brief Aggregated transition counts of a state machine class.
+   *
+   * @tparam state_count Number of states.
+   */
+  template <std::size_t state_count>
+  struct transition_counts {
+    /// Transitions by source and target state index, including `go_to` and
+    /// completion hops.
+    std::array<std::array<std::uint64_t, state_count>, state_count>
+      transitions{};
+    /// Entries into a state by start, transition or completion transition.
+    std::array<std::uint64_t, state_count> entries{};
+    /// Starts in a state.
+    std::array<std::uint64_t, state_count> starts{};
+    /// Stops from a state.
+    std::array<std::uint64_t, state_count> stops{};
+  };
+
+  /**
+   * @brief Per-thread transition counters of a state machine class.
+   *
+   * Enabled by defining `CFSM_STATS` before including this header. Every
+   * thread counts the starts, transitions, completion transitions, `go_to`
+   * hops and stops it performs in its own matrix indexed by source and target
+   * state, with the stopped state as an extra row and column. A count is a
+   * relaxed load and store of a counter no other thread writes, so threads do
+   * not contend. The matrices are summed only when read.
+   *
+   * Matrices are `thread_shards`. The matrix of an exited thread keeps its
+   * counts and is taken over by the next new thread.
+   *
+   * @tparam fsm_type The state machine class.
+   */
+  template <typename fsm_type>
+  class stats {
+  public:
+
+    /// Number of states of the state machine class.
+    static constexpr std::size_t state_count = fsm_type::state_total;
+
+    using snapshot_type = transition_counts<state_count>;
+
+    /**
+     * @brief Counts a transition of the calling thread.
+     *
+     * @param from Index of the source state, `journal_stopped` for a start.
+     * @param to Index of the target state, `journal_stopped` for a stop.
+     */
+    static
+    void count(std::uint32_t from, std::uint32_t to) {
+      std::atomic<std::uint64_t> &counter =
+        matrices::local().counters[slot(from)][slot(to)];
+      counter.store(counter.load(std::memory_order_relaxed) + 1,
+          std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Sums the counters of all threads.
+     *
+     * Counts made concurrently may or may not be included. The counts grow
+     * with the square of the number of states, so they are written to a
+     * buffer of the caller, which may live on the heap, instead of being
+     * returned.
+     *
+     * @param counts Buffer for the counts, zeroed first.
+     */
+    static
+    void snapshot(snapshot_type &counts) {
+      for (auto &row : counts.transitions) {
+        row.fill(0);
+      }
+      counts.entries.fill(0);
+      counts.starts.fill(0);
+      counts.stops.fill(0);
+      matrices::for_each([&counts](std::size_t, matrix &m) {
+        for (std::size_t from = 0; from <= state_count; ++from) {
+          for (std::size_t to = 0; to <= state_count; ++to) {
+            std::uint64_t value =
+              m.counters[from][to].load(std::memory_order_relaxed);
+            if (from && to) {
+              counts.transitions[from - 1][to - 1] += value;
+            } else if (to) {
+              counts.starts[to - 1] += value;
+            } else if (from) {
+              counts.stops[from - 1] += value;
+            }
+            if (to) {
+              counts.entries[to - 1] += value;
+            }
+          }
+        }
+      });
+    }
+
+    /**
+     * @brief Zeroes the counters of all threads.
+     *
+     * Shall not be called while transitions are in progress.
+     */
+    static
+    void reset() {
+      matrices::for_each([](std::size_t, matrix &m) {
+        for (auto &row : m.counters) {
+          for (auto &counter : row) {
+            counter.store(0, std::memory_order_relaxed);
+          }
+        }
+      });
+    }
+
+  private:
+
+    struct matrix {
+      std::atomic<std::uint64_t> counters[state_count + 1][state_count + 1] =
+        {};
+
+      /* Counts of an exited thread are kept */
+      void reclaim() {
+      }
+    };
+
+    using matrices = thread_shards<matrix>;
+
+    /* Row or column of a state index, 0 for the stopped state */
+    static
+    std::size_t slot(std::uint32_t index) {
+      return index == journal_stopped ? 0 : index + 1;
+    }
+  };
+
+#endif /* CFSM_STATS */
+
+#ifdef CFSM_LATENCY
+
+  /* Transition latency */
+
+  /**
+   * @brief Log-bucketed histogram of timestamp counter differences.
+   *
+   * Values below `sub_buckets` have a bucket each, larger values share a
+   * bucket with values of the same power of two and the same next three
+   * bits, so the relative error of a percentile is below 12.5%.
+   */
+  class latency_histogram {
+  public:
+
+    /// Buckets per power of two.
+    static constexpr std::size_t sub_buckets = 8;
+
+    /// Number of buckets covering 64 bit values.
+    static constexpr std::size_t bucket_count = sub_buckets * (64 - 2);
+
+    /**
+     * @brief Returns the bucket of a value.
+     *
+     * @param value The value.
+     */
+    static
+    std::size_t bucket(std::uint64_t value) {
+      if (value < sub_buckets) {
+        return static_cast<std::size_t>(value);
+      }
+#if defined(__GNUC__) || defined(__clang__)
+      std::size_t exponent = 63 - static_cast<std::size_t>(
+          __builtin_clzll(value));
+#else
+      std::size_t exponent = packed_width(value) - 1;
+#endif
+      return sub_buckets * (exponent - 2) +
+        static_cast<std::size_t>((value >> (exponent - 3)) & (sub_buckets - 1));
+    }
+
+    /**
+     * @brief Returns the largest value of a bucket.
+     *
+     * @param index The bucket.
+     */
+    static
+    std::uint64_t bucket_max(std::size_t index) {
+      if (index < sub_buckets) {
+        return index;
+      }
+      std::size_t shift = index / sub_buckets - 1;
+      std::uint64_t lowest =
+        static_cast<std::uint64_t>(sub_buckets + index % sub_buckets) << shift;
+      return lowest + ((std::uint64_t(1) << shift) - 1);
+    }
+
+    /**
+     * @brief Adds a value.
+     *
+     * @param value The value.
+     */
+    void record(std::uint64_t value) {
+      ++counts[bucket(value)];
+    }
+
+    /// Number of values.
+    std::uint64_t count() const {
+      std::uint64_t total = 0;
+      for (std::uint64_t n : counts) {
+        total += n;
+      }
+      return total;
+    }
+
+    /**
+     * @brief Returns a percentile.
+     *
+     * @param fraction The percentile as a fraction, 0.99 for p99.
+     * @return Largest value of the bucket holding the percentile, 0 without
+     * values.
+     */
+    std::uint64_t percentile(double fraction) const {
+      std::uint64_t total = count();
+      if (!total) {
+        return 0;
+      }
+      /* Rank of the percentile value, rounded up */
+      double wanted = fraction * static_cast<double>(total);
+      std::uint64_t rank = static_cast<std::uint64_t>(wanted);
+      if (static_cast<double>(rank) < wanted || !rank) {
+        ++rank;
+      }
+      std::uint64_t seen = 0;
+      for (std::size_t i = 0; i < bucket_count; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+          return bucket_max(i);
+        }
+      }
+      return bucket_max(bucket_count - 1);
+    }
+
+    /// Values per bucket.
+    std::array<std::uint64_t, bucket_count> counts{};
+  };
+
+  /**
+   * @brief Phase of a transition timed by `latency`.
+   */
+  enum class latency_phase {
+    lock_wait,  ///< Acquiring the state machine lock
+    on_exit,    ///< Exit action of the source state
+    functor,    ///< Transition functor
+    on_enter,   ///< Entry action of the target state
+    total,      ///< From calling `transition` until it returns
+    count       ///< Number of phases
+  };
+
+  /**
+   * @brief Point of a transition where the timestamp counter is read.
+   */
+  enum class latency_mark {
+    began,
+    locked,
+    exiting,
+    exited,
+    called,
+    entering,
+    entered,
+    count
+  };
+
+  /**
+   * @brief Per-thread latency histograms of the transitions of a state
+   * machine class.
+   *
+   * Enabled by defining `CFSM_LATENCY` before including this header.
+   * `transition` reads the timestamp counter, see `read_tsc`, around
+   * acquiring the lock, the exit action, the transition functor and the
+   * entry action and adds the differences to histograms of the calling
+   * thread, so recording does not contend. The entry action is accounted to
+   * the target state, the other phases to the source state. Completion
+   * transitions set off by the target state are timed only in the total.
+   * Histograms take about 20 KB per state and thread and are summed only
+   * when read.
+   *
+   * @tparam fsm_type The state machine class.
+   */
+  template <typename fsm_type>
+  class latency {
+  public:
+
+    /// Number of states of the state machine class.
+    static constexpr std::size_t state_count = fsm_type::state_total;
+
+    /**
+     * @brief Reads the timestamp counter at a point of the current
+     * transition of the calling thread.
+     *
+     * @param point The point.
+     */
+    static
+    void mark(latency_mark point) {
+      shards::local().marks[static_cast<std::size_t>(point)] = read_tsc();
+    }
+
+    /**
+     * @brief Records the phases of the current transition of the calling
+     * thread, which has just returned.
+     *
+     * @param from Index of the source state.
+     * @param to Index of the target state.
+     */
+    static
+    void commit(std::size_t from, std::size_t to) {
+      std::uint64_t done = read_tsc();
+      shard &local = shards::local();
+      auto at = [&local](latency_mark point) {
+        return local.marks[static_cast<std::size_t>(point)];
+      };
+
+      local.add(from, latency_phase::lock_wait,
+          at(latency_mark::locked) - at(latency_mark::began));
+      local.add(from, latency_phase::on_exit,
+          at(latency_mark::exited) - at(latency_mark::exiting));
+      local.add(from, latency_phase::functor,
+          at(latency_mark::called) - at(latency_mark::exited));
+      local.add(to, latency_phase::on_enter,
+          at(latency_mark::entered) - at(latency_mark::entering));
+      local.add(from, latency_phase::total, done - at(latency_mark::began));
+    }
+
+    /**
+     * @brief Sums the histograms of all threads for a phase and a state.
+     *
+     * @param phase The phase.
+     * @param index Index of the state, the target state for
+     * `latency_phase::on_enter` and the source state otherwise.
+     * @return The histogram, empty if the index is out of range.
+     */
+    static
+    latency_histogram histogram(latency_phase phase, std::size_t index) {
+      latency_histogram sum;
+      if (index >= state_count || phase >= latency_phase::count) {
+        return sum;
+      }
+      shards::for_each([&](std::size_t, shard &s) {
+        const auto &counts = s.counts[index][static_cast<std::size_t>(phase)];
+        for (std::size_t i = 0; i < latency_histogram::bucket_count; ++i) {
+          sum.counts[i] += counts[i].load(std::memory_order_relaxed);
+        }
+      });
+      return sum;
+    }
+
+    /**
+     * @brief Returns a percentile of a phase for a state over all threads.
+     *
+     * @param phase The phase.
+     * @param index Index of the state, see `histogram`.
+     * @param fraction The percentile as a fraction, 0.999 for p999.
+     * @return Timestamp counter difference, 0 without values.
+     */
+    static
+    std::uint64_t percentile(latency_phase phase, std::size_t index,
+        double fraction) {
+      return histogram(phase, index).percentile(fraction);
+    }
+
+    /**
+     * @brief Empties the histograms of all threads.
+     *
+     * Shall not be called while transitions are in progress.
+     */
+    static
+    void reset() {
+      shards::for_each([](std::size_t, shard &s) {
+        for (auto &phases : s.counts) {
+          for (auto &counts : phases) {
+            for (auto &n : counts) {
+              n.store(0, std::memory_order_relaxed);
+            }
+          }
+        }
+      });
+    }
+
+  private:
+
+    static constexpr std::size_t phase_count =
+      static_cast<std::size_t>(latency_phase::count);
+
+    struct shard {
+      std::atomic<std::uint64_t>
+        counts[state_count][phase_count][latency_histogram::bucket_count] = {};
+      std::uint64_t marks[static_cast<std::size_t>(latency_mark::count)] = {};
+
+      void add(std::size_t index, latency_phase phase, std::uint64_t cycles) {
+        std::atomic<std::uint64_t> &n = counts[index]
+          [static_cast<std::size_t>(phase)][latency_histogram::bucket(cycles)];
+        n.store(n.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+      }
+
+      /* Histograms of an exited thread are kept */
+      void reclaim() {
+      }
+    };
+
+    using shards = thread_shards<shard>;
+  };
+
+#endif /* CFSM_LATENCY */
+
+#if defined(CFSM_LOCK_STATS_PER_MACHINE) && !defined(CFSM_LOCK_STATS)
+#define CFSM_LOCK_STATS 1
+#endif
+
+#ifdef CFSM_LOCK_STATS
+
+  /* Lock contention */
+
+  /**
+   * @brief Lock contention counts of a state machine or a state machine
+   * class.
+   */
+  struct lock_counts {
+    std::uint64_t acquisitions = 0; ///< Times the lock was acquired.
+    std::uint64_t contended = 0; ///< Acquisitions which found the lock held.
+    /// Failed attempts to take the lock before C++20, each retried at once.
+    std::uint64_t spins = 0;
+    /// Failed attempts to take the lock from C++20, each followed by a call
+    /// of `atomic::wait`, which may return without blocking.
+    std::uint64_t parks = 0;
+    std::uint64_t wait_cycles = 0; ///< Timestamp counter cycles waited.
+  };
+
+  /**
+   * @brief Per-thread lock contention counters of a state machine class.
+   *
+   * Enabled by defining `CFSM_LOCK_STATS` before including this header.
+   * Every lock acquisition of a state machine is counted by the acquiring
+   * thread in its own counters, which are summed only when read. An
+   * uncontended acquisition costs one increment, a contended one also reads
+   * the timestamp counter before and after waiting. Failed attempts are
+   * counted as spins before C++20 and as parks from C++20, where every one
+   * waits in `atomic::wait`, so only one of the two is ever nonzero. Whether
+   * a wait blocked the thread is not known. Defining
+   * `CFSM_LOCK_STATS_PER_MACHINE` also keeps the counts in every state
+   * machine, see `state_machine::lock_contention`.
+   *
+   * @tparam fsm_type The state machine class.
+   */
+  template <typename fsm_type>
+  class lock_stats {
+  public:
+
+    /**
+     * @brief Counts a lock acquisition of the calling thread.
+     *
+     * @param waited Contention of the acquisition, zero if uncontended.
+     */
+    static
+    void count(const lock_counts &waited) {
+      shard &local = shards::local();
+      add(local.acquisitions, 1);
+      if (waited.spins || waited.parks) {
+        add(local.contended, 1);
+        add(local.spins, waited.spins);
+        add(local.parks, waited.parks);
+        add(local.wait_cycles, waited.wait_cycles);
+      }
+    }
+
+    /**
+     * @brief Sums the counters of all threads.
+     *
+     * @return The counts.
+     */
+    static
+    lock_counts snapshot() {
+      lock_counts counts;
+      shards::for_each([&counts](std::size_t, shard &s) {
+        counts.acquisitions += s.acquisitions.load(std::memory_order_relaxed);
+        counts.contended += s.contended.load(std::memory_order_relaxed);
+        counts.spins += s.spins.load(std::memory_order_relaxed);
+        counts.parks += s.parks.load(std::memory_order_relaxed);
+        counts.wait_cycles += s.wait_cycles.load(std::memory_order_relaxed);
+      });
+      return counts;
+    }
+
+    /**
+     * @brief Zeroes the counters of all threads.
+     *
+     * Shall not be called while state machines are in use.
+     */
+    static
+    void reset() {
+      shards::for_each([](std::size_t, shard &s) {
+        s.acquisitions.store(0, std::memory_order_relaxed);
+        s.contended.store(0, std::memory_order_relaxed);
+        s.spins.store(0, std::memory_order_relaxed);
+        s.parks.store(0, std::memory_order_relaxed);
+        s.wait_cycles.store(0, std::memory_order_relaxed);
+      });
+    }
+
+  private:
+
+    struct shard {
+      std::atomic<std::uint64_t> acquisitions{0};
+      std::atomic<std::uint64_t> contended{0};
+      std::atomic<std::uint64_t> spins{0};
+      std::atomic<std::uint64_t> parks{0};
+      std::atomic<std::uint64_t> wait_cycles{0};
+
+      /* Counts of an exited thread are kept */
+      void reclaim() {
+      }
+    };
+
+    using shards = thread_shards<shard>;
+
+    static
+    void add(std::atomic<std::uint64_t> &counter, std::uint64_t value) {
+      counter.store(counter.load(std::memory_order_relaxed) + value,
+          std::memory_order_relaxed);
+    }
+  };
+
+#endif /* CFSM_LOCK_STATS */
+
+#ifdef CFSM_TRACE
+
+  /* Trace export */
+
+#ifndef CFSM_TRACE_EVENTS
+  /// Number of trace events buffered per thread.
+#define CFSM_TRACE_EVENTS 65536
+#endif
+
+  /**
+   * @brief Start, transition or stop buffered by `trace`.
+   */
+  struct trace_event {
+    const void *machine; ///< Address of the state machine.
+    const std::string_view *names; ///< State names of its class.
+    std::uint64_t begin; ///< Nanoseconds when the call began, see `trace::now`.
+    std::uint64_t end; ///< Nanoseconds when the call returned.
+    std::uint32_t from; ///< Index of the source state.
+    /// Index of the state the state machine came to rest in, after the
+    /// completion transitions of the target state.
+    std::uint32_t to;
+  };
+
+  /**
+   * @brief In-memory trace of starts, transitions and stops, exported as
+   * Chrome Trace Event JSON.
+   *
+   * Enabled by defining `CFSM_TRACE` before including this header. Every
+   * thread appends the successful starts, transitions and stops it performs
+   * to its own buffer of `CFSM_TRACE_EVENTS` events, allocated on its first
+   * event. Events past the capacity are dropped and counted. `write` emits
+   * one complete event per call, named after the states and carrying the
+   * machine address and the state indices, which chrome://tracing and
+   * Perfetto display per thread.
+   */
+  class trace {
+  public:
+
+    /// Number of events buffered per thread.
+    static constexpr std::size_t capacity = CFSM_TRACE_EVENTS;
+
+    /**
+     * @brief Returns the steady clock in nanoseconds.
+     */
+    static
+    std::uint64_t now() {
+      return static_cast<std::uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    /**
+     * @brief Buffers an event of the calling thread.
+     *
+     * @param event The event, `journal_stopped` standing for the source
+     * state of a start and the target state of a stop.
+     */
+    static
+    void record(const trace_event &event) {
+      buffer &local = buffers::local();
+      std::size_t size = local.size.load(std::memory_order_relaxed);
+      if (size == capacity) {
+        local.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      local.events[size] = event;
+      local.size.store(size + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Returns the number of events dropped by full buffers.
+     */
+    static
+    std::uint64_t dropped() {
+      std::uint64_t count = 0;
+      buffers::for_each([&count](std::size_t, buffer &b) {
+        count += b.dropped.load(std::memory_order_relaxed);
+      });
+      return count;
+    }
+
+    /**
+     * @brief Discards the buffered events of all threads.
+     *
+     * Shall not be called while state machines are in use.
+     */
+    static
+    void clear() {
+      buffers::for_each([](std::size_t, buffer &b) {
+        b.size.store(0, std::memory_order_release);
+        b.dropped.store(0, std::memory_order_relaxed);
+      });
+    }
+
+    /**
+     * @brief Writes the buffered events as Chrome Trace Event JSON.
+     *
+     * Events buffered concurrently may or may not be included.
+     *
+     * @param out The output stream.
+     */
+    static
+    void write(std::ostream &out) {
+      out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+      bool first = true;
+      buffers::for_each([&](std::size_t thread, buffer &b) {
+        std::size_t size = b.size.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < size; ++i) {
+          const trace_event &event = b.events[i];
+          out << (first ? "\n" : ",\n") << "{\"name\":\"";
+          first = false;
+          if (event.from == journal_stopped) {
+            out << "start ";
+            write_escaped(out, event.names[event.to]);
+          } else if (event.to == journal_stopped) {
+            out << "stop ";
+            write_escaped(out, event.names[event.from]);
+          } else {
+            write_escaped(out, event.names[event.from]);
+            out << " -> ";
+            write_escaped(out, event.names[event.to]);
+          }
+          out << "\",\"cat\":\"cfsm\",\"ph\":\"X\",\"pid\":" << pid()
+            << ",\"tid\":" << thread << ",\"ts\":";
+          write_micros(out, event.begin);
+          out << ",\"dur\":";
+          write_micros(out, event.end - event.begin);
+          out << ",\"args\":{\"machine\":\"" << event.machine << '"';
+          if (event.from != journal_stopped) {
+            out << ",\"from\":" << event.from;
+          }
+          if (event.to != journal_stopped) {
+            out << ",\"to\":" << event.to;
+          }
+          out << "}}";
+        }
+      });
+      out << "\n]}\n";
+    }
+
+    /**
+     * @brief Writes the buffered events as Chrome Trace Event JSON to a
+     * file.
+     *
+     * @param path Path of the file, replaced if it exists.
+     * @return false if the file could not be written.
+     */
+    static
+    bool save(const char *path) {
+      std::ofstream out(path, std::ios::out | std::ios::trunc);
+      write(out);
+      out.flush();
+      return static_cast<bool>(out);
+    }
+
+  private:
+
+    struct buffer {
+      std::unique_ptr<trace_event[]> events{new trace_event[capacity]};
+      std::atomic<std::size_t> size{0};
+      std::atomic<std::uint64_t> dropped{0};
+
+      /* Events of an exited thread are kept */
+      void reclaim() {
+      }
+    };
+
+    using buffers = thread_shards<buffer>;
+
+    static
+    void write_escaped(std::ostream &out, std::string_view text) {
+      for (char c : text) {
+        if (c == '"' || c == '\\') {
+          out << '\\';
+        }
+        out << c;
+      }
+    }
+
+    /* Microseconds with nanosecond precision */
+    static
+    void write_micros(std::ostream &out, std::uint64_t nanos) {
+      char fraction[4] = {
+        static_cast<char>('0' + nanos / 100 % 10),
+        static_cast<char>('0' + nanos / 10 % 10),
+        static_cast<char>('0' + nanos % 10),
+        '\0'
+      };
+      out << nanos / 1000 << '.' << fraction;
+    }
+
+    static
+    long pid() {
+#if __has_include(<unistd.h>)
+      return static_cast<long>(::getpid());
+#else
+      return 1;
+#endif
+    }
+  };
+
+#endif /* CFSM_TRACE */
+
+#ifdef CFSM_METRICS
+
+  /* Metrics export */
+
+  /**
+   * @brief Number of state machines of a class in each state.
+   *
+   * Enabled by defining `CFSM_METRICS` before including this header. Every
+   * change of the current state of a state machine, by start, transition,
+   * stop, restore or destruction, moves it between two gauges of the
+   * changing thread, so no state machine is ever scanned and threads do not
+   * contend. A state machine may enter a state on one thread and leave it on
+   * another, so only the sum over all threads is meaningful.
+   *
+   * @tparam fsm_type The state machine class.
+   */
+  template <typename fsm_type>
+  class population {
+  public:
+
+    /// Number of states of the state machine class.
+    static constexpr std::size_t state_count = fsm_type::state_total;
+
+    /**
+     * @brief Moves a state machine between states.
+     *
+     * @param from Index of the state left, out of range if none.
+     * @param to Index of the state entered, out of range if none.
+     */
+    static
+    void move(std::size_t from, std::size_t to) {
+      shard &local = shards::local();
+      if (from < state_count) {
+        add(local.counts[from], -1);
+      }
+      if (to < state_count) {
+        add(local.counts[to], 1);
+      }
+    }
+
+    /**
+     * @brief Returns the number of state machines in a state.
+     *
+     * @param index Index of the state.
+     */
+    static
+    std::int64_t count(std::size_t index) {
+      std::int64_t total = 0;
+      if (index < state_count) {
+        shards::for_each([&](std::size_t, shard &s) {
+          total += s.counts[index].load(std::memory_order_relaxed);
+        });
+      }
+      return total;
+    }
+
+  private:
+
+    struct shard {
+      std::atomic<std::int64_t> counts[state_count] = {};
+
+      /* Gauges of an exited thread still count */
+      void reclaim() {
+      }
+    };
+
+    using shards = thread_shards<shard>;
+
+    static
+    void add(std::atomic<std::int64_t> &counter, std::int64_t value) {
+      counter.store(counter.load(std::memory_order_relaxed) + value,
+          std::memory_order_relaxed);
+    }
+  };
+
+  /**
+   * @brief Formats the statistics of state machine classes in the Prometheus
+   * text exposition format.
+   *
+   * Every added class contributes, labelled with its name,
+   *
+   * - `cfsm_machines{machine,state}`, gauge of the state populations,
+   * - with `CFSM_STATS`, `cfsm_transitions_total{machine,from,to}`,
+   *   `cfsm_starts_total{machine,state}` and
+   *   `cfsm_stops_total{machine,state}` counters,
+   * - with `CFSM_LOCK_STATS`, `cfsm_lock_acquisitions_total`,
+   *   `cfsm_lock_contended_total` and `cfsm_lock_wait_cycles_total`
+   *   counters.
+   *
+   * Formatting reads the aggregated per-thread counters and does not
+   * allocate: the transition counts of a class, which grow with the square
+   * of its number of states, are summed once per write into a buffer
+   * allocated by `add` and shared by the families. An exporter shall
+   * therefore not write from two threads at a time.
+   */
+  class prometheus_exporter {
+  public:
+
+    /**
+     * @brief Adds a state machine class.
+     *
+     * @tparam fsm_type The state machine class.
+     * @param name Value of the `machine` label, a string with static storage
+     * duration.
+     */
+    template <typename fsm_type>
+    void add(std::string_view name) {
+#ifdef CFSM_STATS
+      std::shared_ptr<void> counts =
+        std::make_shared<typename stats<fsm_type>::snapshot_type>();
+#else
+      std::shared_ptr<void> counts;
+#endif
+      classes.push_back({name, &capture<fsm_type>, &emit<fsm_type>,
+          std::move(counts)});
+    }
+
+    /**
+     * @brief Writes the metrics to memory.
+     *
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @return Number of bytes written, 0 if the array is too small.
+     */
+    std::size_t write(char *pdata, std::size_t datalen) {
+      text_writer out{pdata, datalen};
+      for (const auto &entry : classes) {
+        entry.capture(entry.counts.get());
+      }
+      for (std::size_t f = 0; f < family_count; ++f) {
+        out.text("# HELP ");
+        out.text(families[f].name);
+        out.text(" ");
+        out.text(families[f].help);
+        out.text("\n# TYPE ");
+        out.text(families[f].name);
+        out.text(" ");
+        out.text(families[f].type);
+        out.text("\n");
+        for (const auto &entry : classes) {
+          entry.emit(f, entry.name, entry.counts.get(), out);
+        }
+      }
+      return out.overflow ? 0 : out.size;
+    }
+
+    /**
+     * @brief Writes the metrics to a file.
+     *
+     * The file is written under a temporary name and renamed, so a scraper
+     * reading it, such as the node exporter textfile collector, never sees
+     * a partial file.
+     *
+     * @param path Path of the file.
+     * @return false if the file could not be written.
+     */
+    bool save(const char *path) {
+      std::vector<char> data(4096);
+      std::size_t size = 0;
+      while (!(size = write(data.data(), data.size()))) {
+        data.resize(data.size() * 2);
+      }
+
+      std::string temp = std::string(path) + ".tmp";
+      {
+        std::ofstream out(temp, std::ios::out | std::ios::trunc |
+            std::ios::binary);
+        out.write(data.data(), static_cast<std::streamsize>(size));
+        out.flush();
+        if (!out) {
+          std::remove(temp.c_str());
+          return false;
+        }
+      }
+      return std::rename(temp.c_str(), path) == 0;
+    }
+
+  private:
+
+    /* Appends text to a char array, noting when it is too small */
+    struct text_writer {
+      char *pdata;
+      std::size_t datalen;
+      std::size_t size = 0;
+      bool overflow = false;
+
+      void text(std::string_view str) {
+        if (datalen - size < str.size()) {
+          overflow = true;
+          size = datalen;
+          return;
+        }
+        std::memcpy(pdata + size, str.data(), str.size());
+        size += str.size();
+      }
+
+      void number(std::int64_t value) {
+        char digits[24];
+        std::size_t count = 0;
+        std::uint64_t magnitude = value < 0 ?
+          0 - static_cast<std::uint64_t>(value) :
+          static_cast<std::uint64_t>(value);
+        do {
+          digits[sizeof(digits) - ++count] =
+            static_cast<char>('0' + magnitude % 10);
+          magnitude /= 10;
+        } while (magnitude);
+        if (value < 0) {
+          digits[sizeof(digits) - ++count] = '-';
+        }
+        text(std::string_view(digits + sizeof(digits) - count, count));
+      }
+
+      /* Label value with backslash, quote and newline escaped */
+      void label(std::string_view key, std::string_view value) {
+        text(key);
+        text("=\"");
+        for (char c : value) {
+          text(c == '\\' ? "\\\\" : c == '"' ? "\\\"" :
+              c == '\n' ? "\\n" : std::string_view(&c, 1));
+        }
+        text("\"");
+      }
+    };
+
+    struct family {
+      std::string_view name;
+      std::string_view type;
+      std::string_view help;
+    };
+
+    static constexpr family families[] = {
+      {"cfsm_machines", "gauge", "State machines in each state."},
+#ifdef CFSM_STATS
+      {"cfsm_transitions_total", "counter",
+        "Transitions by source and target state."},
+      {"cfsm_starts_total", "counter", "Starts in each state."},
+      {"cfsm_stops_total", "counter", "Stops from each state."},
+#endif
+#ifdef CFSM_LOCK_STATS
+      {"cfsm_lock_acquisitions_total", "counter", "Lock acquisitions."},
+      {"cfsm_lock_contended_total", "counter",
+        "Lock acquisitions which found the lock held."},
+      {"cfsm_lock_wait_cycles_total", "counter",
+        "Timestamp counter cycles spent waiting for locks."},
+#endif
+    };
+
+    static constexpr std::size_t family_count =
+      sizeof(families) / sizeof(families[0]);
+
+    using capture_type = void (*)(void *counts);
+
+    using emit_type = void (*)(std::size_t family, std::string_view name,
+        const void *counts, text_writer &out);
+
+    struct added_class {
+      std::string_view name;
+      capture_type capture;
+      emit_type emit;
+      std::shared_ptr<void> counts; ///< Transition counts, if counted.
+    };
+
+    std::vector<added_class> classes;
+
+    /* Sums the transition counts of a state machine class into its buffer */
+    template <typename fsm_type>
+    static
+    void capture([[maybe_unused]] void *counts) {
+#ifdef CFSM_STATS
+      stats<fsm_type>::snapshot(
+          *static_cast<typename stats<fsm_type>::snapshot_type*>(counts));
+#endif
+    }
+
+    /* Writes the samples of a family for a state machine class */
+    template <typename fsm_type>
+    static
+    void emit(std::size_t f, std::string_view name,
+        [[maybe_unused]] const void *captured, text_writer &out) {
+      constexpr std::size_t state_count = fsm_type::state_total;
+      const auto &names = fsm_type::state_names;
+      std::string_view metric = families[f].name;
+
+      auto sample = [&](auto &&labels, std::int64_t value) {
+        out.text(metric);
+        out.text("{");
+        out.label("machine", name);
+        labels();
+        out.text("} ");
+        out.number(value);
+        out.text("\n");
+      };
+
+      if (metric == "cfsm_machines") {
+        for (std::size_t i = 0; i < state_count; ++i) {
+          sample([&] {
+            out.text(",");
+            out.label("state", names[i]);
+          }, population<fsm_type>::count(i));
+        }
+      }
+
+#ifdef CFSM_STATS
+      if (metric == "cfsm_transitions_total" ||
+          metric == "cfsm_starts_total" || metric == "cfsm_stops_total") {
+        const auto *counts =
+          static_cast<const typename stats<fsm_type>::snapshot_type*>(
+              captured);
+        for (std::size_t i = 0; i < state_count; ++i) {
+          if (metric == "cfsm_transitions_total") {
+            for (std::size_t j = 0; j < state_count; ++j) {
+              if (!counts->transitions[i][j]) {
+                continue;
+              }
+              sample([&] {
+                out.text(",");
+                out.label("from", names[i]);
+                out.text(",");
+                out.label("to", names[j]);
+              }, static_cast<std::int64_t>(counts->transitions[i][j]));
+            }
+          } else {
+            sample([&] {
+              out.text(",");
+              out.label("state", names[i]);
+            }, static_cast<std::int64_t>(metric == "cfsm_starts_total" ?
+                counts->starts[i] : counts->stops[i]));
+          }
+        }
+      }
+#endif
+
+#ifdef CFSM_LOCK_STATS
+      if (metric.substr(0, 10) == "cfsm_lock_") {
+        lock_counts counts = lock_stats<fsm_type>::snapshot();
+        sample([] {}, static_cast<std::int64_t>(
+              metric == "cfsm_lock_acquisitions_total" ? counts.acquisitions :
+              metric == "cfsm_lock_contended_total" ? counts.contended :
+              counts.wait_cycles));
+      }
+#endif
+    }
+  };
+
+#endif /* CFSM_METRICS */
+
+  /* Dirty tracking */
+
+  /// Snapshot flag of a delta holding only the changed state machines.
+  constexpr std::uint8_t snapshot_flag_delta = 0x01;
+
+  /**
+   * @brief Bitmap of state machines changed since the last delta checkpoint.
+   *
+   * One bit per state machine, indexed by its position in the tracked array.
+   * Marking a bit which is already set does not write to the bitmap, so
+   * repeated transitions of a hot state machine do not contend on the cache
+   * line.
+   */
+  class dirty_set {
+  public:
+
+    /**
+     * @brief Creates a bitmap with every state machine clean.
+     *
+     * @param count Number of state machines.
+     */
+    explicit dirty_set(std::size_t count)
+      : count(count), words(new std::atomic<std::uint64_t>[(count + 63) / 64]) {
+      for (std::size_t i = 0; i < (count + 63) / 64; ++i) {
+        words[i].store(0, std::memory_order_relaxed);
+      }
+    }
+
+    dirty_set(const dirty_set&) = delete;
+    dirty_set& operator=(const dirty_set&) = delete;
+
+    /**
+     * @brief Returns the number of state machines.
+     */
+    std::size_t size() const {
+      return count;
+    }
+
+    /**
+     * @brief Number of 64 bit words of the bitmap.
+     */
+    std::size_t word_count() const {
+      return (count + 63) / 64;
+    }
+
+    /**
+     * @brief Marks a state machine as changed.
+     *
+     * @param id Position of the state machine, ignored if out of range.
+     */
+    void mark(std::size_t id) {
+      if (id >= count) {
+        return;
+      }
+      std::uint64_t bit = std::uint64_t(1) << (id % 64);
+      std::atomic<std::uint64_t> &word = words[id / 64];
+      if (!(word.load(std::memory_order_relaxed) & bit)) {
+        word.fetch_or(bit, std::memory_order_release);
+      }
+    }
+
+    /**
+     * @brief Marks every state machine as changed.
+     */
+    void mark_all() {
+      for (std::size_t i = 0; i < word_count(); ++i) {
+        std::size_t bits = std::min<std::size_t>(count - i * 64, 64);
+        words[i].fetch_or(bits == 64 ? ~std::uint64_t(0) :
+            (std::uint64_t(1) << bits) - 1, std::memory_order_release);
+      }
+    }
+
+    /**
+     * @brief Checks if a state machine is marked as changed.
+     *
+     * @param id Position of the state machine.
+     */
+    bool test(std::size_t id) const {
+      return id < count &&
+        (words[id / 64].load(std::memory_order_acquire) >> (id % 64)) & 1;
+    }
+
+    /**
+     * @brief Clears a word of the bitmap and returns its previous bits.
+     *
+     * @param index Position of the word.
+     */
+    std::uint64_t take_word(std::size_t index) {
+      return words[index].exchange(0, std::memory_order_acq_rel);
+    }
+
+    /**
+     * @brief Marks the bits of a word taken earlier again.
+     *
+     * @param index Position of the word.
+     * @param bits The bits.
+     */
+    void restore_word(std::size_t index, std::uint64_t bits) {
+      words[index].fetch_or(bits, std::memory_order_release);
+    }
+
+  private:
+
+    std::size_t count;
+    std::unique_ptr<std::atomic<std::uint64_t>[]> words;
+  };
+
+#if __has_include(<unistd.h>)
+#define CFSM_HAS_BACKGROUND_CHECKPOINT 1
+#endif
+
+  template <typename fsm_type>
+  class background_checkpoint;
+
+#endif /* __cplusplus >= 201703L */
+
+  /* Finite state machine class */
+
+#if __cplusplus >= 201402L
+
+  /**
+   * @brief Template class representing a finite state machine.
+   * 
+   * This state machine class manages transitions between states and calls
+   * appropriate `on_enter` and `on_exit` member functions for the states.
+   * States must derive from a base state class, unless the state objects are
+   * stored in place.
+   * 
+   * @tparam base_state The base class from which all state types must derive.
+   * @tparam type Enum specifying the state object allocation scheme.
+   * @tparam state_pool Array of pointers to base state class objects.
+   * @tparam states List of state classes present in the state machine.
+   */
+  template <
+    typename base_state,
+    enum alloc_type type = alloc_type::LAZY,
+    base_state* state_pool[] = nullptr,
+    typename... states
+  >
+
+#else /* __cplusplus >= 201402L */
+
+  /**
+   * @brief Template class representing a finite state machine.
+   * 
+   * This state machine class manages transitions between states and calls
+   * appropriate * `on_enter` and `on_exit` member functions for the states.
+   * States must derive from a base state class.
+   * 
+   * @tparam base_state The base class from which all state types must derive.
+   * @tparam type Enum specifying the state object allocation scheme.
+   * @tparam state_pool Array of pointers to base state class objects.
+   * @tparam state_count Number of states present in the state machine.
+   */
+  template <
+    typename base_state,
+    enum alloc_type type = alloc_type::LAZY,
+    base_state* state_pool[] = nullptr,
+    std::size_t state_count = 0
+  >
+
+#endif /* __cplusplus >= 201402L */
+
+  class state_machine {
+    using base_state_pointer_type = base_state*;
+
+    struct state_deleter {
+
+      template <
+        enum alloc_type type_ = type
+      >
+      typename std::enable_if<type_ != alloc_type::LAZY, void>::type
+      operator()(base_state_pointer_type ptr) const {}
+
+      template <
+        enum alloc_type type_ = type
+      >
+      typename std::enable_if<type_ == alloc_type::LAZY, void>::type
+      operator()(base_state_pointer_type ptr) const {
+        delete ptr;
+      }
+    };
+
+#if __cplusplus >= 201703L
+
+    /**
+     * @brief Storage for the current state object of an in-place state
+     * machine.
+     *
+     * Sized and aligned for the largest state class. The state object is
+     * constructed in it on entry and destroyed after exit.
+     */
+    struct inplace_state_storage {
+      alignas(states...) unsigned char data[
+        std::max({ sizeof(states)..., std::size_t(1) })
+      ];
+    };
+
+    using base_state_type = typename std::conditional<
+      type == alloc_type::INPLACE,
+      inplace_state_storage,
+      std::unique_ptr<base_state, state_deleter>
+    >::type;
+
+#else /* __cplusplus >= 201703L */
+
+    using base_state_type = std::unique_ptr<base_state, state_deleter>;
+
+#endif /* __cplusplus >= 201703L */
+
+    /// Current state object or pointer to it.
+    base_state_type p_current_state{};
+
+#if __cplusplus >= 201402L
+
+    /// Smallest unsigned type which holds every state index and `no_index`.
+    using index_type = typename std::conditional<
+      (sizeof...(states) < UINT8_MAX),
+      std::uint8_t,
+      typename std::conditional<
+        (sizeof...(states) < UINT16_MAX),
+        std::uint16_t,
+        std::uint32_t
+      >::type
+    >::type;
+
+    /// Stored index value of a stopped state machine.
+    static constexpr index_type no_index = static_cast<index_type>(-1);
+
+    /// Position of the current state class in `states`.
+    index_type current_index{no_index};
+
+    /**
+     * @brief Changes the position of the current state class, keeping the
+     * state populations up to date.
+     *
+     * @param index The new position, `no_index` if stopped.
+     */
+    void set_current_index(index_type index) {
+#ifdef CFSM_METRICS
+      if (index != current_index) {
+        population<state_machine>::move(current_index, index);
+      }
+#endif
+      current_index = index;
+    }
+
+#endif /* __cplusplus >= 201402L */
+
+    std::atomic<bool> lock{false}; ///< Atomic boolean flag to synchronize concurrent operations.
+  
+    /* Atomic lock acquire and release */
+
+#ifdef CFSM_LOCK_STATS
+
+#ifdef CFSM_LOCK_STATS_PER_MACHINE
+    /// Contention of the acquisitions of this state machine's lock.
+    lock_counts lock_history;
+#endif
+
+    void lock_acquire() {
+      lock_counts waited;
+      if (lock.exchange(true, std::memory_order_acquire)) {
+        std::uint64_t begin = read_tsc();
+        do {
+#if __cplusplus >= 202002L
+          ++waited.parks;
+          lock.wait(true);
+#else
+          ++waited.spins;
+#endif
+        } while (lock.exchange(true, std::memory_order_acquire));
+        waited.wait_cycles = read_tsc() - begin;
+      }
+
+#ifdef CFSM_LOCK_STATS_PER_MACHINE
+      /* The lock is held, the history is updated by one thread at a time */
+      ++lock_history.acquisitions;
+      if (waited.spins || waited.parks) {
+        ++lock_history.contended;
+        lock_history.spins += waited.spins;
+        lock_history.parks += waited.parks;
+        lock_history.wait_cycles += waited.wait_cycles;
+      }
+#endif
+      lock_stats<state_machine>::count(waited);
+    }
+
+#else /* CFSM_LOCK_STATS */
+
+    void lock_acquire() {
+      while(lock.exchange(true, std::memory_order_acquire)) {
+#if __cplusplus >= 202002L
+        lock.wait(true);
+#endif
+      }
+    }
+
+#endif /* CFSM_LOCK_STATS */
+
+    void lock_release() {
+      lock.store(false, std::memory_order_release);
+#if __cplusplus >= 202002L
+      lock.notify_one();
+#endif
+    }
+
+
+    /* Ensure the given state is valid */
+
+#if __cplusplus >= 201402L
+
+    /**
+     * @brief Checks if a type is derived from a base class.
+     * 
+     * This struct evaluates whether a given type `derived` is derived from the
+     * specified base class `base`.
+     * 
+     * @tparam base The base class to check against.
+     * @tparam derived The type to check if it's derived from `base`.
+     */
+    template <typename base, typename derived>
+    struct is_base_of_v {
+      /**
+       * @brief The boolean result indicating whether `derived` is derived from
+       * `base`.
+       */
+      static constexpr bool value = std::is_base_of<base, derived>::value;
+    };
+
+    /**
+     * @brief Checks if a type can be used as a state class.
+     *
+     * State classes derive from the base class. In-place state machines also
+     * accept plain classes which do not derive from it.
+     *
+     * @tparam base The base class to check against.
+     * @tparam derived The type to check.
+     */
+    template <typename base, typename derived>
+    struct is_valid_state_class {
+      /**
+       * @brief The boolean result indicating whether `derived` is derived from
+       * `base` or is a plain state class of an in-place state machine.
+       */
+      static constexpr bool value = is_base_of_v<base, derived>::value ||
+        (type == alloc_type::INPLACE && std::is_class<derived>::value);
+    };
+
+    /**
+     * @brief Checks if all provided types are valid state classes.
+     * 
+     * This structure checks if a variadic list of `derived` types are all
+     * valid state classes using conjunction.
+     * 
+     * @tparam base The base class to check against.
+     * @tparam derived The variadic template list of types to check.
+     */
+    template <typename base, typename... derived>
+    struct are_valid_states {
+      /**
+       * @brief The boolean result indicating whether all `derived` types are
+       * valid state classes.
+       */
+      static constexpr bool value =
+        conjunction_v<is_valid_state_class<base, derived>...>;
+    };
+  
+    /**
+     * @brief Checks if a given type matches any type in the list of valid
+     * states.
+     * 
+     * This static function evaluates whether the given type `T` matches
+     * any of the valid states in a predefined list of types.
+     * 
+     * @tparam T The type to be checked against valid states.
+     * @return constexpr bool `true` if `T` matches any of the valid states,
+     * `false` otherwise.
+     */
+    template <typename T>
+    static
+    constexpr bool is_valid_state() {
+      return disjunction_v<std::is_same<T, states>...>;
+    }
+
+  public:
+
+    /// Index value denoting no state.
+    static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    /**
+     * @brief Returns the position of a state class in the list of states.
+     *
+     * @tparam T The state class.
+     * @return constexpr std::size_t Zero based position of `T` in `states`,
+     * `npos` if `T` is not a valid state.
+     */
+    template <typename T>
+    static
+    constexpr std::size_t state_index() {
+      constexpr bool matches[] = { std::is_same<T, states>::value..., false };
+      for (std::size_t i = 0; i < sizeof...(states); ++i) {
+        if (matches[i]) {
+          return i;
+        }
+      }
+      return npos;
+    }
+
+  private:
+
+#else /* __cplusplus >= 201402L */
+
+    /**
+     * @brief Checks if a given type is derived from a base state.
+     * 
+     * This static function evaluates whether the given type `T` is derived
+     * from the predefined `base_state` type.
+     * 
+     * @tparam T The type to be checked.
+     * @return constexpr bool `true` if `T` is derived from `base_state`,
+     * `false` otherwise.
+     */
+    template <typename T>
+    static
+    constexpr bool is_valid_state() {
+      return std::is_base_of<base_state, T>::value;
+    }
+
+#endif /* __cplusplus >= 201402L */
+  
+    /**
+     * @brief Provides a pointer to an object of requested state class.
+     * 
+     * This struct contains a static method named `state` which returns a
+     * pointer of `alloc_base_state` class.
+     *
+     * @tparam alloc_base_state The base state class.
+     * @tparam size The size of the state object pointer array.
+     */
+    template <typename alloc_base_state, std::size_t size = 0>
+    struct state_allocator {
+
+      private:
+
+#if __cplusplus >= 201402L
+
+      /**
+       * @brief Manages a pool of state objects.
+       *
+       * The `internal_state_pool` struct is used to manage a collection (pool)
+       * of state objects, offering a pointer to this pool and ensuring proper
+       * cleanup of dynamically allocated objects.
+       */
+      struct internal_state_pool {
+
+        alloc_base_state *pool[sizeof...(states)];
+
+        /**
+         * @brief Constructs an internal state pool and allocates state objects.
+         *
+         * Initializes the pool with dynamically allocated objects of
+         * each state type provided in the `states` parameter pack.
+         */
+        internal_state_pool() {
+          alloc_base_state *pool_[sizeof...(states)] = { new states... };
+          for (std::size_t i = 0; i < sizeof...(states); ++i) {
+            pool[i] = pool_[i];
+          }
+        }
+
+        /**
+         * @brief Destroys the internal state pool and releases memory.
+         *
+         * Frees each dynamically allocated state object.
+         */
+        ~internal_state_pool() {
+          for (std::size_t i = 0; i < sizeof...(states); ++i) {
+            delete pool[i];
+          }
+        }
+
+      };
+
+#endif /* __cplusplus >= 201402L */
+
+      public:
+
+      /**
+       * @brief Provides a pointer to an object of requested state class from
+       * given array of pointers.
+       *
+       * Takes an array of base state class pointers as argument. The pointers
+       * in this array shall point to state objects of the classes enlisted with
+       * the state machine. This array is indexed into using `type_id` argument
+       * to get the address of an object of the requested state class.
+       *
+       * @param pool The state object pointers array.
+       * @param type_id The type identifier of the derived state class which
+       * the address of an object of, is returned in the base state class
+       * pointer.
+       * @return A pointer to derived state class object of the base state
+       * class.
+       */
+      static
+      alloc_base_state* state(alloc_base_state *pool[size],
+          const std::size_t type_id) {
+        return type_id < size ? pool[type_id] : nullptr;
+      }
+
+#if __cplusplus >= 201402L
+
+    private:
+
+      static
+      internal_state_pool*& get_state_pool() {
+        static internal_state_pool *p_statepool_ = nullptr;
+        return !p_statepool_ ? (p_statepool_ = new internal_state_pool)
+          : p_statepool_;
+      }
+
+    public:
+
+      /**
+       * @brief Provides a pointer to an object of requested state class from
+       * internally managed array of pointers.
+       *
+       * Allocates objects of enlisted state classes and stores their addresses
+       * in an array of base state class pointers. This array is indexed into
+       * using `type_id` argument to get the address of an object of the
+       * requested state class.
+       *
+       * @param type_id The type identifier of the derived state class which
+       * the address of an object of, is returned in the base state class
+       * pointer.
+       * @return A pointer to derived state class object of the base state
+       * class.
+       */
+      template <
+        enum alloc_type type_ = type,
+        typename std::enable_if<type_ == alloc_type::INTERNAL, int>::type = 0
+      >
+      static
+      alloc_base_state* state(const std::size_t type_id) {
+        internal_state_pool *p_statepool = get_state_pool();
+        return p_statepool && type_id < size ? p_statepool->pool[type_id]
+          : nullptr;
+      }
+
+      template <
+        enum alloc_type type_ = type,
+        typename std::enable_if<type_ == alloc_type::STATIC, int>::type = 0
+      >
+      static
+      alloc_base_state* state(const std::size_t type_id) {
+        static internal_state_pool p_statepool_;
+        return type_id < size ? p_statepool_.pool[type_id] : nullptr;
+      }
+
+      template <
+        enum alloc_type type_ = type,
+        typename std::enable_if<type_ == alloc_type::INTERNAL, int>::type = 0
+      >
+      static
+      void delete_state_pool() {
+        internal_state_pool *&statepool = get_state_pool();
+        statepool ? delete statepool : (void)0;
+        statepool = nullptr;
+      }
+
+      template <
+        enum alloc_type type_ = type,
+        typename std::enable_if<type_ != alloc_type::INTERNAL, int>::type = 0
+      >
+      static
+      void delete_state_pool() {
+      }
+
+#endif /* __cplusplus >= 201402L */
+
+    };
+  
+    /**
+     * @brief Returns a pointer to the current state object as given state
+     * class.
+     *
+     * The caller ensures that the current state object is of the requested
+     * state class.
+     *
+     * @tparam state_type The state class of the current state object.
+     * @return Pointer to the current state object.
+     */
+    template <
+      typename state_type,
+      enum alloc_type type_ = type,
+      typename std::enable_if<type_ != alloc_type::INPLACE, int>::type = 0
+    >
+    state_type* current_state_as() {
+      return static_cast<state_type*>(p_current_state.get());
+    }
+
+    /**
+     * @brief Checks if the state machine has a current state object.
+     *
+     * @return true if the state machine is started.
+     */
+    template <
+      enum alloc_type type_ = type,
+      typename std::enable_if<type_ != alloc_type::INPLACE, int>::type = 0
+    >
+    bool has_current_state() const {
+      return p_current_state != nullptr;
+    }
+
+    /**
+     * @brief Free the current state object.
+     *
+     * Sets the current state pointer as nullptr;
+     */
+    template <
+      enum alloc_type type_ = type,
+      typename std::enable_if<type_ != alloc_type::INPLACE, int>::type = 0
+    >
+    void delete_current_state() {
+      if (type == alloc_type::LAZY) {
+        p_current_state.reset();
+      }
+      p_current_state = nullptr;
+
+#if __cplusplus >= 201402L
+
+      set_current_index(no_index);
+
+#endif /* __cplusplus >= 201402L */
+
+    }
+
+#if __cplusplus >= 201703L
+
+    template <
+      typename state_type,
+      enum alloc_type type_ = type,
+      typename std::enable_if<type_ == alloc_type::INPLACE, int>::type = 0
+    >
+    state_type* current_state_as() {
+      return std::launder(reinterpret_cast<state_type*>(p_current_state.data));
+    }
+
+    template <
+      enum alloc_type type_ = type,
+      typename std::enable_if<type_ == alloc_type::INPLACE, int>::type = 0
+    >
+    bool has_current_state() const {
+      return current_index != no_index;
+    }
+
+    /**
+     * @brief Destroys the current in-place state object.
+     */
+    template <
+      enum alloc_type type_ = type,
+      typename std::enable_if<type_ == alloc_type::INPLACE, int>::type = 0
+    >
+    void delete_current_state() {
+      ([&] {
+        if (current_index == state_index<states>()) {
+          current_state_as<states>()->~states();
+        }
+      }(), ...);
+      set_current_index(no_index);
+    }
+
+#endif /* __cplusplus >= 201703L */
+
+    /* Entry and exit actions, elided for states which declare none */
+
+    /**
+     * @brief Calls `on_enter` of a state object through its static type.
+     *
+     * Compiles to nothing when `has_entry_action` is false for the state class.
+     *
+     * @tparam state_type The state class of the object.
+     * @param ptr Pointer to the state object.
+     * @param dataptr Opaque pointer to user data.
+     */
+    template <typename state_type>
+    static
+    typename std::enable_if<has_entry_action<state_type>::value, void>::type
+    enter_state(state_type *ptr, void *dataptr) {
+      ptr->on_enter(dataptr);
+    }
+
+    template <typename state_type>
+    static
+    typename std::enable_if<!has_entry_action<state_type>::value, void>::type
+    enter_state(state_type *ptr, void *dataptr) {
+    }
+
+    /**
+     * @brief Calls `on_exit` of a state object through its static type.
+     *
+     * Compiles to nothing when `has_exit_action` is false for the state class.
+     *
+     * @tparam state_type The state class of the object.
+     * @param ptr Pointer to the state object.
+     * @param dataptr Opaque pointer to user data.
+     */
+    template <typename state_type>
+    static
+    typename std::enable_if<has_exit_action<state_type>::value, void>::type
+    exit_state(state_type *ptr, void *dataptr) {
+      ptr->on_exit(dataptr);
+    }
+
+    template <typename state_type>
+    static
+    typename std::enable_if<!has_exit_action<state_type>::value, void>::type
+    exit_state(state_type *ptr, void *dataptr) {
+    }
+
+#if __cplusplus >= 201703L
+
+    /**
+     * @brief Calls `on_exit` of the current state object.
+     *
+     * The state class is looked up by the current state index so that exit
+     * actions are elided the same way as in `transition`.
+     *
+     * @param dataptr Opaque pointer to user data.
+     */
+    void exit_current_state(void *dataptr) {
+      ([&] {
+        if (current_index == state_index<states>()) {
+          exit_state<states>(current_state_as<states>(), dataptr);
+        }
+      }(), ...);
+    }
+
+#endif /* __cplusplus >= 201703L */
+
+    /* Replacement of the current state object */
+
+    /**
+     * @brief Makes an object of given state class the current state object.
+     *
+     * No entry or exit actions are called.
+     *
+     * @tparam new_state The state class.
+     * @return false if no state object could be obtained.
+     */
+    template <
+      typename new_state,
+      enum alloc_type type_ = type,
+      typename std::enable_if<type_ != alloc_type::INPLACE, int>::type = 0
+    >
+    bool emplace_state() {
+      base_state_pointer_type p_new_state =
+        state_machine::allocate_state<new_state>();
+      if (!p_new_state) {
+        return false;
+      }
+
+      p_current_state = base_state_type(p_new_state);
+
+#if __cplusplus >= 201402L
+
+      set_current_index(static_cast<index_type>(state_index<new_state>()));
+
+#endif /* __cplusplus >= 201402L */
+
+      return true;
+    }
+
+#ifdef CFSM_LATENCY
+
+    /**
+     * @brief Reads the timestamp counter at a point of a timed transition.
+     *
+     * @tparam timed Whether the transition is timed.
+     * @param point The point.
+     */
+    template <bool timed>
+    static
+    void mark_latency(latency_mark point) {
+      if (timed) {
+        latency<state_machine>::mark(point);
+      }
+    }
+
+#endif /* CFSM_LATENCY */
+
+    /**
+     * @brief Performs a transition on a locked state machine in given source
+     * state.
+     *
+     * Calls the exit action of the source state, the transition functor and
+     * the entry action of the target state. Completion transitions of the
+     * target state are followed in the same call and the current state index
+     * is stored once, for the state where the state machine comes to rest.
+     *
+     * @tparam from_state The source state class.
+     * @tparam to_state The target state class.
+     * @tparam timed Whether the phases are marked for `latency`, only for
+     * the transition a caller asked for and not for the completion
+     * transitions it sets off.
+     * @param dataptr Opaque pointer to user data.
+     * @return false if no object of target state class could be obtained, the
+     * state machine stays in the last state it entered then.
+     */
+    template <
+      typename from_state,
+      typename to_state,
+      bool timed = false,
+      enum alloc_type type_ = type,
+      typename std::enable_if<type_ != alloc_type::INPLACE, int>::type = 0
+    >
+    bool switch_state(void *dataptr) {
+      base_state_pointer_type p_new_state =
+        state_machine::allocate_state<to_state>();
+      if (!p_new_state) {
+
+#if __cplusplus >= 201402L
+
+        /* Source state may have been entered by a completion transition */
+        set_current_index(static_cast<index_type>(state_index<from_state>()));
+
+#endif /* __cplusplus >= 201402L */
+
+        return false;
+      }
+
+#ifdef CFSM_LATENCY
+      mark_latency<timed>(latency_mark::exiting);
+#endif
+      exit_state<from_state>(current_state_as<from_state>(), dataptr);
+#ifdef CFSM_LATENCY
+      mark_latency<timed>(latency_mark::exited);
+#endif
+
+      /* Call transition functor for "from_state" to "to_state" transition */
+      cfsm::transition<from_state, to_state>()(dataptr);
+#ifdef CFSM_LATENCY
+      mark_latency<timed>(latency_mark::called);
+#endif
+
+      p_current_state = base_state_type(p_new_state);
+
+#ifdef CFSM_LATENCY
+      mark_latency<timed>(latency_mark::entering);
+#endif
+      enter_state<to_state>(current_state_as<to_state>(), dataptr);
+#ifdef CFSM_LATENCY
+      mark_latency<timed>(latency_mark::entered);
+#endif
+
+#if __cplusplus >= 201703L
+
+      if constexpr (has_completion<from_state>::value) {
+        count_completion<from_state, to_state>();
+      }
+
+#endif /* __cplusplus >= 201703L */
+
+#if __cplusplus >= 201703L
+
+      if constexpr (has_completion<to_state>::value) {
+        return complete_state<to_state>(dataptr);
+      }
+
+#endif /* __cplusplus >= 201703L */
+
+#if __cplusplus >= 201402L
+
+      set_current_index(static_cast<index_type>(state_index<to_state>()));
+
+#endif /* __cplusplus >= 201402L */
+
+      return true;
+    }
+
+#if __cplusplus >= 201703L
+
+    /**
+     * @brief Constructs an in-place state object in the emptied storage of a
+     * locked state machine.
+     *
+     * The current state index shall be `no_index`, so a constructor which
+     * throws leaves the state machine stopped rather than naming a destroyed
+     * object. The lock is released before the exception propagates.
+     *
+     * @tparam new_state The state class.
+     */
+    template <typename new_state>
+    void construct_state() {
+      try {
+        ::new (static_cast<void*>(p_current_state.data)) new_state();
+      } catch (...) {
+        lock_release();
+        throw;
+      }
+    }
+
+    template <
+      typename new_state,
+      enum alloc_type type_ = type,
+      typename std::enable_if<type_ == alloc_type::INPLACE, int>::type = 0
+    >
+    bool emplace_state() {
+      delete_current_state();
+      construct_state<new_state>();
+      set_current_index(static_cast<index_type>(state_index<new_state>()));
+      return true;
+    }
+
+    template <
+      typename from_state,
+      typename to_state,
+      bool timed = false,
+      enum alloc_type type_ = type,
+      typename std::enable_if<type_ == alloc_type::INPLACE, int>::type = 0
+    >
+    bool switch_state(void *dataptr) {
+#ifdef CFSM_LATENCY
+      mark_latency<timed>(latency_mark::exiting);
+#endif
+      exit_state<from_state>(current_state_as<from_state>(), dataptr);
+#ifdef CFSM_LATENCY
+      mark_latency<timed>(latency_mark::exited);
+#endif
+
+      /* Call transition functor for "from_state" to "to_state" transition */
+      cfsm::transition<from_state, to_state>()(dataptr);
+#ifdef CFSM_LATENCY
+      mark_latency<timed>(latency_mark::called);
+#endif
+
+      current_state_as<from_state>()->~from_state();
+      set_current_index(no_index);
+      construct_state<to_state>();
+
+#ifdef CFSM_LATENCY
+      mark_latency<timed>(latency_mark::entering);
+#endif
+      enter_state<to_state>(current_state_as<to_state>(), dataptr);
+#ifdef CFSM_LATENCY
+      mark_latency<timed>(latency_mark::entered);
+#endif
+
+      if constexpr (has_completion<from_state>::value) {
+        count_completion<from_state, to_state>();
+      }
+
+      if constexpr (has_completion<to_state>::value) {
+        return complete_state<to_state>(dataptr);
+      }
+
+      set_current_index(static_cast<index_type>(state_index<to_state>()));
+
+      return true;
+    }
+
+#endif /* __cplusplus >= 201703L */
+
+#if __cplusplus >= 201703L
+
+    /**
+     * @brief Position of the state class where the state machine comes to
+     * rest after entering given state class.
+     *
+     * Follows completion transitions at compile time.
+     *
+     * @tparam state_type The entered state class.
+     * @tparam depth Number of completion transitions followed so far.
+     */
+    template <typename state_type, std::size_t depth = 0>
+    static
+    constexpr std::size_t settled_index() {
+      if constexpr (depth > sizeof...(states)) {
+        static_assert(depth <= sizeof...(states),
+            "Cycle of completion transitions");
+        return npos;
+      } else if constexpr (has_completion<state_type>::value) {
+        return settled_index<typename completion<state_type>::type,
+               depth + 1>();
+      } else {
+        return state_index<state_type>();
+      }
+    }
+
+    /**
+     * @brief Position of the state class where the state machine comes to
+     * rest after entering the state class at given position.
+     *
+     * @param index Position of the entered state class in `states`, or
+     * `journal_stopped`, which is returned as is.
+     */
+    static
+    std::uint32_t settled_position(std::uint32_t index) {
+      static constexpr std::array<std::size_t, sizeof...(states)> settled = {{
+        settled_index<states>()...
+      }};
+      return index == journal_stopped ? index :
+        static_cast<std::uint32_t>(settled[index]);
+    }
+
+    /**
+     * @brief Follows the completion transition of a state which was just
+     * entered.
+     *
+     * @tparam state_type The entered state class.
+     * @param dataptr Opaque pointer to user data.
+     * @return false if a state object could not be obtained on the way.
+     */
+    template <typename state_type>
+    bool complete_state(void *dataptr) {
+      using next_state = typename completion<state_type>::type;
+
+      static_assert(settled_index<state_type>() != npos,
+          "Cycle of completion transitions");
+      static_assert(is_valid_state<next_state>(), "Invalid completion state");
+      static_assert(
+          is_type_complete_v<cfsm::transition<state_type, next_state>>,
+          "Completion transition functor is not defined");
+
+      return switch_state<state_type, next_state>(dataptr);
+    }
+
+    /**
+     * @brief Counts a completion transition in the statistics.
+     *
+     * Transitions are counted by `record_transition` with the pair the
+     * caller asked for, the hops of a completion chain are counted here as
+     * each state is entered.
+     *
+     * @tparam from_state The state class left by the completion transition.
+     * @tparam to_state The state class entered by the completion transition.
+     */
+    template <typename from_state, typename to_state>
+    void count_completion() {
+#ifdef CFSM_STATS
+      stats<state_machine>::count(
+          static_cast<std::uint32_t>(state_index<from_state>()),
+          static_cast<std::uint32_t>(state_index<to_state>()));
+#endif
+    }
+
+#endif /* __cplusplus >= 201703L */
+
+    /* Current state lookup for the state query */
+
+    template <
+      typename state_type,
+      enum alloc_type type_ = type,
+      typename std::enable_if<type_ != alloc_type::INPLACE, int>::type = 0
+    >
+    state_type* current_state_cast() {
+      return dynamic_cast<state_type*>(p_current_state.get());
+    }
+
+#if __cplusplus >= 201703L
+
+    template <
+      typename state_type,
+      enum alloc_type type_ = type,
+      typename std::enable_if<type_ == alloc_type::INPLACE, int>::type = 0
+    >
+    state_type* current_state_cast() {
+      state_type *cur_state = nullptr;
+      ([&] {
+        if constexpr (std::is_convertible<states*, state_type*>::value) {
+          if (current_index == state_index<states>()) {
+            cur_state = current_state_as<states>();
+          }
+        }
+      }(), ...);
+      return cur_state;
+    }
+
+    /* Routes across the transition graph */
+
+    /**
+     * @brief State class at given position in the list of states.
+     *
+     * @tparam index Zero based position in `states`.
+     */
+    template <std::size_t index>
+    using state_at =
+      typename std::tuple_element<index, std::tuple<states...>>::type;
+
+    /**
+     * @brief Checks if the transition graph has an edge between two states.
+     *
+     * An edge exists when the transition functor for the pair of state
+     * classes is defined. A state with a completion transition has only the
+     * edge of its completion transition.
+     *
+     * @tparam from Position of the source state class in `states`.
+     * @tparam to Position of the target state class in `states`.
+     */
+    template <std::size_t from, std::size_t to>
+    static
+    constexpr bool is_edge() {
+      if constexpr (has_completion<state_at<from>>::value) {
+        return std::is_same<
+          typename completion<state_at<from>>::type,
+          state_at<to>
+        >::value;
+      } else {
+        return is_type_complete_v<
+          cfsm::transition<state_at<from>, state_at<to>>
+        >;
+      }
+    }
+
+    /**
+     * @brief Builds the adjacency matrix of the transition graph.
+     *
+     * Entry `i * N + j` holds the edge from state `i` to state `j` where `N`
+     * is the number of states.
+     */
+    template <std::size_t... edge>
+    static
+    constexpr std::array<bool, sizeof...(states) * sizeof...(states)>
+    transition_graph(std::index_sequence<edge...>) {
+      return {{
+        is_edge<edge / sizeof...(states), edge % sizeof...(states)>()...
+      }};
+    }
+
+    /**
+     * @brief Computes shortest routes from every state to a target state.
+     *
+     * Breadth first search from the target over reversed edges of the
+     * transition graph.
+     *
+     * @tparam target Position of the target state class in `states`.
+     * @return Array holding for every state the next state on a shortest
+     * route to the target, the target itself for the target and `npos` for
+     * states without a route.
+     */
+    template <std::size_t target>
+    static
+    constexpr std::array<std::size_t, sizeof...(states)> route_to() {
+      constexpr std::size_t count = sizeof...(states);
+      constexpr std::array<bool, count * count> graph =
+        transition_graph(std::make_index_sequence<count * count>());
+
+      std::array<std::size_t, count> next{};
+      std::array<std::size_t, count> queue{};
+      std::size_t head = 0, tail = 0;
+
+      for (std::size_t i = 0; i < count; ++i) {
+        next[i] = npos;
+      }
+      next[target] = target;
+      queue[tail++] = target;
+
+      while (head < tail) {
+        std::size_t to = queue[head++];
+        for (std::size_t from = 0; from < count; ++from) {
+          if (graph[from * count + to] && next[from] == npos) {
+            next[from] = to;
+            queue[tail++] = from;
+          }
+        }
+      }
+
+      return next;
+    }
+
+    /// Outcome of following a route.
+    enum class route_status {
+      done,         ///< Target state reached
+      unreachable,  ///< No route from the current state
+      failed        ///< State object allocation failed on the way
+    };
+
+    /**
+     * @brief Follows the precomputed route from a state to a target state on
+     * a locked state machine.
+     *
+     * Expands into the sequence of transitions along the route.
+     *
+     * @tparam from Position of the current state class in `states`.
+     * @tparam target Position of the target state class in `states`.
+     * @param dataptr Opaque pointer to user data.
+     */
+    template <std::size_t from, std::size_t target>
+    route_status follow_route(void *dataptr) {
+      constexpr std::array<std::size_t, sizeof...(states)> route =
+        route_to<target>();
+
+      if constexpr (route[from] == npos) {
+        return route_status::unreachable;
+      } else if constexpr (from == target) {
+        return route_status::done;
+      } else {
+        if (!switch_state<state_at<from>, state_at<route[from]>>(dataptr)) {
+          return route_status::failed;
+        }
+        record_transition(from, route[from]);
+        /* Completion transitions move along the route on their own */
+        return follow_route<settled_index<state_at<route[from]>>(), target>(
+            dataptr);
+      }
+    }
+
+    template <std::size_t target, std::size_t... index>
+    route_status follow_route(void *dataptr, std::index_sequence<index...>) {
+      route_status status = route_status::unreachable;
+      ((current_index == index ?
+        (status = follow_route<index, target>(dataptr), true) : false) || ...);
+      return status;
+    }
+
+    /* Transitions selected by state indices at runtime */
+
+    /// Function performing the transition between a fixed pair of states.
+    using trampoline_type = bool (*)(state_machine&, void*);
+
+    template <std::size_t from, std::size_t to>
+    static
+    bool transition_trampoline(state_machine &fsm, void *dataptr) {
+      return fsm.template transition<state_at<from>, state_at<to>>(dataptr);
+    }
+
+    static
+    bool reject_transition(state_machine &fsm, void *dataptr) {
+      return false;
+    }
+
+    /**
+     * @brief Selects the trampoline for a pair of states.
+     *
+     * @tparam from Position of the source state class in `states`.
+     * @tparam to Position of the target state class in `states`.
+     * @return The trampoline calling `transition` for the pair if its
+     * transition functor is defined, the rejecting trampoline otherwise.
+     */
+    template <std::size_t from, std::size_t to>
+    static
+    constexpr trampoline_type trampoline() {
+      if constexpr (
+          is_type_complete_v<cfsm::transition<state_at<from>, state_at<to>>>
+      ) {
+        return &transition_trampoline<from, to>;
+      } else {
+        return &reject_transition;
+      }
+    }
+
+    /**
+     * @brief Builds the table of trampolines for all pairs of states.
+     *
+     * Entry `i * N + j` holds the trampoline for the transition from state `i`
+     * to state `j` where `N` is the number of states.
+     */
+    template <std::size_t... pair>
+    static
+    constexpr std::array<trampoline_type, sizeof...(states) * sizeof...(states)>
+    transition_table(std::index_sequence<pair...>) {
+      return {{
+        trampoline<pair / sizeof...(states), pair % sizeof...(states)>()...
+      }};
+    }
+
+    /* Starts selected by state indices at runtime */
+
+    /// Function starting the state machine in a fixed state.
+    using start_trampoline_type = void (*)(state_machine&, void*);
+
+    template <std::size_t index>
+    static
+    void start_trampoline(state_machine &fsm, void *dataptr) {
+      fsm.template start<state_at<index>>(dataptr);
+    }
+
+    template <std::size_t... index>
+    static
+    constexpr std::array<start_trampoline_type, sizeof...(states)>
+    start_table(std::index_sequence<index...>) {
+      return {{ &start_trampoline<index>... }};
+    }
+
+    /**
+     * @brief Constructs the state object at given index without calling entry
+     * and exit actions.
+     *
+     * @param index Position of the state class in `states`.
+     * @return false if the state object could not be obtained.
+     */
+    bool emplace_state_at(std::size_t index) {
+      bool emplaced = false;
+      ((index == state_index<states>() ?
+        (emplaced = emplace_state<states>(), true) : false) || ...);
+      return emplaced;
+    }
+
+    /* Transition journal and dirty tracking */
+
+#ifdef CFSM_HAS_JOURNAL
+
+    /// Journal transitions are appended to, null if detached.
+    static inline std::atomic<journal*> attached_journal{nullptr};
+
+    /// Array of state machines whose positions are the journal machine ids.
+    static inline const state_machine *journal_machines = nullptr;
+
+    /// Number of state machines in the journaled array.
+    static inline std::size_t journal_count = 0;
+
+#endif /* CFSM_HAS_JOURNAL */
+
+#ifdef CFSM_HAS_BACKGROUND_CHECKPOINT
+
+    template <typename fsm_type>
+    friend class background_checkpoint;
+
+    /// Background checkpoint capturing states before they change.
+    static inline std::atomic<background_checkpoint<state_machine>*>
+      attached_checkpoint{nullptr};
+
+    /// Number of transitions inside the attached background checkpoint.
+    static inline std::atomic<std::size_t> checkpoint_users{0};
+
+#endif /* CFSM_HAS_BACKGROUND_CHECKPOINT */
+
+    /// Bitmap changed state machines are marked in, null if detached.
+    static inline std::atomic<dirty_set*> attached_dirty_set{nullptr};
+
+    /// Array of state machines whose positions index the dirty bitmap.
+    static inline const state_machine *dirty_machines = nullptr;
+
+    /**
+     * @brief Returns the position of this state machine in an array.
+     *
+     * @param machines Pointer to the array of state machines.
+     * @return The position, out of range if the state machine is not in the
+     * array.
+     */
+    std::size_t position_in(const state_machine *machines) const {
+      std::uintptr_t offset = reinterpret_cast<std::uintptr_t>(this) -
+        reinterpret_cast<std::uintptr_t>(machines);
+      return offset / sizeof(state_machine);
+    }
+
+    /**
+     * @brief Writes a transition of this state machine to the flight
+     * recorder and the statistics, marks it in the attached dirty set, hands
+     * its source state to the running background checkpoint and appends it
+     * to the attached journal, called with the lock held.
+     *
+     * @param from Index of the source state, `journal_stopped` for a start.
+     * @param to Index of the target state, `journal_stopped` for a stop.
+     */
+    void record_transition(std::uint32_t from, std::uint32_t to) {
+#ifdef CFSM_FLIGHT_RECORDER
+      /* Completion transitions are followed already */
+      flight_recorder::record(this, from, settled_position(to));
+#endif
+#ifdef CFSM_STATS
+      stats<state_machine>::count(from, to);
+#endif
+      dirty_set *dirty = attached_dirty_set.load(std::memory_order_acquire);
+      if (dirty) {
+        dirty->mark(position_in(dirty_machines));
+      }
+#ifdef CFSM_HAS_BACKGROUND_CHECKPOINT
+      /* Captured before journaling, so the record of a transition missing
+       * from a running cut is timestamped after the cut started */
+      if constexpr (payload_free) {
+        if (attached_checkpoint.load(std::memory_order_relaxed)) {
+          checkpoint_users.fetch_add(1, std::memory_order_seq_cst);
+          background_checkpoint<state_machine> *cut =
+            attached_checkpoint.load(std::memory_order_seq_cst);
+          if (cut) {
+            cut->capture(*this, from == journal_stopped ? 0 : from + 1);
+          }
+          checkpoint_users.fetch_sub(1, std::memory_order_release);
+        }
+      }
+#endif /* CFSM_HAS_BACKGROUND_CHECKPOINT */
+#ifdef CFSM_HAS_JOURNAL
+      journal *log = attached_journal.load(std::memory_order_acquire);
+      if (log) {
+        std::size_t id = position_in(journal_machines);
+        if (id < journal_count) {
+          log->append(id, from, to);
+        }
+      }
+#endif /* CFSM_HAS_JOURNAL */
+    }
+
+#endif /* __cplusplus >= 201703L */
+
+  public:
+    /**
+     * @brief Functon template to fetch a pointer to an object of requested
+     * state class, from an array of base state class pointers.
+     *
+     * This function is a wrapper over the actual implementation.
+     * @see state_allocator::state(allocate_state**, const std::size_t)
+     *
+     * @tparam new_state The requested state class.
+     * @tparam state_pool_ The state object pointer array.
+     * @return A pointer to derived state class object of the base state
+     * class.
+     */
+    template <
+      typename new_state,
+      enum alloc_type type_ = type,
+      typename std::enable_if<type_ == alloc_type::PREALLOCED, int>::type = 0
+    >
+    static
+    base_state* allocate_state() {
+
+#if __cplusplus >= 201402L
+
+      return state_allocator<cfsm::state, sizeof...(states)>::state(state_pool,
+          new_state::type_id());
+
+#else
+
+      return state_allocator<cfsm::state, state_count>
+        ::state(state_pool, new_state::type_id());
+
+#endif
+
+    }
+  
+    /* Internal allocator is unavailable below C++14 */
+
+#if __cplusplus >= 201402L
+
+    /**
+     * @brief Functon template to fetch a pointer to an object of requested
+     * state class, from an internally managed array of base state class
+     * pointers.
+     *
+     * This function is a wrapper over the actual implementation.
+     * @see state_allocator::state(const std::size_t)
+     *
+     * @tparam new_state The requested state class.
+     * @tparam state_pool_ The state object pointer array.
+     * @return A pointer to derived state class object of the base state
+     * class.
+     */
+    template <
+      typename new_state,
+      enum alloc_type type_ = type,
+      typename std::enable_if <
+        type_ == alloc_type::INTERNAL || type_ == alloc_type::STATIC,
+        int
+      >::type = 0
+    >
+    static
+    base_state* allocate_state() {
+      return state_allocator<cfsm::state, sizeof...(states)>
+        ::state(new_state::type_id());
+    }
+
+#endif /* __cplusplus >= 201402L */
+
+    /**
+     * @brief Functon template to allocate a new state object and return its
+     * address as a pointer of base state class.
+     *
+     * Uses new operator on the requested state class.
+     *
+     * @tparam new_state The requested state class.
+     * @tparam state_pool_ The state object pointer array.
+     * @return A pointer to derived state class object of the base state
+     * class.
+     */
+    template <
+      typename new_state,
+      enum alloc_type type_ = type,
+      typename std::enable_if<type_ == alloc_type::LAZY, int>::type = 0
+    >
+    static
+    base_state* allocate_state() {
+      return new new_state();
+    }
+
+    /**
+     * @brief Returns a non-negative integer of `std::size_t` type.
+     *
+     * Returns incremented value of a static variable every time it gets called
+     * starting with zero. This function is static member of the "state_machine"
+     * class, hence can be used to assign type identifiers to derived state
+     * classes.
      * 
-     * This static function evaluates whether the given type `T` matches
-     * any of the valid states in a predefined list of types.
+     * @return A non-negative integer.
+     */
+    static
+    std::size_t gen_type_id() {
+      static std::size_t type_id_gen = 0;
+      return type_id_gen++;
+    }
+  
+#if __cplusplus >= 201402L
+
+    /**
+     * @brief Constructor for the state machine.
+     *
+     * Checks if the states provided as template parameters are derived from
+     * the base "state" class.
+     */
+    state_machine() {
+      static_assert(are_valid_states<base_state, states...>::value,
+          "Invalid states in ctor");
+    }
+
+#else /* __cplusplus >= 201402L */
+
+    /**
+     * @brief Constructor for the state machine.
+     */
+    state_machine() = default;
+
+#endif /* __cplusplus >= 201402L */
+  
+    /**
+     * @brief Starts the state machine in an initial state.
      * 
-     * @tparam T The type to be checked against valid states.
-     * @return constexpr bool `true` if `T` matches any of the valid states,
-     * `false` otherwise.
+     * The state machine transitions into the initial state and calls the
+     * state's `on_enter` member function.
+     * 
+     * @tparam initial_state The type of the initial state, which must inherit
+     * from `base_state`.
+     * @param dataptr Opaque pointer to user data.
+     */
+    template <typename initial_state>
+    void start(void *dataptr) {
+      static_assert(is_valid_state<initial_state>(), "Invalid initial state");
+
+      CFSM_PROBE2(start_entry, this, state_index<initial_state>());
+#ifdef CFSM_TRACE
+      std::uint64_t trace_begin = trace::now();
+#endif
+      lock_acquire();
+
+      if (!emplace_state<initial_state>()) {
+        lock_release();
+        CFSM_PROBE3(start_return, this, state_index<initial_state>(), false);
+        throw std::runtime_error("State pointer is null");
+      }
+
+      enter_state<initial_state>(current_state_as<initial_state>(), dataptr);
+
+#if __cplusplus >= 201703L
+
+      if constexpr (has_completion<initial_state>::value) {
+        if (!complete_state<initial_state>(dataptr)) {
+          lock_release();
+          CFSM_PROBE3(start_return, this, state_index<initial_state>(),
+              false);
+          std::ostringstream oss;
+          oss << "Failed to allocate new state, state_pool: " << state_pool;
+          throw std::runtime_error(oss.str());
+        }
+      }
+
+      record_transition(journal_stopped, state_index<initial_state>());
+
+#endif /* __cplusplus >= 201703L */
+
+      lock_release();
+
+#ifdef CFSM_TRACE
+      trace::record({this, state_names.data(), trace_begin, trace::now(),
+          journal_stopped,
+          static_cast<std::uint32_t>(settled_index<initial_state>())});
+#endif
+      CFSM_PROBE3(start_return, this, state_index<initial_state>(), true);
+    }
+  
+    /**
+     * @brief Transitions the state machine to a new state.
+     * 
+     * The state machine transitions from the current state to the new state
+     * and calls the appropriate `on_exit` member function for the current
+     * state and `on_enter` member function for the new state. It also invokes
+     * the transition functor for the specific transition between the two
+     * states.
+     *
+     * From C++14 the current state is matched by its index, so the transition
+     * is performed only if the current state is exactly `from_state`, and not
+     * a state class derived from it as before. Both state classes must be in
+     * the list of states. The state query, `state<state_type>()`, still
+     * matches derived state classes.
+     * 
+     * @tparam new_state The type of the target state, which must inherit from
+     * `base_state`.
+     * @param dataptr Opaque pointer to user data.
+     * @return true on successfull state transition, false on error.
+     */
+    template <
+      typename from_state, typename to_state,
+      typename std::enable_if<
+        is_type_complete_v<transition<from_state, to_state>>,
+        bool
+      >::type = false
+    >
+    bool transition(void *dataptr) {
+      static_assert(is_valid_state<from_state>(), "Invalid source state");
+      static_assert(is_valid_state<to_state>(), "Invalid target state");
+
+      CFSM_PROBE3(transition_entry, this, state_index<from_state>(),
+          state_index<to_state>());
+#ifdef CFSM_TRACE
+      std::uint64_t trace_begin = trace::now();
+#endif
+#ifdef CFSM_LATENCY
+      latency<state_machine>::mark(latency_mark::began);
+#endif
+      lock_acquire();
+#ifdef CFSM_LATENCY
+      latency<state_machine>::mark(latency_mark::locked);
+#endif
+
+      if (!has_current_state()) {
+        lock_release();
+        CFSM_PROBE4(transition_return, this, state_index<from_state>(),
+            state_index<to_state>(), false);
+        throw std::runtime_error("State pointer is null");
+      }
+  
+#if __cplusplus >= 201402L
+
+      if (current_index != state_index<from_state>()) {
+        lock_release();
+        CFSM_PROBE4(transition_return, this, state_index<from_state>(),
+            state_index<to_state>(), false);
+        return false;
+      }
+
+#else /* __cplusplus >= 201402L */
+
+      if (dynamic_cast<from_state*>(p_current_state.get()) == nullptr) {
+        lock_release();
+        return false;
+      }
+
+#endif /* __cplusplus >= 201402L */
+
+      if (!switch_state<from_state, to_state, true>(dataptr)) {
+        lock_release();
+        CFSM_PROBE4(transition_return, this, state_index<from_state>(),
+            state_index<to_state>(), false);
+        std::ostringstream oss;
+        oss << "Failed to allocate new state, state_pool: " << state_pool;
+        throw std::runtime_error(oss.str());
+      }
+
+#if __cplusplus >= 201703L
+
+      record_transition(state_index<from_state>(), state_index<to_state>());
+
+#endif /* __cplusplus >= 201703L */
+  
+      lock_release();
+
+#ifdef CFSM_LATENCY
+      latency<state_machine>::commit(state_index<from_state>(),
+          state_index<to_state>());
+#endif
+#ifdef CFSM_TRACE
+      trace::record({this, state_names.data(), trace_begin, trace::now(),
+          static_cast<std::uint32_t>(state_index<from_state>()),
+          static_cast<std::uint32_t>(settled_index<to_state>())});
+#endif
+      CFSM_PROBE4(transition_return, this, state_index<from_state>(),
+          state_index<to_state>(), true);
+
+      return true;
+    }
+
+#if __cplusplus >= 201703L
+
+    /**
+     * @brief Drives the state machine to a target state along a shortest
+     * route of defined transitions.
+     *
+     * Routes from every state are computed at compile time from the defined
+     * transition functors. The transitions along the route are performed
+     * under a single lock acquisition, calling exit actions, transition
+     * functors and entry actions as `transition` does.
+     *
+     * @tparam target_state The type of the target state.
+     * @param dataptr Opaque pointer to user data.
+     * @return true if the state machine is in the target state, false if the
+     * target state is unreachable from the current state.
+     */
+    template <typename target_state>
+    bool go_to(void *dataptr) {
+      static_assert(is_valid_state<target_state>(), "Invalid target state");
+      static_assert(!has_completion<target_state>::value,
+          "Target state is left by a completion transition");
+
+      lock_acquire();
+
+      if (!has_current_state()) {
+        lock_release();
+        throw std::runtime_error("State pointer is null");
+      }
+
+      route_status status = follow_route<state_index<target_state>()>(
+          dataptr, std::make_index_sequence<sizeof...(states)>());
+
+      lock_release();
+
+      if (status == route_status::failed) {
+        std::ostringstream oss;
+        oss << "Failed to allocate new state, state_pool: " << state_pool;
+        throw std::runtime_error(oss.str());
+      }
+
+      return status == route_status::done;
+    }
+
+    /**
+     * @brief Transitions the state machine between states given by their
+     * indices.
+     *
+     * Looks up the transition in a table generated at compile time and
+     * performs it as `transition` does for the corresponding state classes.
+     * Indices are positions of the state classes in `states`, see
+     * `state_index`.
+     *
+     * @param from_index Index of the source state.
+     * @param to_index Index of the target state.
+     * @param dataptr Opaque pointer to user data.
+     * @return true on successfull state transition, false if the state
+     * machine is not in the source state, either index is out of range or no
+     * transition functor is defined for the pair of states.
+     */
+    bool transition_by_id(
+        std::size_t from_index,
+        std::size_t to_index,
+        void *dataptr
+    ) {
+      constexpr std::size_t count = sizeof...(states);
+      static constexpr std::array<trampoline_type, count * count> table =
+        transition_table(std::make_index_sequence<count * count>());
+
+      if (from_index >= count || to_index >= count) {
+        return false;
+      }
+
+      return table[from_index * count + to_index](*this, dataptr);
+    }
+
+    /**
+     * @brief Returns the index of the current state.
+     *
+     * @return Position of the current state class in `states`, `npos` if the
+     * state machine is not started.
+     */
+    std::size_t state_id() {
+      lock_acquire();
+      std::size_t index = has_current_state() ? current_index : npos;
+      lock_release();
+
+      return index;
+    }
+
+#ifdef CFSM_LOCK_STATS_PER_MACHINE
+
+    /**
+     * @brief Returns the lock contention of this state machine.
+     *
+     * The lock is taken without counting the acquisition.
+     *
+     * @param reset Whether to zero the counts.
+     * @return The counts since construction or the last reset.
+     */
+    lock_counts lock_contention(bool reset = false) {
+      while (lock.exchange(true, std::memory_order_acquire)) {
+#if __cplusplus >= 202002L
+        lock.wait(true);
+#endif
+      }
+      lock_counts counts = lock_history;
+      if (reset) {
+        lock_history = lock_counts();
+      }
+      lock_release();
+
+      return counts;
+    }
+
+#endif /* CFSM_LOCK_STATS_PER_MACHINE */
+
+#endif /* __cplusplus >= 201703L */
+  
+    /**
+     * @brief Stops the state machine.
+     *
+     * This function calls the `on_exit` member function and frees the current
+     * state object. The `start` member function is required to be called for
+     * the state machine to start operating.
+     *
+     * @param dataptr Opaque pointer to user data.
+     */
+    void stop(void *dataptr) {
+      CFSM_PROBE1(stop_entry, this);
+#ifdef CFSM_TRACE
+      std::uint64_t trace_begin = trace::now();
+#endif
+#if defined(CFSM_TRACE) || defined(CFSM_HAS_USDT)
+      std::uint32_t from = journal_stopped;
+#endif
+      lock_acquire();
+
+      do {
+        if (!has_current_state()) {
+          break;
+        }
+
+#if (defined(CFSM_TRACE) || defined(CFSM_HAS_USDT)) && \
+  __cplusplus >= 201402L
+
+        from = static_cast<std::uint32_t>(current_index);
+
+#endif
+
+#if __cplusplus >= 201703L
+
+        exit_current_state(dataptr);
+        record_transition(current_index, journal_stopped);
+
+#else /* __cplusplus >= 201703L */
+
+        p_current_state->on_exit(dataptr);
+
+#endif /* __cplusplus >= 201703L */
+
+        delete_current_state();
+
+#if __cplusplus >= 201402L
+
+        state_allocator<cfsm::state, sizeof...(states)>::delete_state_pool();
+
+#endif
+
+      } while (0);
+
+      lock_release();
+
+#ifdef CFSM_TRACE
+      if (from != journal_stopped) {
+        trace::record({this, state_names.data(), trace_begin, trace::now(),
+            from, journal_stopped});
+      }
+#endif
+      CFSM_PROBE2(stop_return, this, from);
+    }
+
+    /**
+     * @brief Returns pointer to constant current state object.
+     *
+     * This function template returns a pointer of the state type provided as
+     * template argument which points to constant object of the current state 
+     * class. If the current state object does not belong the the state type
+     * requested, nullptr is returned.
+     *
+     * @tparam state_type The expected state class of the current state.
+     * @return Pointer of the state class provided as template parameter.
+     */
+    template<typename state_type = base_state>
+    const state_type* state() {
+      state_type *cur_state = nullptr;
+
+      lock_acquire();
+      cur_state = current_state_cast<state_type>();
+      lock_release();
+
+      return cur_state;
+    }
+
+#if __cplusplus < 201703L
+
+    template<
+      int  = 0
+    >
+    std::size_t type_id_from_base_pointer(base_state_pointer_type ptr) {
+      return -1;
+    }
+
+    template<
+      typename first,
+      typename... rest
+    >
+    std::size_t type_id_from_base_pointer(base_state_pointer_type ptr) {
+      if (dynamic_cast<first*>(ptr) != nullptr) {
+        return first::type_id();
+      }
+      return type_id_from_base_pointer<rest...>(ptr);
+    }
+
+#endif /* __cplusplus < 201703L */
+
+#if __cplusplus >= 201703L
+
+  private:
+
+    /* Snapshot header and records */
+
+    /**
+     * @brief Writes a snapshot header.
+     *
+     * @param count Number of state machines the snapshot describes.
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @param flags Snapshot flags, `snapshot_flag_delta` for a delta.
+     * @param entries Number of entries of a delta.
+     * @param timestamp Time the snapshot was started at, see
+     * `timestamp_now`.
+     * @return Number of bytes written, 0 if the array is too small.
      */
-    template <typename T>
     static
-    constexpr bool is_valid_state() {
-      return disjunction_v<std::is_same<T, states>...>;
+    std::size_t save_header(std::size_t count, char *pdata,
+        std::size_t datalen, std::uint8_t flags = 0,
+        std::uint64_t entries = 0, std::uint64_t timestamp = timestamp_now()) {
+      constexpr std::size_t fixed_size =
+        sizeof(std::uint32_t) + 2 + 2 * sizeof(std::uint64_t);
+
+      if (datalen < fixed_size) {
+        return 0;
+      }
+
+      encode_fixed(snapshot_magic, sizeof(std::uint32_t), pdata);
+      pdata[4] = static_cast<char>(snapshot_version);
+      pdata[5] = static_cast<char>(flags);
+      encode_fixed(schema_hash(), sizeof(std::uint64_t), pdata + 6);
+      encode_fixed(timestamp, sizeof(std::uint64_t), pdata + 14);
+
+      std::size_t size =
+        encode_varint(count, pdata + fixed_size, datalen - fixed_size);
+      if (!size) {
+        return 0;
+      }
+      size += fixed_size;
+
+      std::size_t tail_size = crc_size +
+        (flags & snapshot_flag_delta ? sizeof(std::uint64_t) : 0);
+      if (datalen - size < tail_size) {
+        return 0;
+      }
+      if (flags & snapshot_flag_delta) {
+        encode_fixed(entries, sizeof(std::uint64_t), pdata + size);
+        size += sizeof(std::uint64_t);
+      }
+      encode_fixed(crc32c(pdata, size), crc_size, pdata + size);
+
+      return size + crc_size;
     }
 
-#else /* __cplusplus >= 201402L */
+    /**
+     * @brief Reads and validates a snapshot header.
+     *
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @param count Number of state machines the snapshot describes.
+     * @param flags Expected snapshot flags.
+     * @param entries Number of entries of a delta, may be null otherwise.
+     * @param timestamp Time the snapshot was started at, may be null.
+     * @return Number of bytes read, 0 if the header is truncated, corrupted
+     * or does not match the format version, the flags or the schema of this
+     * state machine class.
+     */
+    static
+    std::size_t load_header(const char *pdata, std::size_t datalen,
+        std::uint64_t &count, std::uint8_t flags = 0,
+        std::uint64_t *entries = nullptr, std::uint64_t *timestamp = nullptr) {
+      constexpr std::size_t fixed_size =
+        sizeof(std::uint32_t) + 2 + 2 * sizeof(std::uint64_t);
+
+      if (datalen < fixed_size) {
+        return 0;
+      }
+      if (decode_fixed(sizeof(std::uint32_t), pdata) != snapshot_magic) {
+        return 0;
+      }
+      if (static_cast<std::uint8_t>(pdata[4]) != snapshot_version) {
+        return 0;
+      }
+      if (static_cast<std::uint8_t>(pdata[5]) != flags) {
+        return 0;
+      }
+      if (decode_fixed(sizeof(std::uint64_t), pdata + 6) != schema_hash()) {
+        return 0;
+      }
+
+      std::size_t size =
+        decode_varint(pdata + fixed_size, datalen - fixed_size, count);
+      if (!size) {
+        return 0;
+      }
+      size += fixed_size;
+
+      std::size_t tail_size = crc_size +
+        (flags & snapshot_flag_delta ? sizeof(std::uint64_t) : 0);
+      if (datalen - size < tail_size) {
+        return 0;
+      }
+      if (flags & snapshot_flag_delta) {
+        if (entries) {
+          *entries = decode_fixed(sizeof(std::uint64_t), pdata + size);
+        }
+        size += sizeof(std::uint64_t);
+      }
+      if (crc32c(pdata, size) != decode_fixed(crc_size, pdata + size)) {
+        return 0;
+      }
+      if (timestamp) {
+        *timestamp = decode_fixed(sizeof(std::uint64_t), pdata + 14);
+      }
+
+      return size + crc_size;
+    }
 
     /**
-     * @brief Checks if a given type is derived from a base state.
-     * 
-     * This static function evaluates whether the given type `T` is derived
-     * from the predefined `base_state` type.
-     * 
-     * @tparam T The type to be checked.
-     * @return constexpr bool `true` if `T` is derived from `base_state`,
-     * `false` otherwise.
+     * @brief Returns the largest size of the payload of a state.
+     *
+     * Length prefix and serialized data, 0 without a payload trait.
+     *
+     * @tparam state_type The state class.
      */
-    template <typename T>
+    template <typename state_type>
     static
-    constexpr bool is_valid_state() {
-      return std::is_base_of<base_state, T>::value;
+    constexpr std::size_t payload_bound() {
+      if constexpr (has_payload<state_type>::value) {
+        return varint_size(payload<state_type>::max_size) +
+          payload<state_type>::max_size;
+      } else {
+        return 0;
+      }
     }
 
-#endif /* __cplusplus >= 201402L */
-  
+    /// Whether no state class has a payload trait.
+    static constexpr bool payload_free = (!has_payload<states>::value && ...);
+
     /**
-     * @brief Provides a pointer to an object of requested state class.
-     * 
-     * This struct contains a static method named `state` which returns a
-     * pointer of `alloc_base_state` class.
+     * @brief Writes the payload of the current state.
+     *
+     * @tparam state_type The state class of the current state.
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @return Number of bytes written, 0 if the array is too small.
+     */
+    template <typename state_type>
+    std::size_t save_payload(char *pdata, std::size_t datalen) {
+      static_assert(type == alloc_type::LAZY || type == alloc_type::INPLACE,
+          "State payloads need state objects of their own, shared state "
+          "objects would get the payload of the last loaded state machine");
+
+      constexpr std::size_t max_size = payload<state_type>::max_size;
+      constexpr std::size_t prefix_size = varint_size(max_size);
+
+      if (datalen < prefix_size) {
+        return 0;
+      }
+
+      /* The length prefix is padded to its largest size */
+      std::size_t size = payload<state_type>::save(
+          *current_state_as<state_type>(), pdata + prefix_size,
+          std::min(datalen - prefix_size, max_size));
+      if (!size) {
+        return 0;
+      }
+
+      for (std::size_t i = 0; i < prefix_size; ++i) {
+        std::uint8_t byte = (size >> (7 * i)) & 0x7f;
+        pdata[i] = static_cast<char>(i + 1 < prefix_size ? byte | 0x80 : byte);
+      }
+
+      return prefix_size + size;
+    }
+
+    /**
+     * @brief Reads the payload of the current state.
+     *
+     * @tparam state_type The state class of the current state.
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @return Number of bytes read, 0 if the payload is invalid.
+     */
+    template <typename state_type>
+    std::size_t load_payload(const char *pdata, std::size_t datalen) {
+      static_assert(type == alloc_type::LAZY || type == alloc_type::INPLACE,
+          "State payloads need state objects of their own, shared state "
+          "objects would get the payload of the last loaded state machine");
+
+      std::uint64_t size = 0;
+      std::size_t prefix_size = decode_varint(pdata, datalen, size);
+      if (!prefix_size || size > payload<state_type>::max_size ||
+          size > datalen - prefix_size) {
+        return 0;
+      }
+
+      if (!payload<state_type>::load(*current_state_as<state_type>(),
+            pdata + prefix_size, size)) {
+        return 0;
+      }
+
+      return prefix_size + size;
+    }
+
+    /**
+     * @brief Writes the record of this state machine.
+     *
+     * The record is the current state index plus one, zero for a stopped
+     * state machine, as an unsigned LEB128 integer. It is followed by the
+     * length prefixed payload if the current state has a payload trait.
+     *
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @return Number of bytes written, 0 if the array is too small.
+     */
+    std::size_t save_record(char *pdata, std::size_t datalen) {
+      lock_acquire();
+      std::uint64_t record = has_current_state() ? current_index + 1 : 0;
+
+      std::size_t size = encode_varint(record, pdata, datalen);
+      if (size && record) {
+        ([&] {
+          if constexpr (has_payload<states>::value) {
+            if (current_index == state_index<states>()) {
+              std::size_t payload_size =
+                save_payload<states>(pdata + size, datalen - size);
+              size = payload_size ? size + payload_size : 0;
+            }
+          }
+        }(), ...);
+      }
+      lock_release();
+
+      return size;
+    }
+
+    /**
+     * @brief Reads the record of this state machine and restores its state.
+     *
+     * Entry and exit actions are not called.
+     *
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @return Number of bytes read, 0 if the record is invalid or a state
+     * object could not be obtained.
+     */
+    std::size_t load_record(const char *pdata, std::size_t datalen) {
+      std::uint64_t record = 0;
+      std::size_t size = decode_varint(pdata, datalen, record);
+      if (!size || record > sizeof...(states)) {
+        return 0;
+      }
+
+      bool loaded = record == 0;
+
+      lock_acquire();
+      if (loaded) {
+        delete_current_state();
+      } else {
+        ([&] {
+          if (record - 1 == state_index<states>()) {
+            loaded = emplace_state<states>();
+            if constexpr (has_payload<states>::value) {
+              if (loaded) {
+                std::size_t payload_size =
+                  load_payload<states>(pdata + size, datalen - size);
+                size += payload_size;
+                loaded = payload_size != 0;
+              }
+            }
+          }
+        }(), ...);
+      }
+      lock_release();
+
+      return loaded ? size : 0;
+    }
+
+    /**
+     * @brief Returns the size of a record without restoring it.
+     *
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @return Number of bytes of the record, 0 if the record is invalid.
+     */
+    static
+    std::size_t record_length(const char *pdata, std::size_t datalen) {
+      std::uint64_t record = 0;
+      std::size_t size = decode_varint(pdata, datalen, record);
+      if (!size || record > sizeof...(states)) {
+        return 0;
+      }
+
+      bool valid = true;
+      ([&] {
+        if constexpr (has_payload<states>::value) {
+          if (record == state_index<states>() + 1) {
+            std::uint64_t length = 0;
+            std::size_t prefix_size =
+              decode_varint(pdata + size, datalen - size, length);
+            valid = prefix_size && length <= payload<states>::max_size &&
+              length <= datalen - size - prefix_size;
+            size += prefix_size + length;
+          }
+        }
+      }(), ...);
+
+      return valid ? size : 0;
+    }
+
+  public:
+
+    /**
+     * @brief Returns the schema hash of the state machine class.
+     *
+     * Hash over the names of the state classes in the order of `states` and
+     * the largest payload sizes of the states with a payload trait.
+     * Snapshots are loaded only by state machines with the same schema hash.
+     *
+     * @return The 64 bit hash.
+     */
+    static
+    constexpr std::uint64_t schema_hash() {
+      std::uint64_t hash = fnv1a_offset;
+      ((hash = (hash ^ type_name_hash<states>()) * fnv1a_prime,
+        hash = (hash ^ payload_bound<states>()) * fnv1a_prime), ...);
+      return hash;
+    }
+
+    /**
+     * @brief Returns the largest size of a snapshot of given number of state
+     * machines.
+     *
+     * @param count Number of state machines.
+     * @return Size in bytes.
+     */
+    static
+    constexpr std::size_t snapshot_bound(std::size_t count) {
+      return snapshot_header_max_size + count * record_bound() +
+        snapshot_frames(count) * snapshot_frame_overhead;
+    }
+
+    /**
+     * @brief Returns the largest size of the record of a state machine.
+     *
+     * @return Size in bytes.
+     */
+    static
+    constexpr std::size_t record_bound() {
+      return varint_size(sizeof...(states)) +
+        std::max({payload_bound<states>()...});
+    }
+
+    /**
+     * @brief Saves the states of an array of state machines to memory.
+     *
+     * Writes a snapshot header, holding the format version, the schema hash
+     * and the number of state machines, followed by one varint record per
+     * state machine in a single pass. Records are grouped into frames of
+     * `snapshot_frame_records` records, each with its size and CRC32C
+     * checksum, and the header carries its own checksum. Each state machine is
+     * locked while its record is written.
+     *
+     * @param machines Pointer to the array of state machines.
+     * @param count Number of state machines.
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @return Number of bytes written, 0 if the array is too small.
+     * @see snapshot_bound(std::size_t)
+     */
+    static
+    std::size_t save_many(state_machine *machines, std::size_t count,
+        char *pdata, std::size_t datalen) {
+      if (!pdata || (!machines && count)) {
+        return 0;
+      }
+
+      std::size_t offset = save_header(count, pdata, datalen);
+      if (!offset) {
+        return 0;
+      }
+
+      frame_writer writer(pdata, datalen, offset);
+      for (std::size_t i = 0; i < count; ++i) {
+        if (!writer.begin_record()) {
+          return 0;
+        }
+        std::size_t size = machines[i].save_record(writer.data(),
+            writer.space());
+        if (!size) {
+          return 0;
+        }
+        writer.end_record(size);
+      }
+
+      return writer.finish();
+    }
+
+    /**
+     * @brief Loads the states of an array of state machines from memory.
+     *
+     * Validates the snapshot header and restores the state machines from
+     * their records in a single pass. The checksum of each frame is verified
+     * before its records are restored, while the frame is brought into the
+     * cache. Entry and exit actions are not called. On error the state
+     * machines before the invalid frame or record are already restored.
+     *
+     * @param machines Pointer to the array of state machines.
+     * @param count Number of state machines, shall match the snapshot.
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @return Number of bytes read, 0 on error.
+     */
+    static
+    std::size_t load_many(state_machine *machines, std::size_t count,
+        const char *pdata, std::size_t datalen) {
+      if (!pdata || (!machines && count)) {
+        return 0;
+      }
+
+      std::uint64_t saved_count = 0;
+      std::size_t offset = load_header(pdata, datalen, saved_count);
+      if (!offset || saved_count != count) {
+        return 0;
+      }
+
+      frame_reader reader(pdata, datalen, offset);
+      for (std::size_t i = 0; i < count; ++i) {
+        if (!reader.begin_record()) {
+          return 0;
+        }
+        std::size_t size = machines[i].load_record(reader.data(),
+            reader.space());
+        if (!size || !reader.end_record(size, i + 1 == count)) {
+          return 0;
+        }
+      }
+
+      return reader.position();
+    }
+
+    /**
+     * @brief Loads the states of an array of state machines from memory with
+     * several threads.
+     *
+     * Validates the snapshot header once and splits the frames into one
+     * contiguous range per thread, following the size prefixes of the frames.
+     * Every range is verified and restored by its own thread, including the
+     * allocation of state objects. Entry and exit actions are not called. On
+     * error an unspecified subset of the state machines is restored.
      *
-     * @tparam alloc_base_state The base state class.
-     * @tparam size The size of the state object pointer array.
+     * @param machines Pointer to the array of state machines.
+     * @param count Number of state machines, shall match the snapshot.
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @param threads Number of threads including the calling one, 0 for the
+     * number of hardware threads.
+     * @return Number of bytes read, 0 on error.
+     * @see load_many()
      */
-    template <typename alloc_base_state, std::size_t size = 0>
-    struct state_allocator {
-
-      private:
+    static
+    std::size_t load_many_parallel(state_machine *machines, std::size_t count,
+        const char *pdata, std::size_t datalen, std::size_t threads = 0) {
+      if (!pdata || (!machines && count)) {
+        return 0;
+      }
 
-#if __cplusplus >= 201402L
+      std::uint64_t saved_count = 0;
+      std::size_t offset = load_header(pdata, datalen, saved_count);
+      if (!offset || saved_count != count) {
+        return 0;
+      }
 
-      /**
-       * @brief Manages a pool of state objects.
-       *
-       * The `internal_state_pool` struct is used to manage a collection (pool)
-       * of state objects, offering a pointer to this pool and ensuring proper
-       * cleanup of dynamically allocated objects.
-       */
-      struct internal_state_pool {
+      std::size_t frames = snapshot_frames(count);
+      if (!threads) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+      }
+      threads = std::max(std::min(threads, frames), std::size_t(1));
+
+      /* Byte offsets of the frames, plus the end */
+      std::vector<std::size_t> start(frames + 1);
+      for (std::size_t f = 0; f < frames; ++f) {
+        start[f] = offset;
+        std::size_t size = frame_reader::frame_size(pdata, datalen, offset);
+        if (!size) {
+          return 0;
+        }
+        offset += size;
+      }
+      start[frames] = offset;
 
-        alloc_base_state *pool[sizeof...(states)];
+      if constexpr (type == alloc_type::INTERNAL ||
+          type == alloc_type::STATIC) {
+        /* The shared pool is created before the threads use it */
+        allocate_state<state_at<0>>();
+      }
 
-        /**
-         * @brief Constructs an internal state pool and allocates state objects.
-         *
-         * Initializes the pool with dynamically allocated objects of
-         * each state type provided in the `states` parameter pack.
-         */
-        internal_state_pool() {
-          alloc_base_state *pool_[sizeof...(states)] = { new states... };
-          for (std::size_t i = 0; i < sizeof...(states); ++i) {
-            pool[i] = pool_[i];
+      std::atomic<bool> ok{true};
+      auto restore = [&](std::size_t t) {
+        std::size_t first =
+          frames / threads * t + std::min(t, frames % threads);
+        std::size_t last = first + frames / threads + (t < frames % threads);
+        std::size_t end = std::min(last * snapshot_frame_records, count);
+
+        frame_reader reader(pdata, start[last], start[first]);
+        for (std::size_t i = first * snapshot_frame_records; i < end; ++i) {
+          if (!reader.begin_record()) {
+            ok.store(false, std::memory_order_relaxed);
+            return;
           }
-        }
-
-        /**
-         * @brief Destroys the internal state pool and releases memory.
-         *
-         * Frees each dynamically allocated state object.
-         */
-        ~internal_state_pool() {
-          for (std::size_t i = 0; i < sizeof...(states); ++i) {
-            delete pool[i];
+          std::size_t size = machines[i].load_record(reader.data(),
+              reader.space());
+          if (!size || !reader.end_record(size, i + 1 == count)) {
+            ok.store(false, std::memory_order_relaxed);
+            return;
           }
         }
-
       };
 
-#endif /* __cplusplus >= 201402L */
+      std::vector<std::thread> workers;
+      workers.reserve(threads - 1);
+      for (std::size_t t = 1; t < threads; ++t) {
+        workers.emplace_back(restore, t);
+      }
+      restore(0);
+      for (auto &worker : workers) {
+        worker.join();
+      }
 
-      public:
+      return ok.load(std::memory_order_relaxed) ? offset : 0;
+    }
 
-      /**
-       * @brief Provides a pointer to an object of requested state class from
-       * given array of pointers.
-       *
-       * Takes an array of base state class pointers as argument. The pointers
-       * in this array shall point to state objects of the classes enlisted with
-       * the state machine. This array is indexed into using `type_id` argument
-       * to get the address of an object of the requested state class.
-       *
-       * @param pool The state object pointers array.
-       * @param type_id The type identifier of the derived state class which
-       * the address of an object of, is returned in the base state class
-       * pointer.
-       * @return A pointer to derived state class object of the base state
-       * class.
-       */
-      static
-      alloc_base_state* state(alloc_base_state *pool[size],
-          const std::size_t type_id) {
-        return type_id < size ? pool[type_id] : nullptr;
-      }
+    /**
+     * @brief Save the state machine's state to memory.
+     *
+     * Writes a snapshot of this state machine alone.
+     *
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @return Number of bytes written, 0 if the array is too small.
+     * @see save_many()
+     */
+    std::size_t save(char *pdata, std::size_t datalen) {
+      return save_many(this, 1, pdata, datalen);
+    }
 
-#if __cplusplus >= 201402L
+    /**
+     * @brief Load the state machine's state from memory.
+     *
+     * Reads a snapshot of a single state machine.
+     *
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @return Number of bytes read, 0 on error.
+     * @see load_many()
+     */
+    std::size_t load(const char *pdata, const std::size_t datalen) {
+      return load_many(this, 1, pdata, datalen);
+    }
 
-    private:
+    /**
+     * @brief Packed record of a state machine, the current state index plus
+     * one, zero for a stopped state machine.
+     */
+    using packed_type = index_type;
 
-      static
-      internal_state_pool*& get_state_pool() {
-        static internal_state_pool *p_statepool_ = nullptr;
-        return !p_statepool_ ? (p_statepool_ = new internal_state_pool)
-          : p_statepool_;
-      }
+    /// Number of states.
+    static constexpr std::size_t state_total = sizeof...(states);
 
-    public:
+    /// Names of the state classes in the order of `states`.
+    static constexpr std::array<std::string_view, sizeof...(states)>
+      state_names = {{type_name<states>()...}};
 
-      /**
-       * @brief Provides a pointer to an object of requested state class from
-       * internally managed array of pointers.
-       *
-       * Allocates objects of enlisted state classes and stores their addresses
-       * in an array of base state class pointers. This array is indexed into
-       * using `type_id` argument to get the address of an object of the
-       * requested state class.
-       *
-       * @param type_id The type identifier of the derived state class which
-       * the address of an object of, is returned in the base state class
-       * pointer.
-       * @return A pointer to derived state class object of the base state
-       * class.
-       */
-      template <
-        enum alloc_type type_ = type,
-        typename std::enable_if<type_ == alloc_type::INTERNAL, int>::type = 0
-      >
-      static
-      alloc_base_state* state(const std::size_t type_id) {
-        internal_state_pool *p_statepool = get_state_pool();
-        return p_statepool && type_id < size ? p_statepool->pool[type_id]
-          : nullptr;
+    /**
+     * @brief Saves the states of an array of state machines to an array of
+     * packed records.
+     *
+     * Each state machine is locked while its record is written.
+     *
+     * @param machines Pointer to the array of state machines.
+     * @param count Number of state machines.
+     * @param records Pointer to the array of `count` records.
+     */
+    static
+    void save_packed(state_machine *machines, std::size_t count,
+        packed_type *records) {
+      for (std::size_t i = 0; i < count; ++i) {
+        state_machine &fsm = machines[i];
+        fsm.lock_acquire();
+        records[i] = fsm.has_current_state() ?
+          static_cast<packed_type>(fsm.current_index + 1) : 0;
+        fsm.lock_release();
       }
+    }
 
-      template <
-        enum alloc_type type_ = type,
-        typename std::enable_if<type_ == alloc_type::STATIC, int>::type = 0
-      >
-      static
-      alloc_base_state* state(const std::size_t type_id) {
-        static internal_state_pool p_statepool_;
-        return type_id < size ? p_statepool_.pool[type_id] : nullptr;
-      }
+    /**
+     * @brief Restores the states of an array of state machines from an array
+     * of packed records.
+     *
+     * Entry and exit actions are not called.
+     *
+     * @param machines Pointer to the array of state machines.
+     * @param count Number of state machines.
+     * @param records Pointer to the array of `count` records.
+     * @return false if a record is invalid or a state object could not be
+     * obtained, the state machines before it are already restored.
+     */
+    static
+    bool load_packed(state_machine *machines, std::size_t count,
+        const packed_type *records) {
+      for (std::size_t i = 0; i < count; ++i) {
+        if (records[i] > sizeof...(states)) {
+          return false;
+        }
 
-      template <
-        enum alloc_type type_ = type,
-        typename std::enable_if<type_ == alloc_type::INTERNAL, int>::type = 0
-      >
-      static
-      void delete_state_pool() {
-        internal_state_pool *&statepool = get_state_pool();
-        statepool ? delete statepool : (void)0;
-        statepool = nullptr;
-      }
+        state_machine &fsm = machines[i];
+        bool loaded = true;
+        fsm.lock_acquire();
+        if (records[i] == 0) {
+          fsm.delete_current_state();
+        } else {
+          loaded = fsm.emplace_state_at(records[i] - 1);
+        }
+        fsm.lock_release();
 
-      template <
-        enum alloc_type type_ = type,
-        typename std::enable_if<type_ != alloc_type::INTERNAL, int>::type = 0
-      >
-      static
-      void delete_state_pool() {
+        if (!loaded) {
+          return false;
+        }
       }
 
-#endif /* __cplusplus >= 201402L */
+      return true;
+    }
+
+    /* Compressed snapshots */
 
-    };
-  
     /**
-     * @brief Free the current state object.
+     * @brief Returns the largest size of a compressed snapshot of given
+     * number of state machines.
      *
-     * Sets the current state pointer as nullptr;
+     * @param count Number of state machines.
+     * @return Size in bytes.
+     * @see save_many_compressed()
      */
-    void delete_current_state() {
-      if (type == alloc_type::LAZY) {
-        p_current_state.reset();
-      }
-      p_current_state = nullptr;
+    static
+    constexpr std::size_t compressed_bound(std::size_t count) {
+      constexpr std::size_t width = packed_width(sizeof...(states));
+      std::size_t runs = count / repeated_run_min + 1;
+      return snapshot_header_max_size +
+        runs * (varint_max_size + (width + 7) / 8) +
+        (count / packed_group_size + 1) * width +
+        snapshot_frames(runs) * snapshot_frame_overhead;
     }
 
-  public:
     /**
-     * @brief Functon template to fetch a pointer to an object of requested
-     * state class, from an array of base state class pointers.
+     * @brief Saves the states of an array of state machines to memory,
+     * run-length encoded and bit-packed.
      *
-     * This function is a wrapper over the actual implementation.
-     * @see state_allocator::state(allocate_state**, const std::size_t)
+     * Writes a snapshot header with the `snapshot_flag_compressed` flag
+     * followed by runs of packed records, see `save_packed`. A run of at
+     * least `repeated_run_min` equal records is written as its length and the
+     * record. Other records are bit-packed in groups of `packed_group_size`,
+     * each record taking `packed_width(sizeof...(states))` bits, the last
+     * group being padded with zeros. A run starts with a varint holding the
+     * length or the number of groups shifted left by one, the low bit is set
+     * for bit-packed runs. Runs are grouped into checksummed frames as
+     * records are. Only state machine classes without payload traits are
+     * supported.
      *
-     * @tparam new_state The requested state class.
-     * @tparam state_pool_ The state object pointer array.
-     * @return A pointer to derived state class object of the base state
-     * class.
+     * @param machines Pointer to the array of state machines.
+     * @param count Number of state machines.
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @return Number of bytes written, 0 if the array is too small.
+     * @see compressed_bound(std::size_t)
      */
-    template <
-      typename new_state,
-      enum alloc_type type_ = type,
-      typename std::enable_if<type_ == alloc_type::PREALLOCED, int>::type = 0
-    >
     static
-    base_state* allocate_state() {
+    std::size_t save_many_compressed(state_machine *machines,
+        std::size_t count, char *pdata, std::size_t datalen) {
+      static_assert(payload_free,
+          "State payloads are not saved in compressed snapshots");
 
-#if __cplusplus >= 201402L
+      constexpr std::size_t width = packed_width(sizeof...(states));
+      constexpr std::size_t value_size = (width + 7) / 8;
 
-      return state_allocator<cfsm::state, sizeof...(states)>::state(state_pool,
-          new_state::type_id());
+      if (!pdata || (!machines && count)) {
+        return 0;
+      }
 
-#else
+      std::size_t offset = save_header(count, pdata, datalen,
+          snapshot_flag_compressed);
+      if (!offset) {
+        return 0;
+      }
 
-      return state_allocator<cfsm::state, state_count>
-        ::state(state_pool, new_state::type_id());
+      /* Zero padded for the last group */
+      std::vector<packed_type> records(count + packed_group_size);
+      save_packed(machines, count, records.data());
 
-#endif
+      auto run_length = [&](std::size_t i, std::size_t limit) {
+        std::size_t j = i + 1;
+        limit = std::min(limit, count - i);
+        while (j - i < limit && records[j] == records[i]) {
+          ++j;
+        }
+        return j - i;
+      };
 
-    }
-  
-    /* Internal allocator is unavailable below C++14 */
+      frame_writer writer(pdata, datalen, offset);
+      for (std::size_t i = 0; i < count;) {
+        if (!writer.begin_record()) {
+          return 0;
+        }
 
-#if __cplusplus >= 201402L
+        std::size_t run = run_length(i, count);
+        std::size_t size = 0;
+        if (run >= repeated_run_min) {
+          size = encode_varint(static_cast<std::uint64_t>(run) << 1,
+              writer.data(), writer.space());
+          if (!size || writer.space() - size < value_size) {
+            return 0;
+          }
+          encode_fixed(records[i], value_size, writer.data() + size);
+          size += value_size;
+          i += run;
+        } else {
+          std::size_t groups = 0;
+          std::size_t j = i;
+          do {
+            j += packed_group_size;
+            ++groups;
+          } while (groups < packed_run_max_groups && j < count &&
+              run_length(j, repeated_run_min) < repeated_run_min);
+
+          size = encode_varint(static_cast<std::uint64_t>(groups) << 1 | 1,
+              writer.data(), writer.space());
+          if (!size || writer.space() - size < groups * width) {
+            return 0;
+          }
+          for (std::size_t g = 0; g < groups; ++g) {
+            pack_group(records.data() + i + g * packed_group_size, width,
+                writer.data() + size + g * width);
+          }
+          size += groups * width;
+          i = j;
+        }
+
+        writer.end_record(size);
+      }
+
+      return writer.finish();
+    }
 
     /**
-     * @brief Functon template to fetch a pointer to an object of requested
-     * state class, from an internally managed array of base state class
-     * pointers.
+     * @brief Loads the states of an array of state machines from a
+     * compressed snapshot.
      *
-     * This function is a wrapper over the actual implementation.
-     * @see state_allocator::state(const std::size_t)
+     * Bit-packed runs are unpacked a group at a time into a buffer of packed
+     * records and repeated runs fill the buffer once, the buffer is then
+     * restored with `load_packed`. The checksum of each frame is verified
+     * before its runs are restored. Entry and exit actions are not called. On
+     * error the state machines before the invalid frame or run are already
+     * restored.
      *
-     * @tparam new_state The requested state class.
-     * @tparam state_pool_ The state object pointer array.
-     * @return A pointer to derived state class object of the base state
-     * class.
+     * @param machines Pointer to the array of state machines.
+     * @param count Number of state machines, shall match the snapshot.
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @return Number of bytes read, 0 on error.
+     * @see save_many_compressed()
      */
-    template <
-      typename new_state,
-      enum alloc_type type_ = type,
-      typename std::enable_if <
-        type_ == alloc_type::INTERNAL || type_ == alloc_type::STATIC,
-        int
-      >::type = 0
-    >
     static
-    base_state* allocate_state() {
-      return state_allocator<cfsm::state, sizeof...(states)>
-        ::state(new_state::type_id());
+    std::size_t load_many_compressed(state_machine *machines,
+        std::size_t count, const char *pdata, std::size_t datalen) {
+      static_assert(payload_free,
+          "State payloads are not saved in compressed snapshots");
+
+      constexpr std::size_t width = packed_width(sizeof...(states));
+      constexpr std::size_t value_size = (width + 7) / 8;
+      constexpr std::size_t capacity =
+        packed_run_max_groups * packed_group_size;
+
+      if (!pdata || (!machines && count)) {
+        return 0;
+      }
+
+      std::uint64_t saved_count = 0;
+      std::size_t offset = load_header(pdata, datalen, saved_count,
+          snapshot_flag_compressed);
+      if (!offset || saved_count != count) {
+        return 0;
+      }
+
+      packed_type values[capacity];
+      frame_reader reader(pdata, datalen, offset);
+      for (std::size_t i = 0; i < count;) {
+        if (!reader.begin_record()) {
+          return 0;
+        }
+
+        std::uint64_t run = 0;
+        std::size_t size = decode_varint(reader.data(), reader.space(), run);
+        std::uint64_t length = run >> 1;
+        std::size_t left = count - i;
+        if (!size || !length) {
+          return 0;
+        }
+
+        if (run & 1) {
+          /* Only the last group may extend past the array */
+          std::size_t records = length * packed_group_size;
+          if (length > packed_run_max_groups ||
+              reader.space() - size < length * width ||
+              (records > left && records - left >= packed_group_size)) {
+            return 0;
+          }
+          for (std::size_t g = 0; g < length; ++g) {
+            unpack_group(reader.data() + size + g * width, width,
+                values + g * packed_group_size);
+          }
+          size += length * width;
+          records = std::min(records, left);
+          if (!load_packed(machines + i, records, values)) {
+            return 0;
+          }
+          i += records;
+        } else {
+          if (length > left || reader.space() - size < value_size) {
+            return 0;
+          }
+          packed_type value = static_cast<packed_type>(
+              decode_fixed(value_size, reader.data() + size));
+          size += value_size;
+          std::fill(values, values + std::min<std::uint64_t>(length, capacity),
+              value);
+          for (std::uint64_t done = 0; done < length;) {
+            std::size_t records = std::min<std::uint64_t>(length - done,
+                capacity);
+            if (!load_packed(machines + i + done, records, values)) {
+              return 0;
+            }
+            done += records;
+          }
+          i += length;
+        }
+
+        if (!reader.end_record(size, i == count)) {
+          return 0;
+        }
+      }
+
+      return reader.position();
     }
 
-#endif /* __cplusplus >= 201402L */
+    /* Incremental checkpoints */
 
     /**
-     * @brief Functon template to allocate a new state object and return its
-     * address as a pointer of base state class.
-     *
-     * Uses new operator on the requested state class.
+     * @brief Returns the largest size of a delta of given number of changed
+     * state machines.
      *
-     * @tparam new_state The requested state class.
-     * @tparam state_pool_ The state object pointer array.
-     * @return A pointer to derived state class object of the base state
-     * class.
+     * @param entries Number of changed state machines.
+     * @return Size in bytes.
      */
-    template <
-      typename new_state,
-      enum alloc_type type_ = type,
-      typename std::enable_if<type_ == alloc_type::LAZY, int>::type = 0
-    >
     static
-    base_state* allocate_state() {
-      return new new_state();
+    constexpr std::size_t delta_bound(std::size_t entries) {
+      return snapshot_header_max_size + sizeof(std::uint64_t) +
+        entries * (varint_max_size + record_bound()) +
+        snapshot_frames(entries) * snapshot_frame_overhead;
     }
 
     /**
-     * @brief Returns a non-negative integer of `std::size_t` type.
+     * @brief Marks the state machines of an array in a dirty set when they
+     * change state.
      *
-     * Returns incremented value of a static variable every time it gets called
-     * starting with zero. This function is static member of the "state_machine"
-     * class, hence can be used to assign type identifiers to derived state
-     * classes.
-     * 
-     * @return A non-negative integer.
+     * Successful starts, transitions, routes followed by `go_to` and stops
+     * mark the state machine at its position in the array. Changes of state
+     * object data outside of these calls are not tracked. Shall not be called
+     * while transitions are in progress.
+     *
+     * @param dirty The dirty set, it shall outlive the attachment.
+     * @param machines Pointer to the array of state machines.
      */
     static
-    std::size_t gen_type_id() {
-      static std::size_t type_id_gen = 0;
-      return type_id_gen++;
+    void attach_dirty_set(dirty_set *dirty, const state_machine *machines) {
+      dirty_machines = machines;
+      attached_dirty_set.store(dirty, std::memory_order_release);
     }
-  
-#if __cplusplus >= 201402L
 
     /**
-     * @brief Constructor for the state machine.
-     *
-     * Checks if the states provided as template parameters are derived from
-     * the base "state" class.
+     * @brief Stops marking changed state machines in the attached dirty set.
      */
-    state_machine() {
-      static_assert(are_valid_states<base_state, states...>::value,
-          "Invalid states in ctor");
+    static
+    void detach_dirty_set() {
+      attached_dirty_set.store(nullptr, std::memory_order_release);
     }
 
-#else /* __cplusplus >= 201402L */
-
     /**
-     * @brief Constructor for the state machine.
+     * @brief Saves the state machines marked in a dirty set to memory and
+     * clears their marks.
+     *
+     * Writes a snapshot header with the `snapshot_flag_delta` flag, the
+     * number of state machines of the array and the number of entries,
+     * followed by one entry per changed state machine in ascending order of
+     * position. An entry is the gap to the previous position as a varint
+     * followed by the record of the state machine as in `save_many`. Entries
+     * are grouped into checksummed frames as records are. A mark is cleared
+     * before the record is written, so a transition racing with the
+     * checkpoint is saved again by the next one.
+     *
+     * @param machines Pointer to the array of state machines.
+     * @param count Number of state machines, shall match the dirty set.
+     * @param dirty The dirty set.
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @return Number of bytes written, 0 if the array is too small, the marks
+     * are kept then.
+     * @see delta_bound(std::size_t)
      */
-    state_machine() = default;
+    static
+    std::size_t checkpoint_delta(state_machine *machines, std::size_t count,
+        dirty_set &dirty, char *pdata, std::size_t datalen) {
+      if (!pdata || (!machines && count) || dirty.size() != count) {
+        return 0;
+      }
 
-#endif /* __cplusplus >= 201402L */
-  
-    /**
-     * @brief Starts the state machine in an initial state.
-     * 
-     * The state machine transitions into the initial state and calls the
-     * state's `on_enter` member function.
-     * 
-     * @tparam initial_state The type of the initial state, which must inherit
-     * from `base_state`.
-     * @param dataptr Opaque pointer to user data.
-     */
-    template <typename initial_state>
-    void start(void *dataptr) {
-      static_assert(is_valid_state<initial_state>(), "Invalid initial state");
-  
-      lock_acquire();
+      /* Rewritten with the number of entries once known */
+      std::uint64_t started = timestamp_now();
+      std::size_t offset =
+        save_header(count, pdata, datalen, snapshot_flag_delta, 0, started);
+      if (!offset) {
+        return 0;
+      }
 
-      p_current_state =
-        base_state_type(state_machine::allocate_state<initial_state>());
-      if (!p_current_state) {
-        lock_release();
-        throw std::runtime_error("State pointer is null");
+      std::vector<std::pair<std::size_t, std::uint64_t>> taken;
+      frame_writer writer(pdata, datalen, offset);
+      std::uint64_t entries = 0;
+      std::size_t next_id = 0;
+      bool ok = true;
+
+      for (std::size_t w = 0; ok && w < dirty.word_count(); ++w) {
+        std::uint64_t bits = dirty.take_word(w);
+        if (!bits) {
+          continue;
+        }
+        taken.emplace_back(w, bits);
+
+        for (std::size_t b = 0; ok && b < 64; ++b) {
+          if (!((bits >> b) & 1)) {
+            continue;
+          }
+          std::size_t id = w * 64 + b;
+          if (!writer.begin_record()) {
+            ok = false;
+            break;
+          }
+          std::size_t gap_size =
+            encode_varint(id - next_id, writer.data(), writer.space());
+          std::size_t size = gap_size ?
+            machines[id].save_record(writer.data() + gap_size,
+                writer.space() - gap_size) : 0;
+          ok = size != 0;
+          writer.end_record(gap_size + size);
+          next_id = id + 1;
+          ++entries;
+        }
       }
-  
-      p_current_state->on_enter(dataptr);
 
-      lock_release();
+      if (!ok) {
+        for (auto &word : taken) {
+          dirty.restore_word(word.first, word.second);
+        }
+        return 0;
+      }
+
+      save_header(count, pdata, datalen, snapshot_flag_delta, entries,
+          started);
+
+      return writer.finish();
     }
-  
+
     /**
-     * @brief Transitions the state machine to a new state.
-     * 
-     * The state machine transitions from the current state to the new state
-     * and calls the appropriate `on_exit` member function for the current
-     * state and `on_enter` member function for the new state. It also invokes
-     * the transition functor for the specific transition between the two
-     * states.
-     * 
-     * @tparam new_state The type of the target state, which must inherit from
-     * `base_state`.
-     * @param dataptr Opaque pointer to user data.
-     * @return true on successfull state transition, false on error.
+     * @brief Applies a delta to an array of state machines.
+     *
+     * Restores the state machines of the entries of the delta, the others are
+     * left unchanged. Entry and exit actions are not called. On error the
+     * entries before the invalid frame or entry are already applied.
+     *
+     * @param machines Pointer to the array of state machines.
+     * @param count Number of state machines, shall match the delta.
+     * @param pdata Pointer to char array.
+     * @param datalen Size of the char array.
+     * @return Number of bytes read, 0 on error.
+     * @see checkpoint_delta()
      */
-    template <
-      typename from_state, typename to_state,
-      typename std::enable_if<
-        is_type_complete_v<transition<from_state, to_state>>,
-        bool
-      >::type = false
-    >
-    bool transition(void *dataptr) {
-      static_assert(is_valid_state<from_state>(), "Invalid source state");
-      static_assert(is_valid_state<to_state>(), "Invalid target state");
-
-      lock_acquire();
-
-      if (!p_current_state) {
-        lock_release();
-        throw std::runtime_error("State pointer is null");
+    static
+    std::size_t load_delta(state_machine *machines, std::size_t count,
+        const char *pdata, std::size_t datalen) {
+      if (!pdata || (!machines && count)) {
+        return 0;
       }
-  
-      if (dynamic_cast<from_state*>(p_current_state.get()) == nullptr) {
-        lock_release();
-        return false;
+
+      std::uint64_t saved_count = 0;
+      std::uint64_t entries = 0;
+      std::size_t offset = load_header(pdata, datalen, saved_count,
+          snapshot_flag_delta, &entries);
+      if (!offset || saved_count != count) {
+        return 0;
       }
 
-      base_state_pointer_type p_new_state =
-        state_machine::allocate_state<to_state>();
-      if (!p_new_state) {
-        lock_release();
-        std::ostringstream oss;
-        oss << "Failed to allocate new state, state_pool: " << state_pool;
-        throw std::runtime_error(oss.str());
+      frame_reader reader(pdata, datalen, offset);
+      std::size_t next_id = 0;
+      for (std::uint64_t i = 0; i < entries; ++i) {
+        if (!reader.begin_record()) {
+          return 0;
+        }
+        std::uint64_t gap = 0;
+        std::size_t gap_size = decode_varint(reader.data(), reader.space(),
+            gap);
+        if (!gap_size || gap >= count - next_id) {
+          return 0;
+        }
+
+        std::size_t id = next_id + gap;
+        std::size_t size = machines[id].load_record(reader.data() + gap_size,
+            reader.space() - gap_size);
+        if (!size || !reader.end_record(gap_size + size, i + 1 == entries)) {
+          return 0;
+        }
+        next_id = id + 1;
       }
-  
-      p_current_state->on_exit(dataptr);
-  
-      /* Call transition functor for "from_state" to "to_state" transition */
-      cfsm::transition<from_state, to_state>()(dataptr);
-  
-      p_current_state = base_state_type(p_new_state);
-      p_current_state->on_enter(dataptr);
-  
-      lock_release();
 
-      return true;
+      return reader.position();
     }
-  
+
     /**
-     * @brief Stops the state machine.
+     * @brief Merges a delta into a snapshot.
      *
-     * This function calls the `on_exit` member function and frees the current
-     * state object. The `start` member function is required to be called for
-     * the state machine to start operating.
+     * Writes a snapshot as `save_many` does, holding the records of the delta
+     * for the state machines it contains and the records of the base snapshot
+     * for the others. The checksums of both inputs are verified. Deltas are
+     * merged one at a time in the order they were taken. No state machines
+     * are involved.
      *
-     * @param dataptr Opaque pointer to user data.
+     * @param base Pointer to char array holding the snapshot.
+     * @param baselen Size of the snapshot.
+     * @param delta Pointer to char array holding the delta.
+     * @param deltalen Size of the delta.
+     * @param pdata Pointer to char array, shall not overlap the inputs.
+     * @param datalen Size of the char array.
+     * @return Number of bytes written, 0 if an input is invalid, they do not
+     * describe the same number of state machines or the array is too small.
      */
-    void stop(void *dataptr) {
-      lock_acquire();
+    static
+    std::size_t compact(const char *base, std::size_t baselen,
+        const char *delta, std::size_t deltalen, char *pdata,
+        std::size_t datalen) {
+      if (!base || !delta || !pdata) {
+        return 0;
+      }
 
-      do {
-        if (!p_current_state) {
-          break;
-        }
+      std::uint64_t count = 0;
+      std::uint64_t delta_count = 0;
+      std::uint64_t entries = 0;
+      std::uint64_t started = 0;
+      std::size_t base_offset = load_header(base, baselen, count);
+      std::size_t delta_offset = load_header(delta, deltalen, delta_count,
+          snapshot_flag_delta, &entries, &started);
+      if (!base_offset || !delta_offset || count != delta_count) {
+        return 0;
+      }
 
-        p_current_state->on_exit(dataptr);
+      /* The merged snapshot is as recent as the delta */
+      std::size_t offset = save_header(count, pdata, datalen, 0, 0, started);
+      if (!offset) {
+        return 0;
+      }
 
-        delete_current_state();
+      frame_reader base_reader(base, baselen, base_offset);
+      frame_reader delta_reader(delta, deltalen, delta_offset);
+      frame_writer writer(pdata, datalen, offset);
+
+      /* Position and record of the next entry, count when exhausted */
+      std::uint64_t next_entry = count;
+      const char *entry_record = nullptr;
+      std::size_t entry_size = 0;
+      std::size_t next_id = 0;
+      auto read_entry = [&]() {
+        if (!entries) {
+          next_entry = count;
+          return true;
+        }
+        if (!delta_reader.begin_record()) {
+          return false;
+        }
+        std::uint64_t gap = 0;
+        std::size_t gap_size = decode_varint(delta_reader.data(),
+            delta_reader.space(), gap);
+        if (!gap_size || gap >= count - next_id) {
+          return false;
+        }
+        entry_record = delta_reader.data() + gap_size;
+        entry_size = record_length(entry_record,
+            delta_reader.space() - gap_size);
+        if (!entry_size ||
+            !delta_reader.end_record(gap_size + entry_size, entries == 1)) {
+          return false;
+        }
+        next_entry = next_id + gap;
+        next_id = next_entry + 1;
+        --entries;
+        return true;
+      };
+      if (!read_entry()) {
+        return 0;
+      }
 
-#if __cplusplus >= 201402L
+      for (std::uint64_t id = 0; id < count; ++id) {
+        if (!base_reader.begin_record()) {
+          return 0;
+        }
+        std::size_t base_size = record_length(base_reader.data(),
+            base_reader.space());
+        if (!base_size) {
+          return 0;
+        }
 
-        state_allocator<cfsm::state, sizeof...(states)>::delete_state_pool();
+        const char *record = base_reader.data();
+        std::size_t size = base_size;
+        if (id == next_entry) {
+          record = entry_record;
+          size = entry_size;
+          if (!read_entry()) {
+            return 0;
+          }
+        }
 
-#endif
+        if (!writer.begin_record() || writer.space() < size) {
+          return 0;
+        }
+        std::memcpy(writer.data(), record, size);
+        writer.end_record(size);
 
-      } while (0);
+        if (!base_reader.end_record(base_size, id + 1 == count)) {
+          return 0;
+        }
+      }
 
-      lock_release();
+      return writer.finish();
     }
 
+#ifdef CFSM_HAS_JOURNAL
+
     /**
-     * @brief Returns pointer to constant current state object.
+     * @brief Appends the transitions of an array of state machines to a
+     * journal.
      *
-     * This function template returns a pointer of the state type provided as
-     * template argument which points to constant object of the current state 
-     * class. If the current state object does not belong the the state type
-     * requested, nullptr is returned.
+     * Successful starts, transitions, routes followed by `go_to` and stops are
+     * journaled with the position of the state machine in the array as its
+     * id. Completion transitions are not journaled, they follow from the
+     * journaled transition. Shall not be called while transitions are in
+     * progress.
      *
-     * @tparam state_type The expected state class of the current state.
-     * @return Pointer of the state class provided as template parameter.
+     * @param log The journal, it shall outlive the attachment.
+     * @param machines Pointer to the array of state machines.
+     * @param count Number of state machines.
      */
-    template<typename state_type = base_state>
-    const state_type* state() {
-      state_type *cur_state = nullptr;
-
-      lock_acquire();
-      cur_state = dynamic_cast<state_type*>(p_current_state.get());
-      lock_release();
+    static
+    void attach_journal(journal *log, const state_machine *machines,
+        std::size_t count) {
+      journal_machines = machines;
+      journal_count = count;
+      attached_journal.store(log, std::memory_order_release);
+    }
 
-      return cur_state;
+    /**
+     * @brief Stops appending transitions to the attached journal.
+     */
+    static
+    void detach_journal() {
+      attached_journal.store(nullptr, std::memory_order_release);
     }
 
-#if __cplusplus < 201703L
+#endif /* CFSM_HAS_JOURNAL */
 
-    template<
-      int  = 0
-    >
-    std::size_t type_id_from_base_pointer(base_state_pointer_type ptr) {
-      return -1;
+    /**
+     * @brief Returns the time a snapshot of this state machine class was
+     * started at.
+     *
+     * Journal records older than this time are reflected in the snapshot, so
+     * it is the `since` argument of `replay` after loading the snapshot.
+     *
+     * @param pdata Pointer to char array holding a snapshot, delta or
+     * compressed snapshot.
+     * @param datalen Size of the char array.
+     * @return Nanoseconds since the epoch of the system clock, 0 if the
+     * header is invalid.
+     */
+    static
+    std::uint64_t snapshot_time(const char *pdata, std::size_t datalen) {
+      if (!pdata) {
+        return 0;
+      }
+      for (std::uint8_t flags : {std::uint8_t(0), snapshot_flag_delta,
+          snapshot_flag_compressed}) {
+        std::uint64_t count = 0;
+        std::uint64_t timestamp = 0;
+        if (load_header(pdata, datalen, count, flags, nullptr, &timestamp)) {
+          return timestamp;
+        }
+      }
+      return 0;
     }
 
-    template<
-      typename first,
-      typename... rest
-    >
-    std::size_t type_id_from_base_pointer(base_state_pointer_type ptr) {
-      if (dynamic_cast<first*>(ptr) != nullptr) {
-        return first::type_id();
+    /**
+     * @brief Replays journal records onto an array of state machines.
+     *
+     * Rebuilds the state machines restored from a snapshot by applying the
+     * journal records written after it. Without hooks the target state
+     * objects, after their completion transitions, are constructed directly
+     * and no entry actions, exit actions or transition functors are called.
+     * State objects constructed this way are default constructed. With hooks
+     * the records are applied through `start`, `transition_by_id` and `stop`.
+     *
+     * Records with a timestamp older than the start time of the snapshot
+     * are skipped, the others are applied in sequence number order. Wall time
+     * is compared with the snapshot as it is saved by another process, the
+     * sequence number is not set back with the system clock. A snapshot is
+     * not a consistent cut, so records of transitions it already reflects,
+     * whose target state is the current state, are skipped. Records whose
+     * machine id is out of range or whose source state is not the current
+     * state are counted as mismatched and skipped too; later records are
+     * still applied. Reading stops at the first record whose checksum does
+     * not match, such as a trailing partial record left by an interrupted
+     * write.
+     *
+     * @param machines Pointer to the array of state machines.
+     * @param count Number of state machines.
+     * @param pdata Pointer to char array holding the journal.
+     * @param datalen Size of the char array.
+     * @param since Start time of the snapshot, see `snapshot_time`, older
+     * records are skipped.
+     * @param dataptr Opaque pointer to user data passed to hooks.
+     * @param hooks Whether entry actions, exit actions and transition functors
+     * are called.
+     * @return The bytes read and the numbers of applied, skipped and
+     * mismatched records.
+     */
+    static
+    replay_result replay(state_machine *machines, std::size_t count,
+        const char *pdata, std::size_t datalen, std::uint64_t since = 0,
+        void *dataptr = nullptr, bool hooks = false) {
+      constexpr std::size_t N = sizeof...(states);
+      static constexpr std::array<start_trampoline_type, N> starts =
+        start_table(std::make_index_sequence<N>());
+
+      replay_result result;
+      if (!pdata || (!machines && count)) {
+        return result;
+      }
+
+      std::vector<journal_record> records;
+      for (; datalen - result.bytes >= journal_record_size;
+          result.bytes += journal_record_size) {
+        if (!check_journal_record(pdata + result.bytes)) {
+          break;
+        }
+        journal_record rec = decode_journal_record(pdata + result.bytes);
+        if (rec.timestamp < since) {
+          ++result.skipped;
+        } else {
+          records.push_back(rec);
+        }
+      }
+
+      /* Batches of different threads may interleave in the journal */
+      std::stable_sort(records.begin(), records.end(),
+          [](const journal_record &a, const journal_record &b) {
+            return a.sequence < b.sequence;
+          });
+
+      for (const journal_record &rec : records) {
+        if (rec.machine_id >= count ||
+            (rec.from != journal_stopped && rec.from >= N) ||
+            (rec.to != journal_stopped && rec.to >= N)) {
+          ++result.mismatched;
+          continue;
+        }
+
+        state_machine &fsm = machines[rec.machine_id];
+        std::size_t from = rec.from == journal_stopped ? npos : rec.from;
+        std::size_t to = rec.to == journal_stopped ? npos :
+          settled_position(rec.to);
+
+        if (hooks) {
+          std::size_t current = fsm.state_id();
+          bool applied = current == from;
+          if (applied) {
+            if (rec.from == journal_stopped) {
+              starts[rec.to](fsm, dataptr);
+            } else if (rec.to == journal_stopped) {
+              fsm.stop(dataptr);
+            } else {
+              applied = fsm.transition_by_id(rec.from, rec.to, dataptr);
+            }
+          }
+          if (applied) {
+            ++result.applied;
+          } else if (current == to) {
+            ++result.skipped;
+          } else {
+            ++result.mismatched;
+          }
+          continue;
+        }
+
+        fsm.lock_acquire();
+        std::size_t current = fsm.has_current_state() ?
+          static_cast<std::size_t>(fsm.current_index) : npos;
+        bool applied = current == from;
+        if (applied) {
+          if (rec.to == journal_stopped) {
+            fsm.delete_current_state();
+          } else {
+            applied = fsm.emplace_state_at(to);
+          }
+        }
+        fsm.lock_release();
+
+        if (applied) {
+          ++result.applied;
+        } else if (current == to) {
+          ++result.skipped;
+        } else {
+          ++result.mismatched;
+        }
       }
-      return type_id_from_base_pointer<rest...>(ptr);
+
+      return result;
     }
 
-#endif /* __cplusplus < 201703L */
+#else /* __cplusplus >= 201703L */
 
     /**
      * @brief Save the state machine's state to memory.
@@ -905,24 +6245,10 @@ namespace cfsm {
         return 0;
       }
 
-      base_state_pointer_type p_current_state_raw = p_current_state.get();
-
-#if __cplusplus >= 201703L
-
-      std::size_t type_id = -1;
-      ([&] {
-        if (
-            type_id == -1 &&
-            dynamic_cast<states*>(p_current_state_raw) != nullptr
-        ) {
-          type_id = states::type_id();
-        }
-      }(), ...);
-
-#elif __cplusplus >= 201402L
+#if __cplusplus >= 201402L
 
       std::size_t type_id
-        = type_id_from_base_pointer<states...>(p_current_state_raw);
+        = type_id_from_base_pointer<states...>(p_current_state.get());
 
 #else
 
@@ -930,9 +6256,9 @@ namespace cfsm {
         return 0;
       }
 
-      std::size_t type_id = func(p_current_state_raw);
+      std::size_t type_id = func(p_current_state.get());
 
-#endif /* __cplusplus >= 201703L */
+#endif /* __cplusplus >= 201402L */
 
       if (type_id == -1) {
         return 0;
@@ -943,8 +6269,6 @@ namespace cfsm {
       return sizeof(std::size_t);
     }
 
-#if __cplusplus < 201703L
-
     template<
       int = 0
     >
@@ -963,7 +6287,27 @@ namespace cfsm {
       return allocate_state_from_id<rest...>(type_id);
     }
 
-#endif /* __cplusplus < 201703L */
+#if __cplusplus >= 201402L
+
+    template<
+      int = 0
+    >
+    std::size_t index_from_type_id(std::size_t type_id) {
+      return npos;
+    }
+
+    template<
+      typename first,
+      typename... rest
+    >
+    std::size_t index_from_type_id(std::size_t type_id) {
+      if (type_id == first::type_id()) {
+        return state_index<first>();
+      }
+      return index_from_type_id<rest...>(type_id);
+    }
+
+#endif /* __cplusplus >= 201402L */
 
     /**
      * @brief Load the state machine's state from memory.
@@ -993,16 +6337,7 @@ namespace cfsm {
 
       std::size_t type_id = *reinterpret_cast<std::size_t const *>(pdata);
 
-#if __cplusplus >= 201703L
-
-      base_state_pointer_type p_state = nullptr;
-      ([&] {
-        if (!p_state && type_id == states::type_id()) {
-          p_state = state_machine::allocate_state<states>();
-        }
-      }(), ...);
-
-#elif __cplusplus >= 201402L
+#if __cplusplus >= 201402L
 
       base_state_pointer_type p_state =
         allocate_state_from_id<states...>(type_id);
@@ -1015,17 +6350,26 @@ namespace cfsm {
 
       base_state_pointer_type p_state = func(type_id);
 
-#endif /* __cplusplus >= 201703L */
+#endif /* __cplusplus >= 201402L */
 
       if (!p_state) {
         return 0;
-    }
+      }
   
       p_current_state = base_state_type(p_state);
 
+#if __cplusplus >= 201402L
+
+      current_index =
+        static_cast<index_type>(index_from_type_id<states...>(type_id));
+
+#endif /* __cplusplus >= 201402L */
+
       return sizeof(std::size_t);
     }
 
+#endif /* __cplusplus >= 201703L */
+
     /**
      * @brief Destructor for the state machine.
      * 
@@ -1033,7 +6377,7 @@ namespace cfsm {
      * @see delete_current_state()
      */
     ~state_machine() {
-      if (!p_current_state) {
+      if (!has_current_state()) {
         return;
       }
   
@@ -1125,6 +6469,31 @@ namespace cfsm {
     states...
   >;
 
+#if __cplusplus >= 201703L
+
+  /**
+   * @brief Type alias representing a finite state machine which constructs
+   * the current state object inside itself.
+   *
+   * @tparam base_state The base class of the state types, void for plain
+   * state classes.
+   * @tparam state_pool Unused, shall be nullptr.
+   * @tparam states List of state classes present in the state machine.
+   */
+  template <
+    typename base_state,
+    base_state* state_pool[] = nullptr,
+    typename... states
+  >
+  using state_machine_inplace = state_machine<
+    base_state,
+    alloc_type::INPLACE,
+    state_pool,
+    states...
+  >;
+
+#endif /* __cplusplus >= 201703L */
+
 #else /* __cplusplus >= 201402L */
 
   /**
@@ -1201,6 +6570,490 @@ namespace cfsm {
 
 #endif /* __cplusplus >= 201402L */
 
+#if __cplusplus >= 201703L
+#if __has_include(<sys/mman.h>) && __has_include(<fcntl.h>)
+
+  /* Memory-mapped fleet state */
+
+  /**
+   * @brief Packed states of an array of state machines kept in a
+   * memory-mapped file.
+   *
+   * The file starts with two headers followed by two page aligned slots of
+   * packed records, see `state_machine::save_packed`. Header `i` describes
+   * slot `i` and holds the magic number, the format version, the record size,
+   * the CRC32C checksum of the slot's records, the schema hash of the state
+   * machine class, the number of records, a generation counter and a
+   * checksum of these fields. A checkpoint writes the slot of the older
+   * generation first and its header last. When the file is opened, the slot
+   * with the newest header whose fields and records both match their
+   * checksums is taken, so a crash in the middle of a checkpoint, or torn or
+   * stale records under a newer header, leave the previous checkpoint in
+   * use.
+   *
+   * Writeback is left to the kernel unless a checkpoint is synced. Without
+   * syncing, a crash of the process keeps the page cache and loses nothing,
+   * but after a crash of the system the kernel may have written back neither
+   * slot completely, and `open` then fails.
+   *
+   * The file is a packed mirror of the state machines: the state machine
+   * objects themselves stay in ordinary memory, and a restart remaps the file
+   * and rebuilds them from it with `restore`.
+   *
+   * @tparam fsm_type The state machine class.
+   */
+  template <typename fsm_type>
+  class mapped_fleet {
+  public:
+
+    using packed_type = typename fsm_type::packed_type;
+
+    /// Size of a header.
+    static constexpr std::size_t header_size = 64;
+
+    mapped_fleet() = default;
+
+    mapped_fleet(const mapped_fleet&) = delete;
+    mapped_fleet& operator=(const mapped_fleet&) = delete;
+
+    ~mapped_fleet() {
+      close();
+    }
+
+    /**
+     * @brief Opens or creates the file and maps it.
+     *
+     * A new file is initialized with every state machine stopped. An existing
+     * file shall have a valid header for the same state machine class and
+     * number of state machines.
+     *
+     * @param path Path of the file.
+     * @param count Number of state machines.
+     * @return false if the file could not be mapped or does not match.
+     */
+    bool open(const char *path, std::size_t count) {
+      close();
+
+      fd = ::open(path, O_RDWR | O_CREAT, 0644);
+      if (fd < 0) {
+        return false;
+      }
+
+      struct stat st;
+      if (::fstat(fd, &st) != 0) {
+        close();
+        return false;
+      }
+
+      records = count;
+      slot_size = align_page(count * sizeof(packed_type));
+      map_size = align_page(2 * header_size) + 2 * slot_size;
+
+      bool created = st.st_size == 0;
+      if (created) {
+        if (::ftruncate(fd, static_cast<off_t>(map_size)) != 0) {
+          close();
+          return false;
+        }
+      } else if (static_cast<std::size_t>(st.st_size) != map_size) {
+        close();
+        return false;
+      }
+
+      void *addr = ::mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+          MAP_SHARED, fd, 0);
+      if (addr == MAP_FAILED) {
+        close();
+        return false;
+      }
+      base = static_cast<char*>(addr);
+
+      if (created) {
+        /* The file is zero filled, every state machine is stopped */
+        write_header(0, 1);
+        if (::msync(base, map_size, MS_SYNC) != 0) {
+          close();
+          return false;
+        }
+      }
+
+      current = find_active_slot();
+      if (current < 0) {
+        close();
+        return false;
+      }
+
+      return true;
+    }
+
+    /**
+     * @brief Unmaps and closes the file.
+     */
+    void close() {
+      current = -1;
+      if (base) {
+        ::munmap(base, map_size);
+        base = nullptr;
+      }
+      if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+      }
+    }
+
+    /**
+     * @brief Checks if a file is mapped.
+     */
+    bool is_open() const {
+      return base != nullptr;
+    }
+
+    /**
+     * @brief Returns the number of state machines.
+     */
+    std::size_t size() const {
+      return records;
+    }
+
+    /**
+     * @brief Returns the generation of the last complete checkpoint.
+     *
+     * @return The generation, 0 if no file is mapped.
+     */
+    std::uint64_t generation() const {
+      return current < 0 ? 0 : header_generation(current);
+    }
+
+    /**
+     * @brief Returns the packed records of the last complete checkpoint.
+     *
+     * @return Pointer to `size()` records, nullptr if no file is mapped.
+     */
+    const packed_type* data() const {
+      return current < 0 ? nullptr : slot_data(current);
+    }
+
+    /**
+     * @brief Writes the states of the state machines to the mapped file.
+     *
+     * @param machines Pointer to the array of state machines.
+     * @param count Number of state machines, shall match the file.
+     * @param sync Whether to wait until the checkpoint is written back.
+     * Without syncing, the header may reach the file before the records; the
+     * records checksum then rejects the slot after a system crash.
+     * @return false on error, the previous checkpoint is kept.
+     */
+    bool checkpoint(fsm_type *machines, std::size_t count, bool sync = true) {
+      if (current < 0 || count != records) {
+        return false;
+      }
+
+      int next = 1 - current;
+      fsm_type::save_packed(machines, count, slot_data(next));
+
+      /* Records reach the file before the header which publishes them */
+      if (sync && ::msync(slot_data(next), slot_size, MS_SYNC) != 0) {
+        return false;
+      }
+      std::atomic_thread_fence(std::memory_order_release);
+
+      write_header(next, header_generation(current) + 1);
+      current = next;
+
+      return !sync || ::msync(base, align_page(2 * header_size), MS_SYNC) == 0;
+    }
+
+    /**
+     * @brief Restores the states of the state machines from the mapped file.
+     *
+     * Entry and exit actions are not called.
+     *
+     * @param machines Pointer to the array of state machines.
+     * @param count Number of state machines, shall match the file.
+     * @return false if no file is mapped or a record is invalid.
+     */
+    bool restore(fsm_type *machines, std::size_t count) {
+      const packed_type *packed = data();
+      if (!packed || count != records) {
+        return false;
+      }
+      return fsm_type::load_packed(machines, count, packed);
+    }
+
+  private:
+
+    int fd = -1;
+    char *base = nullptr;
+    int current = -1; ///< Slot of the last complete checkpoint.
+    std::size_t records = 0;
+    std::size_t slot_size = 0;
+    std::size_t map_size = 0;
+
+    static
+    std::size_t align_page(std::size_t size) {
+      std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+      return (std::max(size, std::size_t(1)) + page - 1) / page * page;
+    }
+
+    char* header(int slot) const {
+      return base + slot * header_size;
+    }
+
+    packed_type* slot_data(int slot) const {
+      return reinterpret_cast<packed_type*>(
+          base + align_page(2 * header_size) + slot * slot_size);
+    }
+
+    std::uint64_t header_generation(int slot) const {
+      return decode_fixed(sizeof(std::uint64_t), header(slot) + 32);
+    }
+
+    std::uint32_t records_checksum(int slot) const {
+      return crc32c(reinterpret_cast<const char*>(slot_data(slot)),
+          records * sizeof(packed_type));
+    }
+
+    /* Magic, version, record size, records checksum, schema hash, count,
+     * generation and checksum of the preceding fields */
+    void write_header(int slot, std::uint64_t gen) {
+      char data[header_size] = {};
+      encode_fixed(snapshot_magic, sizeof(std::uint32_t), data);
+      data[4] = static_cast<char>(snapshot_version);
+      data[5] = static_cast<char>(sizeof(packed_type));
+      encode_fixed(records_checksum(slot), crc_size, data + 8);
+      encode_fixed(fsm_type::schema_hash(), sizeof(std::uint64_t), data + 16);
+      encode_fixed(records, sizeof(std::uint64_t), data + 24);
+      encode_fixed(gen, sizeof(std::uint64_t), data + 32);
+      encode_fixed(fnv1a(data, data + 40), sizeof(std::uint64_t), data + 40);
+      std::memcpy(header(slot), data, header_size);
+    }
+
+    bool valid_header(int slot) const {
+      const char *data = header(slot);
+      return decode_fixed(sizeof(std::uint32_t), data) == snapshot_magic &&
+        static_cast<std::uint8_t>(data[4]) == snapshot_version &&
+        static_cast<std::uint8_t>(data[5]) == sizeof(packed_type) &&
+        decode_fixed(sizeof(std::uint64_t), data + 16) ==
+          fsm_type::schema_hash() &&
+        decode_fixed(sizeof(std::uint64_t), data + 24) == records &&
+        decode_fixed(sizeof(std::uint64_t), data + 40) ==
+          fnv1a(data, data + 40) &&
+        decode_fixed(crc_size, data + 8) == records_checksum(slot);
+    }
+
+    /* Slot with the newest valid header and records, -1 if there is none */
+    int find_active_slot() const {
+      if (!base) {
+        return -1;
+      }
+      bool valid0 = valid_header(0);
+      bool valid1 = valid_header(1);
+      if (valid0 && valid1) {
+        return header_generation(1) > header_generation(0) ? 1 : 0;
+      }
+      return valid0 ? 0 : valid1 ? 1 : -1;
+    }
+  };
+
+#endif /* __has_include(<sys/mman.h>) */
+
+#ifdef CFSM_HAS_BACKGROUND_CHECKPOINT
+
+  /* Background checkpoint */
+
+  /**
+   * @brief Snapshot of an array of state machines written by a background
+   * thread while transitions continue.
+   *
+   * The snapshot is a consistent cut, it holds the state of every state
+   * machine at the moment `start` was called. A bitmap tells which state
+   * machines are captured. The background thread captures the state
+   * machines in order, locking one at a time, and streams the records it has
+   * passed to the file descriptor. A start, transition, `go_to` or stop of a
+   * state machine which is not captured yet first captures its source state,
+   * a copy on write of a single record. Every state machine is captured once
+   * and only its own lock is held while doing so.
+   *
+   * The file holds a snapshot as written by `state_machine::save_many`, so
+   * only state machine classes without payload traits are supported. One
+   * background checkpoint per state machine class runs at a time.
+   *
+   * @tparam fsm_type The state machine class.
+   */
+  template <typename fsm_type>
+  class background_checkpoint {
+  public:
+
+    static_assert(fsm_type::payload_free,
+        "State payloads are not captured by background checkpoints");
+
+    using packed_type = typename fsm_type::packed_type;
+
+    /**
+     * @brief Prepares checkpoints of an array of state machines.
+     *
+     * @param machines Pointer to the array of state machines.
+     * @param count Number of state machines.
+     */
+    background_checkpoint(fsm_type *machines, std::size_t count)
+      : machines(machines), count(count), records(new packed_type[count]),
+        captured(count) {
+    }
+
+    background_checkpoint(const background_checkpoint&) = delete;
+    background_checkpoint& operator=(const background_checkpoint&) = delete;
+
+    /**
+     * @brief Waits for the running checkpoint.
+     */
+    ~background_checkpoint() {
+      wait();
+    }
+
+    /**
+     * @brief Captures the cut and starts writing it in the background.
+     *
+     * @param fd File descriptor opened for writing, owned by the caller.
+     * @param sync Whether to sync the file descriptor once written.
+     * @return false if a checkpoint of the state machine class is running or
+     * the previous checkpoint of this object was not waited for.
+     */
+    bool start(int fd, bool sync = true) {
+      if (writer.joinable()) {
+        return false;
+      }
+
+      for (std::size_t w = 0; w < captured.word_count(); ++w) {
+        captured.take_word(w);
+      }
+
+      /* Transitions journaled before this time are in the cut */
+      started = timestamp_now();
+
+      background_checkpoint *expected = nullptr;
+      if (!fsm_type::attached_checkpoint.compare_exchange_strong(expected,
+            this, std::memory_order_seq_cst)) {
+        return false;
+      }
+
+      error = false;
+      writer = std::thread([this, fd, sync] { write_cut(fd, sync); });
+      return true;
+    }
+
+    /**
+     * @brief Waits until the checkpoint is written.
+     *
+     * @return false if writing or syncing failed.
+     */
+    bool wait() {
+      if (writer.joinable()) {
+        writer.join();
+      }
+      return !error;
+    }
+
+    /**
+     * @brief Checks if a checkpoint is being written.
+     */
+    bool running() const {
+      return fsm_type::attached_checkpoint.load(std::memory_order_acquire) ==
+        this;
+    }
+
+  private:
+
+    friend fsm_type;
+
+    fsm_type *machines;
+    std::size_t count;
+    std::unique_ptr<packed_type[]> records; ///< State of the cut per machine.
+    dirty_set captured; ///< State machines whose record is in the cut.
+    std::thread writer;
+    bool error = false;
+    std::uint64_t started = 0; ///< Time the cut was taken at.
+
+    /* Saves the record of a state machine not captured yet, called with its
+     * lock held */
+    void capture(const fsm_type &fsm, std::size_t record) {
+      std::size_t id = fsm.position_in(machines);
+      if (id < count && !captured.test(id)) {
+        records[id] = static_cast<packed_type>(record);
+        captured.mark(id);
+      }
+    }
+
+    bool write_all(int fd, const char *pdata, std::size_t datalen) {
+      while (datalen) {
+        ssize_t written = ::write(fd, pdata, datalen);
+        if (written < 0 && errno == EINTR) {
+          continue;
+        }
+        if (written <= 0) {
+          return false;
+        }
+        pdata += written;
+        datalen -= static_cast<std::size_t>(written);
+      }
+      return true;
+    }
+
+    void write_cut(int fd, bool sync) {
+      constexpr std::size_t chunk_size = 64 * 1024;
+      constexpr std::size_t frame_bound =
+        snapshot_frame_records * varint_max_size + snapshot_frame_overhead;
+      std::vector<char> chunk(chunk_size + snapshot_header_max_size +
+          frame_bound);
+      std::size_t offset = fsm_type::save_header(count, chunk.data(),
+          chunk.size(), 0, 0, started);
+      frame_writer frames(chunk.data(), chunk.size(), offset);
+      bool ok = offset != 0;
+
+      for (std::size_t i = 0; ok && i < count; ++i) {
+        fsm_type &fsm = machines[i];
+        fsm.lock_acquire();
+        if (!captured.test(i)) {
+          records[i] = fsm.has_current_state() ?
+            static_cast<packed_type>(fsm.current_index + 1) : 0;
+          captured.mark(i);
+        }
+        fsm.lock_release();
+
+        frames.begin_record();
+        frames.end_record(encode_varint(records[i], frames.data(),
+              frames.space()));
+
+        /* Chunks end on frame boundaries so a frame is sealed in place */
+        if (frames.at_boundary()) {
+          std::size_t size = frames.finish();
+          if (size >= chunk_size) {
+            ok = write_all(fd, chunk.data(), size);
+            frames.rewind(0);
+          }
+        }
+      }
+      /* Every state machine is captured, transitions no longer copy */
+      fsm_type::attached_checkpoint.store(nullptr, std::memory_order_seq_cst);
+      while (fsm_type::checkpoint_users.load(std::memory_order_seq_cst)) {
+        std::this_thread::yield();
+      }
+
+      ok = ok && write_all(fd, chunk.data(), frames.finish());
+      if (ok && sync) {
+#if defined(__linux__)
+        ok = ::fdatasync(fd) == 0;
+#else
+        ok = ::fsync(fd) == 0;
+#endif
+      }
+      error = !ok;
+    }
+  };
+
+#endif /* CFSM_HAS_BACKGROUND_CHECKPOINT */
+
+#endif /* __cplusplus >= 201703L */
+
 }
 
 #endif /* __SMBUILDER_HPP__ */
@@ -1,11 +1,244 @@
 #include <iostream>
 #include <thread>
 #include <chrono>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <utility>
+#include <new>
+#include <cstdlib>
+#include <cerrno>
 #include <cfsm.hpp>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#if __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define BENCH_HAS_PERF_EVENT 1
+#endif
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+/*
+ * Allocation counting. Global operator new and delete are replaced, the
+ * aligned ones included, and, with glibc, malloc, calloc, realloc, free,
+ * aligned_alloc, posix_memalign and memalign are interposed too, forwarding
+ * to the glibc implementations. Calls are only counted while
+ * `alloc_counting` is set.
+ */
+static std::atomic<bool> alloc_counting{false};
+static std::atomic<std::uint64_t> alloc_calls{0};
+static std::atomic<std::uint64_t> alloc_bytes{0};
+static std::atomic<std::uint64_t> free_calls{0};
+
+static void count_alloc(std::size_t size) {
+  if (alloc_counting.load(std::memory_order_relaxed)) {
+    alloc_calls.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+}
+
+static void count_free(void *ptr) {
+  if (ptr && alloc_counting.load(std::memory_order_relaxed)) {
+    free_calls.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+#ifdef __GLIBC__
+
+#define BENCH_HAS_MALLOC_HOOKS 1
+
+extern "C" {
+
+void* __libc_malloc(std::size_t size);
+void* __libc_calloc(std::size_t count, std::size_t size);
+void* __libc_realloc(void *ptr, std::size_t size);
+void __libc_free(void *ptr);
+void* __libc_memalign(std::size_t alignment, std::size_t size);
+
+void* malloc(std::size_t size) {
+  count_alloc(size);
+  return __libc_malloc(size);
+}
+
+void* calloc(std::size_t count, std::size_t size) {
+  count_alloc(count * size);
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void *ptr, std::size_t size) {
+  count_alloc(size);
+  count_free(ptr);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  count_free(ptr);
+  __libc_free(ptr);
+}
+
+void* memalign(std::size_t alignment, std::size_t size) {
+  count_alloc(size);
+  return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(std::size_t alignment, std::size_t size) {
+  count_alloc(size);
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, std::size_t alignment, std::size_t size) {
+  if (!alignment || (alignment & (alignment - 1)) ||
+      alignment % sizeof(void*)) {
+    return EINVAL;
+  }
+  count_alloc(size);
+  void *mem = __libc_memalign(alignment, size);
+  if (!mem) {
+    return ENOMEM;
+  }
+  *ptr = mem;
+  return 0;
+}
+
+}
+
+#endif /* __GLIBC__ */
+
+static void* counted_new(std::size_t size) {
+#ifndef BENCH_HAS_MALLOC_HOOKS
+  count_alloc(size);
+#endif
+  return std::malloc(size ? size : 1);
+}
+
+static void counted_delete(void *ptr) {
+#ifndef BENCH_HAS_MALLOC_HOOKS
+  count_free(ptr);
+#endif
+  std::free(ptr);
+}
+
+void* operator new(std::size_t size) {
+  if (void *ptr = counted_new(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return counted_new(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return counted_new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t&) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t&) noexcept {
+  counted_delete(ptr);
+}
+
+#ifdef __cpp_aligned_new
+
+static void* counted_aligned_new(std::size_t size, std::align_val_t align) {
+  std::size_t alignment = static_cast<std::size_t>(align);
+#ifndef BENCH_HAS_MALLOC_HOOKS
+  count_alloc(size);
+#endif
+  /* aligned_alloc wants a multiple of the alignment */
+  std::size_t rounded = size ? (size + alignment - 1) / alignment * alignment :
+    alignment;
+  return std::aligned_alloc(alignment, rounded);
+}
+
+void* operator new(std::size_t size, std::align_val_t align) {
+  if (void *ptr = counted_aligned_new(size, align)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t align) {
+  return operator new(size, align);
+}
+
+void* operator new(std::size_t size, std::align_val_t align,
+    const std::nothrow_t&) noexcept {
+  return counted_aligned_new(size, align);
+}
+
+void* operator new[](std::size_t size, std::align_val_t align,
+    const std::nothrow_t&) noexcept {
+  return counted_aligned_new(size, align);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t,
+    const std::nothrow_t&) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t,
+    const std::nothrow_t&) noexcept {
+  counted_delete(ptr);
+}
+
+#endif /* __cpp_aligned_new */
+
 using namespace cfsm;
 
-class state_a final : public state {
+class state_a final
+  : public state, public no_entry_action, public no_exit_action {
   static
   const std::size_t type_id_;
 
@@ -22,7 +255,8 @@ public:
   }
 };
 
-class state_b final : public state {
+class state_b final
+  : public state, public no_entry_action, public no_exit_action {
   static
   const std::size_t type_id_;
 
@@ -81,303 +315,1058 @@ CFSM_TRANSITION(state_a, state_b) {
 CFSM_TRANSITION(state_b, state_a) {
 }
 
-/* Static state storage */
-static struct _state_storage {
-  state_a a;
-  state_b b;
-} state_storage = {
-  state_a(),
-  state_b()
+#if __cplusplus >= 201703L
+
+/* Transition benchmark suite */
+
+/*
+ * Largest state count compiled in. Machines of 256 and 512 states take
+ * minutes and gigabytes to compile for every allocation type, build them
+ * with `make EXTRA_FLAGS=-DBENCH_MAX_STATES=512`.
+ */
+#ifndef BENCH_MAX_STATES
+#define BENCH_MAX_STATES 128
+#endif
+
+/* Iterations of simulated work in entry and exit actions */
+static unsigned hook_work = 0;
+
+static void do_hook_work() {
+  for (unsigned i = 0; i < hook_work; ++i) {
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  }
+}
+
+/* Data shared by the states of a benchmarked state machine */
+struct bench_data {
+  /* Index of the current state, written by entry actions under the lock */
+  std::atomic<std::size_t> position{0};
 };
 
-static state* state_pool[2] = {
-  &state_storage.a,
-  &state_storage.b
+/* States of a ring of `count` states, each moving on to the next one */
+template <std::size_t id, std::size_t count>
+class bench_state final : public state {
+public:
+  using next = bench_state<(id + 1) % count, count>;
+
+  static
+  std::size_t type_id() {
+    return id;
+  }
+
+  void on_enter(void *dataptr) const override {
+    do_hook_work();
+    static_cast<bench_data*>(dataptr)->position.store(id,
+        std::memory_order_relaxed);
+  }
+
+  void on_exit(void *dataptr) const override {
+    do_hook_work();
+  }
 };
 
-void benchmark_state_machine_lazy(int num_transitions) {
-  std::cout << "Lazy allocation\n";
+template <std::size_t id, std::size_t count>
+struct cfsm::transition<bench_state<id, count>,
+  typename bench_state<id, count>::next> {
+  void operator()(void *dataptr) {
+  }
+};
 
-#if __cplusplus >= 201402L
-  state_machine<state, alloc_type::LAZY, nullptr, state_a, state_b> fsm;
-#else
-  state_machine<state, alloc_type::LAZY, nullptr, 2> fsm;
+/* State objects of externally preallocated state machines */
+template <std::size_t count>
+state *bench_pool[count];
+
+template <typename state_type>
+state_type bench_object;
+
+template <std::size_t count, std::size_t... ids>
+void fill_bench_pool(std::index_sequence<ids...>) {
+  ((bench_pool<count>[ids] = &bench_object<bench_state<ids, count>>), ...);
+}
+
+template <
+  alloc_type alloc, std::size_t count,
+  typename = std::make_index_sequence<count>
+>
+struct bench_machine;
+
+template <alloc_type alloc, std::size_t count, std::size_t... ids>
+struct bench_machine<alloc, count, std::index_sequence<ids...>> {
+  using type = state_machine<
+    state,
+    alloc,
+    alloc == alloc_type::PREALLOCED ? bench_pool<count> : nullptr,
+    bench_state<ids, count>...
+  >;
+};
+
+/* Transition out of the state at a run time position of the ring */
+template <typename fsm_type, std::size_t id, std::size_t count>
+bool bench_step(fsm_type &fsm, bench_data &data) {
+  using from_state = bench_state<id, count>;
+  return fsm.template transition<from_state, typename from_state::next>(
+      &data);
+}
+
+template <typename fsm_type, std::size_t count, std::size_t... ids>
+constexpr auto make_bench_steps(std::index_sequence<ids...>) {
+  return std::array<bool (*)(fsm_type &, bench_data &), count>{
+    &bench_step<fsm_type, ids, count>...
+  };
+}
+
+/* The lock itself is fixed by the library, spinning with atomic::wait from
+ * C++20 and plain spinning before, so only the contention on it varies */
+enum class contention_mode {
+  uncontended,  ///< Every thread drives its own state machine
+  contended     ///< All threads drive one state machine
+};
+
+struct bench_config {
+  alloc_type alloc;
+  std::size_t states;
+  unsigned threads;
+  unsigned hook_work;
+  contention_mode contention;
+};
+
+/* Hardware events counted around the timed transitions of every thread */
+enum perf_event_id {
+  perf_cycles,
+  perf_instructions,
+  perf_branch_misses,
+  perf_l1d_misses,
+  perf_llc_misses,
+  perf_dtlb_misses,
+  perf_event_count
+};
+
+static const char* const perf_event_names[perf_event_count] = {
+  "cycles",
+  "instructions",
+  "branch_misses",
+  "l1d_misses",
+  "llc_misses",
+  "dtlb_misses"
+};
+
+/* Event counts, negative for events which could not be counted */
+using perf_values = std::array<double, perf_event_count>;
+
+/*
+ * Counters of the calling thread, opened with perf_event_open. Counts are
+ * scaled by the fraction of time the kernel had each counter scheduled, as
+ * six events may not fit the PMU at once.
+ */
+class perf_counters {
+#ifdef BENCH_HAS_PERF_EVENT
+  std::array<int, perf_event_count> fds;
+
+  static int open_event(std::uint32_t type, std::uint64_t config) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+      PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+          0));
+  }
+
+  static constexpr std::uint64_t cache_miss(std::uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  }
 #endif
 
-  fsm.start<state_a>(nullptr);
+public:
+  perf_counters() {
+#ifdef BENCH_HAS_PERF_EVENT
+    fds = {
+      open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES),
+      open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS),
+      open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES),
+      open_event(PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_L1D)),
+      open_event(PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_LL)),
+      open_event(PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_DTLB))
+    };
+#endif
+  }
 
-  /* Warmup */
-  for (int i = 0; i < num_transitions; ++i) {
-    if (i % 2 == 0) {
-      fsm.transition<state_a, state_b>(nullptr);
-    } else {
-      fsm.transition<state_b, state_a>(nullptr);
+  perf_counters(const perf_counters&) = delete;
+  perf_counters& operator=(const perf_counters&) = delete;
+
+  ~perf_counters() {
+#ifdef BENCH_HAS_PERF_EVENT
+    for (int fd : fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
     }
+#endif
   }
 
-  auto start_time = std::chrono::high_resolution_clock::now();
+  void start() {
+#ifdef BENCH_HAS_PERF_EVENT
+    for (int fd : fds) {
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+#endif
+  }
 
-  for (int i = 0; i < num_transitions; ++i) {
-    if (i % 2 == 0) {
-      fsm.transition<state_a, state_b>(nullptr);
-    } else {
-      fsm.transition<state_b, state_a>(nullptr);
+  void stop() {
+#ifdef BENCH_HAS_PERF_EVENT
+    for (int fd : fds) {
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      }
     }
+#endif
   }
 
-  auto end_time = std::chrono::high_resolution_clock::now();
-  std::chrono::duration<double> elapsed = end_time - start_time;
+  perf_values read() const {
+    perf_values values;
+    values.fill(-1);
+#ifdef BENCH_HAS_PERF_EVENT
+    for (std::size_t i = 0; i < perf_event_count; ++i) {
+      /* Value, time enabled, time running */
+      std::uint64_t data[3];
+      if (fds[i] < 0 ||
+          ::read(fds[i], data, sizeof(data)) != sizeof(data) || !data[2]) {
+        continue;
+      }
+      values[i] = static_cast<double>(data[0]) * data[1] / data[2];
+    }
+#endif
+    return values;
+  }
+};
 
-  std::cout << num_transitions << " transitions took "
-            << elapsed.count() << " seconds." << std::endl;
+struct bench_result {
+  bench_config config;
+  std::size_t samples;
+  std::size_t failed;
+  /* Timestamp counter ticks of a transition */
+  std::uint64_t min;
+  std::uint64_t p50;
+  std::uint64_t p99;
+  std::uint64_t p999;
+  /* Hardware events per transition, negative if not counted */
+  perf_values perf;
+};
+
+struct bench_options {
+  std::size_t samples = 200000;
+  std::size_t max_states = BENCH_MAX_STATES;
+  unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+  bool json = false;
+  bool allocs = false;
+  bool footprint = false;
+  std::size_t machines = 1000000;
+  double tsc_per_ns = 1;
+};
 
-  std::cout << "Avg time per transition: "
-    << 1000000 * elapsed.count() / num_transitions << " microseconds\n";
+static const char* alloc_name(alloc_type alloc) {
+  switch (alloc) {
+    case alloc_type::LAZY: return "lazy";
+    case alloc_type::PREALLOCED: return "prealloced";
+    case alloc_type::INTERNAL: return "internal";
+    case alloc_type::STATIC: return "static";
+    case alloc_type::INPLACE: return "inplace";
+  }
+  return "";
 }
 
-void benchmark_state_machine_internal(int num_transitions) {
-  std::cout << "Internal preallocation\n";
+static const char* contention_name(contention_mode contention) {
+  return contention == contention_mode::contended ?
+    "contended" : "uncontended";
+}
 
-#if __cplusplus >= 201402L
-  state_machine<state, alloc_type::INTERNAL, nullptr, state_a, state_b> fsm;
+static std::uint64_t percentile(const std::vector<std::uint64_t> &sorted,
+    double p) {
+  return sorted[static_cast<std::size_t>(p * (sorted.size() - 1))];
+}
+
+/* Pins the calling thread to a CPU */
+static void pin_thread(unsigned cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % std::max(1u, std::thread::hardware_concurrency()), &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
 
-  fsm.start<state_a>(nullptr);
+/* Timestamp counter ticks per nanosecond */
+static double calibrate_tsc() {
+  std::uint64_t start = read_tsc();
+  auto start_time = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::nano> elapsed;
+  do {
+    elapsed = std::chrono::steady_clock::now() - start_time;
+  } while (elapsed.count() < 10e6);
+  return (read_tsc() - start) / elapsed.count();
+}
 
-  /* Warmup */
-  for (int i = 0; i < num_transitions; ++i) {
-    if (i % 2 == 0) {
-      fsm.transition<state_a, state_b>(nullptr);
-    } else {
-      fsm.transition<state_b, state_a>(nullptr);
-    }
+template <alloc_type alloc, std::size_t count>
+bench_result run_bench(const bench_config &config,
+    const bench_options &options) {
+  using fsm_type = typename bench_machine<alloc, count>::type;
+  static constexpr auto steps =
+    make_bench_steps<fsm_type, count>(std::make_index_sequence<count>{});
+
+  if constexpr (alloc == alloc_type::PREALLOCED) {
+    fill_bench_pool<count>(std::make_index_sequence<count>{});
   }
+  hook_work = config.hook_work;
 
-  auto start_time = std::chrono::high_resolution_clock::now();
+  bool contended = config.contention == contention_mode::contended;
+  fsm_type shared_fsm;
+  bench_data shared_data;
+  if (contended) {
+    shared_fsm.template start<bench_state<0, count>>(&shared_data);
+  }
 
-  for (int i = 0; i < num_transitions; ++i) {
-    if (i % 2 == 0) {
-      fsm.transition<state_a, state_b>(nullptr);
-    } else {
-      fsm.transition<state_b, state_a>(nullptr);
-    }
+  std::vector<std::vector<std::uint64_t>> latencies(config.threads);
+  std::vector<std::size_t> failed(config.threads);
+  std::vector<perf_values> events(config.threads);
+  std::atomic<unsigned> ready{0};
+  std::vector<std::thread> threads;
+
+  for (unsigned t = 0; t < config.threads; ++t) {
+    threads.emplace_back([&, t] {
+      pin_thread(t);
+
+      fsm_type own_fsm;
+      bench_data own_data;
+      fsm_type &fsm = contended ? shared_fsm : own_fsm;
+      bench_data &data = contended ? shared_data : own_data;
+      if (!contended) {
+        fsm.template start<bench_state<0, count>>(&data);
+      }
+
+      std::vector<std::uint64_t> &samples = latencies[t];
+      samples.reserve(options.samples);
+
+      /* Warmup, then start together */
+      for (std::size_t i = 0; i < options.samples / 10; ++i) {
+        steps[data.position.load(std::memory_order_relaxed)](fsm, data);
+      }
+      ready.fetch_add(1);
+      while (ready.load() != config.threads);
+
+      perf_counters counters;
+      counters.start();
+      for (std::size_t i = 0; i < options.samples; ++i) {
+        std::size_t position = data.position.load(std::memory_order_relaxed);
+        std::uint64_t begin = read_tsc();
+        bool ok = steps[position](fsm, data);
+        std::uint64_t end = read_tsc();
+        if (ok) {
+          samples.push_back(end - begin);
+        } else {
+          ++failed[t];
+        }
+      }
+      counters.stop();
+      events[t] = counters.read();
+
+      if (!contended) {
+        fsm.stop(&data);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  if (contended) {
+    shared_fsm.stop(&shared_data);
   }
 
-  auto end_time = std::chrono::high_resolution_clock::now();
-  std::chrono::duration<double> elapsed = end_time - start_time;
+  std::vector<std::uint64_t> all;
+  for (auto &samples : latencies) {
+    all.insert(all.end(), samples.begin(), samples.end());
+  }
+  std::sort(all.begin(), all.end());
 
-  std::cout << num_transitions << " transitions took "
-    << elapsed.count() << " seconds\n";
+  bench_result result{config, all.size(), 0, 0, 0, 0, 0, {}};
+  for (std::size_t count_failed : failed) {
+    result.failed += count_failed;
+  }
 
-  std::cout << "Avg time per transition: "
-    << 1000000 * elapsed.count() / num_transitions << " microseconds\n";
+  /* Events of all threads over all attempted transitions */
+  std::size_t attempts = result.samples + result.failed;
+  for (std::size_t i = 0; i < perf_event_count; ++i) {
+    double total = 0;
+    for (const perf_values &values : events) {
+      if (values[i] < 0) {
+        total = -1;
+        break;
+      }
+      total += values[i];
+    }
+    result.perf[i] = total < 0 || !attempts ? -1 : total / attempts;
+  }
+  if (!all.empty()) {
+    result.min = all.front();
+    result.p50 = percentile(all, 0.5);
+    result.p99 = percentile(all, 0.99);
+    result.p999 = percentile(all, 0.999);
+  }
+  return result;
+}
 
-#else
+template <alloc_type alloc, std::size_t count>
+void bench_states(const bench_options &options,
+    std::vector<bench_result> &results) {
+  if (count > options.max_states) {
+    return;
+  }
+  for (unsigned threads = 1; threads <= options.max_threads; threads *= 2) {
+    for (unsigned work : {0u, 64u}) {
+      for (contention_mode contention : {contention_mode::uncontended,
+          contention_mode::contended}) {
+        if (threads == 1 && contention == contention_mode::contended) {
+          continue;
+        }
+        bench_config config{alloc, count, threads, work, contention};
+        results.push_back(run_bench<alloc, count>(config, options));
+        if (!options.json) {
+          const bench_result &r = results.back();
+          double scale = options.tsc_per_ns;
+          std::printf("%-10s %6zu %7u %5u %-11s %8llu %8llu %8llu %8llu"
+              " %8.1f %8.1f %8.1f %8.1f",
+              alloc_name(alloc), count, threads, work,
+              contention_name(contention),
+              static_cast<unsigned long long>(r.min),
+              static_cast<unsigned long long>(r.p50),
+              static_cast<unsigned long long>(r.p99),
+              static_cast<unsigned long long>(r.p999),
+              r.min / scale, r.p50 / scale, r.p99 / scale, r.p999 / scale);
+          for (double value : r.perf) {
+            if (value < 0) {
+              std::printf(" %8s", "-");
+            } else {
+              std::printf(" %8.2f", value);
+            }
+          }
+          std::printf("\n");
+        }
+      }
+    }
+  }
+}
 
-#warning Cannot benchmark internal preallocated storage for versions below C++14
-  std::cerr << "Cannot benchmark internal preallocated storage for versions"
-    "below C++14\n";
+template <alloc_type alloc>
+void bench_alloc(const bench_options &options,
+    std::vector<bench_result> &results) {
+  bench_states<alloc, 2>(options, results);
+  bench_states<alloc, 8>(options, results);
+  bench_states<alloc, 32>(options, results);
+  bench_states<alloc, 128>(options, results);
+#if BENCH_MAX_STATES >= 256
+  bench_states<alloc, 256>(options, results);
+#endif
+#if BENCH_MAX_STATES >= 512
+  bench_states<alloc, 512>(options, results);
 #endif
+}
+
+/* Heap allocations of a single thread's steady state transitions */
+struct alloc_result {
+  alloc_type alloc;
+  std::size_t states;
+  std::size_t transitions;
+  std::uint64_t allocations;
+  std::uint64_t bytes;
+  std::uint64_t frees;
+};
 
+/* Allocation types which shall not allocate after start */
+static bool zero_alloc(alloc_type alloc) {
+  return alloc != alloc_type::LAZY;
 }
 
-void benchmark_state_machine_internal_static(int num_transitions) {
-  std::cout << "Internal preallocation with objects in static array\n";
+template <alloc_type alloc, std::size_t count>
+alloc_result run_alloc_bench(const bench_options &options) {
+  using fsm_type = typename bench_machine<alloc, count>::type;
+  static constexpr auto steps =
+    make_bench_steps<fsm_type, count>(std::make_index_sequence<count>{});
 
-#if __cplusplus >= 201402L
-  state_machine<state, alloc_type::STATIC, nullptr, state_a, state_b> fsm;
+  if constexpr (alloc == alloc_type::PREALLOCED) {
+    fill_bench_pool<count>(std::make_index_sequence<count>{});
+  }
+  hook_work = 0;
 
-  fsm.start<state_a>(nullptr);
+  fsm_type fsm;
+  bench_data data;
+  fsm.template start<bench_state<0, count>>(&data);
 
-  /* Warmup */
-  for (int i = 0; i < num_transitions; ++i) {
-    if (i % 2 == 0) {
-      fsm.transition<state_a, state_b>(nullptr);
-    } else {
-      fsm.transition<state_b, state_a>(nullptr);
-    }
+  /* Visit every state once before counting */
+  for (std::size_t i = 0; i < count; ++i) {
+    steps[data.position.load(std::memory_order_relaxed)](fsm, data);
   }
 
-  auto start_time = std::chrono::high_resolution_clock::now();
+  alloc_calls.store(0);
+  alloc_bytes.store(0);
+  free_calls.store(0);
+  alloc_counting.store(true);
+  for (std::size_t i = 0; i < options.samples; ++i) {
+    steps[data.position.load(std::memory_order_relaxed)](fsm, data);
+  }
+  alloc_counting.store(false);
+
+  fsm.stop(&data);
+  return {alloc, count, options.samples, alloc_calls.load(),
+    alloc_bytes.load(), free_calls.load()};
+}
+
+template <alloc_type alloc>
+void alloc_bench_alloc(const bench_options &options,
+    std::vector<alloc_result> &results) {
+  results.push_back(run_alloc_bench<alloc, 2>(options));
+  if (options.max_states >= 32) {
+    results.push_back(run_alloc_bench<alloc, 32>(options));
+  }
+}
+
+/* Returns false if a zero allocation type allocated */
+/* Escapes the deliberate allocations of the self-check from the optimizer */
+static void* volatile alloc_probe;
 
-  for (int i = 0; i < num_transitions; ++i) {
-    if (i % 2 == 0) {
-      fsm.transition<state_a, state_b>(nullptr);
+struct alignas(64) aligned_probe {
+  char data[64];
+};
+
+/* Checks that deliberate allocations and frees of every hooked kind are
+ * counted, so zero counts of a run mean no allocations */
+static bool alloc_self_check() {
+  bool ok = true;
+  auto check = [&ok](const char *name, auto &&allocate) {
+    std::uint64_t allocs = alloc_calls.load();
+    std::uint64_t frees = free_calls.load();
+    alloc_counting.store(true);
+    allocate();
+    alloc_counting.store(false);
+    if (alloc_calls.load() == allocs || free_calls.load() == frees) {
+      std::cerr << "Allocation self-check: " << name << " was not counted\n";
+      ok = false;
+    }
+  };
+
+  check("operator new", [] {
+    int *ptr = new int(1);
+    alloc_probe = ptr;
+    delete ptr;
+  });
+  check("operator new[]", [] {
+    int *ptr = new int[4]();
+    alloc_probe = ptr;
+    delete[] ptr;
+  });
+#ifdef __cpp_aligned_new
+  check("aligned operator new", [] {
+    aligned_probe *ptr = new aligned_probe();
+    alloc_probe = ptr;
+    delete ptr;
+  });
+#endif
+#ifdef BENCH_HAS_MALLOC_HOOKS
+  check("malloc", [] {
+    void *ptr = std::malloc(16);
+    alloc_probe = ptr;
+    std::free(ptr);
+  });
+  check("aligned_alloc", [] {
+    void *ptr = std::aligned_alloc(64, 64);
+    alloc_probe = ptr;
+    std::free(ptr);
+  });
+  check("posix_memalign", [] {
+    void *ptr = nullptr;
+    if (!posix_memalign(&ptr, 64, 64)) {
+      alloc_probe = ptr;
+      std::free(ptr);
+    }
+  });
+  check("memalign", [] {
+    void *ptr = memalign(64, 64);
+    alloc_probe = ptr;
+    std::free(ptr);
+  });
+#endif
+  return ok;
+}
+
+static bool alloc_bench(const bench_options &options) {
+  if (!alloc_self_check()) {
+    std::cerr << "Allocation counting is incomplete, not benchmarking\n";
+    return false;
+  }
+
+  std::vector<alloc_result> results;
+  alloc_bench_alloc<alloc_type::LAZY>(options, results);
+  alloc_bench_alloc<alloc_type::PREALLOCED>(options, results);
+  alloc_bench_alloc<alloc_type::INTERNAL>(options, results);
+  alloc_bench_alloc<alloc_type::STATIC>(options, results);
+  alloc_bench_alloc<alloc_type::INPLACE>(options, results);
+
+  bool ok = true;
+  if (options.json) {
+    std::cout << "{\"results\":[";
+  } else {
+    std::cout << "Heap allocations per steady state transition\n";
+    std::printf("%-10s %6s %12s %12s %12s\n", "alloc", "states", "allocs",
+        "bytes", "frees");
+  }
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    const alloc_result &r = results[i];
+    double n = static_cast<double>(r.transitions);
+    bool failed = zero_alloc(r.alloc) && r.allocations;
+    ok = ok && !failed;
+    if (options.json) {
+      std::cout << (i ? "," : "") << "\n{\"alloc\":\"" << alloc_name(r.alloc)
+        << "\",\"states\":" << r.states
+        << ",\"transitions\":" << r.transitions
+        << ",\"allocations\":" << r.allocations
+        << ",\"bytes\":" << r.bytes
+        << ",\"frees\":" << r.frees
+        << ",\"zero_alloc\":" << (zero_alloc(r.alloc) ? "true" : "false")
+        << ",\"failed\":" << (failed ? "true" : "false") << "}";
     } else {
-      fsm.transition<state_b, state_a>(nullptr);
+      std::printf("%-10s %6zu %12.3f %12.3f %12.3f%s\n", alloc_name(r.alloc),
+          r.states, r.allocations / n, r.bytes / n, r.frees / n,
+          failed ? "  FAILED: expected no allocations" : "");
     }
   }
+  if (options.json) {
+    std::cout << "\n]}\n";
+  }
+  return ok;
+}
 
-  auto end_time = std::chrono::high_resolution_clock::now();
-  std::chrono::duration<double> elapsed = end_time - start_time;
+/* Memory footprint of state machine populations */
 
-  std::cout << num_transitions << " transitions took "
-    << elapsed.count() << " seconds\n";
+/* Plain state classes of a two state in-place ring, without a vtable */
+struct plain_idle {
+};
 
-  std::cout << "Avg time per transition: "
-    << 1000000 * elapsed.count() / num_transitions << " microseconds\n";
+struct plain_busy {
+};
 
-#else
+template <>
+struct cfsm::transition<plain_idle, plain_busy> {
+  void operator()(void *dataptr) {
+  }
+};
 
-#warning Cannot test internal statically preallocated storage for versions below C++14
-  std::cerr << "Cannot test internal statically preallocated storage for"
-    "versions below C++14\n";
+struct footprint_result {
+  const char *name;
+  std::size_t machines;
+  std::size_t size;             ///< sizeof a state machine or record
+  std::uint64_t allocations;    ///< Heap allocations, including the array
+  std::uint64_t bytes;          ///< Heap bytes requested
+  long long allocator_bytes;    ///< Heap bytes in use per malloc, -1 if unknown
+  long long rss;                ///< Resident set size delta, -1 if unknown
+};
 
+/* Resident set size in bytes, -1 if unknown */
+static long long resident_bytes() {
+#ifdef __linux__
+  std::FILE *file = std::fopen("/proc/self/statm", "r");
+  if (!file) {
+    return -1;
+  }
+  long long size = 0, resident = -1;
+  if (std::fscanf(file, "%lld %lld", &size, &resident) != 2) {
+    resident = -1;
+  }
+  std::fclose(file);
+  return resident < 0 ? -1 : resident * sysconf(_SC_PAGESIZE);
+#else
+  return -1;
 #endif
-
 }
 
-void benchmark_state_machine_external(int num_transitions) {
-  std::cout << "External preallocation\n";
-
-#if __cplusplus >= 201402L
-  state_machine<state, alloc_type::PREALLOCED, state_pool, state_a, state_b> fsm;
+/* Heap bytes in use including allocator overhead, -1 if unknown */
+static long long allocator_bytes() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  struct mallinfo2 info = mallinfo2();
+  return static_cast<long long>(info.uordblks + info.hblkhd);
 #else
-  state_machine<state, alloc_type::PREALLOCED, state_pool, 2> fsm;
+  return -1;
+#endif
+}
+
+/* Returns freed heap memory so that the next measurement starts clean */
+static void release_heap() {
+#ifdef __GLIBC__
+  malloc_trim(0);
 #endif
+}
+
+/*
+ * Measures `num_machines` objects created and started by `create`, which
+ * returns the container holding them.
+ */
+template <typename create_type>
+footprint_result measure_footprint(const char *name, std::size_t size,
+    std::size_t num_machines, create_type create) {
+  release_heap();
+  long long rss_before = resident_bytes();
+  long long heap_before = allocator_bytes();
+
+  alloc_calls.store(0);
+  alloc_bytes.store(0);
+  alloc_counting.store(true);
+  auto population = create(num_machines);
+  alloc_counting.store(false);
+
+  long long rss_after = resident_bytes();
+  long long heap_after = allocator_bytes();
+  footprint_result result{name, num_machines, size, alloc_calls.load(),
+    alloc_bytes.load(),
+    heap_before < 0 ? -1 : heap_after - heap_before,
+    rss_before < 0 ? -1 : rss_after - rss_before};
+
+  population.clear();
+  population.shrink_to_fit();
+  return result;
+}
 
-  fsm.start<state_a>(nullptr);
+template <alloc_type alloc>
+footprint_result measure_machines(std::size_t num_machines) {
+  using fsm_type = typename bench_machine<alloc, 2>::type;
+  if constexpr (alloc == alloc_type::PREALLOCED) {
+    fill_bench_pool<2>(std::make_index_sequence<2>{});
+  }
+  return measure_footprint(alloc_name(alloc), sizeof(fsm_type), num_machines,
+      [](std::size_t n) {
+        static bench_data data;
+        std::vector<fsm_type> machines(n);
+        for (fsm_type &fsm : machines) {
+          fsm.template start<bench_state<0, 2>>(&data);
+        }
+        return machines;
+      });
+}
 
-  /* Warmup */
-  for (int i = 0; i < num_transitions; ++i) {
-    if (i % 2 == 0) {
-      fsm.transition<state_a, state_b>(nullptr);
+static void footprint_bench(const bench_options &options) {
+  using plain_type =
+    state_machine_inplace<void, nullptr, plain_idle, plain_busy>;
+  using packed_type = typename bench_machine<alloc_type::INPLACE,
+        2>::type::packed_type;
+
+  std::size_t n = options.machines;
+  std::vector<footprint_result> results;
+  results.push_back(measure_machines<alloc_type::LAZY>(n));
+  results.push_back(measure_machines<alloc_type::PREALLOCED>(n));
+  results.push_back(measure_machines<alloc_type::INTERNAL>(n));
+  results.push_back(measure_machines<alloc_type::STATIC>(n));
+  results.push_back(measure_machines<alloc_type::INPLACE>(n));
+  results.push_back(measure_footprint("plain", sizeof(plain_type), n,
+      [](std::size_t n) {
+        std::vector<plain_type> machines(n);
+        for (plain_type &fsm : machines) {
+          fsm.start<plain_idle>(nullptr);
+        }
+        return machines;
+      }));
+
+  /* Packed records as kept by save_packed and cfsm::mapped_fleet */
+  results.push_back(measure_footprint("packed", sizeof(packed_type), n,
+      [](std::size_t n) {
+        return std::vector<packed_type>(n, 1);
+      }));
+
+  if (options.json) {
+    std::cout << "{\"machines\":" << n << ",\"results\":[";
+  } else {
+    std::cout << "Memory footprint of " << n << " started state machines\n";
+    std::printf("%-10s %6s %10s %12s %12s %12s %10s %10s\n", "alloc",
+        "sizeof", "allocs", "heap", "allocator", "rss", "heap/fsm",
+        "rss/fsm");
+  }
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    const footprint_result &r = results[i];
+    double heap_per = static_cast<double>(r.bytes) / r.machines;
+    if (options.json) {
+      std::cout << (i ? "," : "") << "\n{\"name\":\"" << r.name
+        << "\",\"sizeof\":" << r.size
+        << ",\"allocations\":" << r.allocations
+        << ",\"heap_bytes\":" << r.bytes
+        << ",\"allocator_bytes\":" << r.allocator_bytes
+        << ",\"rss_bytes\":" << r.rss
+        << ",\"heap_bytes_per_machine\":" << heap_per
+        << ",\"allocator_bytes_per_machine\":"
+        << (r.allocator_bytes < 0 ? -1.0 :
+            static_cast<double>(r.allocator_bytes) / r.machines)
+        << ",\"rss_bytes_per_machine\":"
+        << (r.rss < 0 ? -1.0 : static_cast<double>(r.rss) / r.machines)
+        << "}";
     } else {
-      fsm.transition<state_b, state_a>(nullptr);
+      std::printf("%-10s %6zu %10llu %12llu %12lld %12lld %10.2f %10.2f\n",
+          r.name, r.size, static_cast<unsigned long long>(r.allocations),
+          static_cast<unsigned long long>(r.bytes), r.allocator_bytes, r.rss,
+          heap_per,
+          r.rss < 0 ? -1.0 : static_cast<double>(r.rss) / r.machines);
     }
   }
+  if (options.json) {
+    std::cout << "\n]}\n";
+  }
+}
 
-  auto start_time = std::chrono::high_resolution_clock::now();
-
-  for (int i = 0; i < num_transitions; ++i) {
-    if (i % 2 == 0) {
-      fsm.transition<state_a, state_b>(nullptr);
-    } else {
-      fsm.transition<state_b, state_a>(nullptr);
+static void write_json(std::ostream &out,
+    const std::vector<bench_result> &results, double tsc_per_ns) {
+  auto stats = [&](const bench_result &r, double scale) {
+    out << "{\"min\":" << r.min / scale << ",\"p50\":" << r.p50 / scale
+      << ",\"p99\":" << r.p99 / scale << ",\"p999\":" << r.p999 / scale
+      << "}";
+  };
+
+  out << "{\"cplusplus\":" << __cplusplus
+    << ",\"tsc_ghz\":" << tsc_per_ns
+    << ",\"lock\":\"" << (__cplusplus >= 202002L ? "spin_wait" : "spin")
+    << "\",\"results\":[";
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    const bench_result &r = results[i];
+    out << (i ? "," : "") << "\n{\"alloc\":\"" << alloc_name(r.config.alloc)
+      << "\",\"states\":" << r.config.states
+      << ",\"threads\":" << r.config.threads
+      << ",\"hook_work\":" << r.config.hook_work
+      << ",\"contention\":\"" << contention_name(r.config.contention)
+      << "\",\"samples\":" << r.samples
+      << ",\"failed\":" << r.failed
+      << ",\"cycles\":";
+    stats(r, 1);
+    out << ",\"ns\":";
+    stats(r, tsc_per_ns);
+    out << ",\"per_transition\":{";
+    for (std::size_t e = 0; e < perf_event_count; ++e) {
+      out << (e ? "," : "") << "\"" << perf_event_names[e] << "\":";
+      if (r.perf[e] < 0) {
+        out << "null";
+      } else {
+        out << r.perf[e];
+      }
     }
+    out << "}}";
   }
+  out << "\n]}\n";
+}
 
-  auto end_time = std::chrono::high_resolution_clock::now();
-  std::chrono::duration<double> elapsed = end_time - start_time;
+#endif /* __cplusplus >= 201703L */
 
-  std::cout << num_transitions << " transitions took "
-    << elapsed.count() << " seconds\n";
+#if __cplusplus >= 201703L && defined(CFSM_HAS_BACKGROUND_CHECKPOINT)
+
+/* Transition latencies in nanoseconds, sorted */
+template <typename fsm_type, typename predicate_type>
+std::vector<double> sample_transition_latencies(
+    std::vector<fsm_type> &machines, std::size_t num_samples,
+    predicate_type keep_going
+) {
+  std::vector<double> latencies;
+  latencies.reserve(num_samples);
+
+  for (std::size_t i = 0; i < num_samples || keep_going(); ++i) {
+    fsm_type &fsm = machines[(i * 7919) % machines.size()];
+    auto start_time = std::chrono::steady_clock::now();
+    if (!fsm.template transition<state_a, state_b>(nullptr)) {
+      fsm.template transition<state_b, state_a>(nullptr);
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    latencies.push_back(
+        std::chrono::duration<double, std::nano>(end_time - start_time)
+        .count());
+  }
 
-  std::cout << "Avg time per transition: "
-    << 1000000 * elapsed.count() / num_transitions << " microseconds\n";
+  std::sort(latencies.begin(), latencies.end());
+  return latencies;
 }
 
-void benchmark_concurrent_state_machine_lazy(
-    int num_transitions, int num_threads
-) {
-  std::cout << "Concurrent lazy allocation\n";
+static double percentile(const std::vector<double> &sorted, double p) {
+  return sorted[static_cast<std::size_t>(p * (sorted.size() - 1))];
+}
 
-#if __cplusplus >= 201402L
-  state_machine<state, alloc_type::LAZY, nullptr, state_a, state_b> fsm;
-#else
-  state_machine<state, alloc_type::LAZY, nullptr, 2> fsm;
 #endif
 
-  std::vector<std::thread> threads;
-  fsm.start<state_a>(nullptr);
-
-  /* Warmup */
-  for (int t = 0; t < num_threads; ++t) {
-    threads.emplace_back(
-        [&] {
-          for (int i = 0; i < num_transitions / num_threads; ++i) {
-            if (i % 2 == 0) {
-              while (fsm.state<state_a>() == nullptr);
-              fsm.transition<state_a, state_b>(nullptr);
-            } else {
-              while (fsm.state<state_b>() == nullptr);
-              fsm.transition<state_b, state_a>(nullptr);
-            }
-          }
-        }
-    );
-  }
+void benchmark_background_checkpoint(std::size_t num_machines) {
+  std::cout << "Background checkpoint impact on transition latency\n";
+
+#if __cplusplus >= 201703L && defined(CFSM_HAS_BACKGROUND_CHECKPOINT)
+  using fsm_type =
+    state_machine<state, alloc_type::INPLACE, nullptr, state_a, state_b>;
 
-  for (auto &t : threads) {
-    t.join();
+  std::vector<fsm_type> machines(num_machines);
+  for (auto &fsm : machines) {
+    fsm.start<state_a>(nullptr);
   }
-  fsm.stop(nullptr);
 
-  threads.clear();
+  std::vector<double> idle = sample_transition_latencies(machines,
+      num_machines, [] { return false; });
 
-  auto start_time = std::chrono::high_resolution_clock::now();
+  std::FILE *file = std::tmpfile();
+  if (!file) {
+    std::cerr << "Cannot create a temporary file for the checkpoint\n";
+    return;
+  }
+  cfsm::background_checkpoint<fsm_type> checkpoint(machines.data(),
+      num_machines);
 
-  fsm.start<state_a>(nullptr);
+  auto start_time = std::chrono::high_resolution_clock::now();
+  checkpoint.start(fileno(file), false);
+  std::vector<double> busy = sample_transition_latencies(machines, 0,
+      [&checkpoint] { return checkpoint.running(); });
+  checkpoint.wait();
+  auto end_time = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double> elapsed = end_time - start_time;
+  std::fclose(file);
 
-  for (int t = 0; t < num_threads; ++t) {
-    threads.emplace_back(
-        [&] {
-          for (int i = 0; i < num_transitions / num_threads; ++i) {
-            if (i % 2 == 0) {
-              while (fsm.state<state_a>() == nullptr);
-              fsm.transition<state_a, state_b>(nullptr);
-            } else {
-              while (fsm.state<state_b>() == nullptr);
-              fsm.transition<state_b, state_a>(nullptr);
-            }
-          }
-        }
-    );
+  std::cout << num_machines << " machines checkpointed in "
+    << elapsed.count() << " seconds\n";
+  std::cout << "Without checkpoint: p50 " << percentile(idle, 0.5)
+    << " ns, p99 " << percentile(idle, 0.99) << " ns\n";
+  if (!busy.empty()) {
+    std::cout << "During checkpoint:  p50 " << percentile(busy, 0.5)
+      << " ns, p99 " << percentile(busy, 0.99) << " ns ("
+      << busy.size() << " transitions)\n";
   }
 
-  for (auto &t : threads) {
-    t.join();
+#else
+
+#warning Cannot benchmark background checkpoints for versions below C++17
+  std::cerr << "Cannot benchmark background checkpoints for versions below"
+    " C++17\n";
+
+#endif
+
+}
+
+void benchmark_compressed_snapshot(std::size_t num_machines) {
+  std::cout << "Compressed snapshot size and load time\n";
+
+#if __cplusplus >= 201703L
+  using fsm_type =
+    state_machine<state, alloc_type::INPLACE, nullptr, state_a, state_b>;
+
+  /* Mostly idle, every 100th state machine moved on */
+  std::vector<fsm_type> machines(num_machines);
+  for (std::size_t i = 0; i < num_machines; ++i) {
+    machines[i].start<state_a>(nullptr);
+    if (i % 100 == 0) {
+      machines[i].transition<state_a, state_b>(nullptr);
+    }
   }
 
-  fsm.stop(nullptr);
+  std::vector<char> plain(fsm_type::snapshot_bound(num_machines));
+  std::size_t plain_len = fsm_type::save_many(machines.data(), num_machines,
+      plain.data(), plain.size());
+  std::vector<char> compressed(fsm_type::compressed_bound(num_machines));
+  std::size_t compressed_len = fsm_type::save_many_compressed(machines.data(),
+      num_machines, compressed.data(), compressed.size());
 
+  auto start_time = std::chrono::high_resolution_clock::now();
+  fsm_type::load_many(machines.data(), num_machines, plain.data(), plain_len);
   auto end_time = std::chrono::high_resolution_clock::now();
-  std::chrono::duration<double> elapsed = end_time - start_time;
+  std::chrono::duration<double> plain_elapsed = end_time - start_time;
 
-  std::cout << num_transitions << " transitions took "
-            << elapsed.count() << " seconds." << std::endl;
+  start_time = std::chrono::high_resolution_clock::now();
+  fsm_type::load_many_compressed(machines.data(), num_machines,
+      compressed.data(), compressed_len);
+  end_time = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double> compressed_elapsed = end_time - start_time;
 
-  std::cout << "Avg time per transition: "
-    << 1000000 * elapsed.count() / num_transitions << " microseconds\n";
+  std::cout << "Plain:      " << plain_len << " bytes, loaded in "
+    << plain_elapsed.count() << " seconds\n";
+  std::cout << "Compressed: " << compressed_len << " bytes, loaded in "
+    << compressed_elapsed.count() << " seconds ("
+    << static_cast<double>(plain_len) / compressed_len << "x smaller)\n";
 
-  threads.clear();
-}
+#else
 
-static inline uint64_t rdtsc() {
-    uint32_t lo, hi;
-    asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
-    return ((uint64_t)hi << 32) | lo;
-}
+#warning Cannot benchmark compressed snapshots for versions below C++17
+  std::cerr << "Cannot benchmark compressed snapshots for versions below"
+    " C++17\n";
 
-void calculate_cpu_clock_speed() {
-    uint64_t start, end;
-    std::chrono::duration<double> elapsed;
+#endif
 
-    // Get TSC and time at start
-    start = rdtsc();
-    auto start_time = std::chrono::high_resolution_clock::now();
+}
 
-    // Busy-wait loop (~1 ms)
-    do {
-      auto end_time = std::chrono::high_resolution_clock::now();
-      elapsed = end_time - start_time;
-    } while (elapsed.count() < 0.001);
+int main(int argc, char **argv) {
+#if __cplusplus >= 201703L
+  bench_options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--json") {
+      options.json = true;
+    } else if (arg == "--samples" && i + 1 < argc) {
+      options.samples = std::stoul(argv[++i]);
+    } else if (arg == "--max-states" && i + 1 < argc) {
+      options.max_states = std::stoul(argv[++i]);
+    } else if (arg == "--max-threads" && i + 1 < argc) {
+      options.max_threads = std::max(1ul, std::stoul(argv[++i]));
+    } else if (arg == "--allocs") {
+      options.allocs = true;
+    } else if (arg == "--footprint") {
+      options.footprint = true;
+    } else if (arg == "--machines" && i + 1 < argc) {
+      options.machines = std::max(1ul, std::stoul(argv[++i]));
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--json] [--allocs]"
+        " [--footprint] [--machines n] [--samples n] [--max-states n]"
+        " [--max-threads n]\n";
+      return 1;
+    }
+  }
 
-    end = rdtsc();
+  if (options.allocs) {
+    return alloc_bench(options) ? 0 : 1;
+  }
+  if (options.footprint) {
+    footprint_bench(options);
+    return 0;
+  }
 
-    double fcpu_hz = (end - start) / elapsed.count();
-    double fcpu_ghz = fcpu_hz / 1e9;
+  double tsc_per_ns = calibrate_tsc();
+  options.tsc_per_ns = tsc_per_ns;
+  if (!options.json) {
+    std::cout << "Compile-time state machine benchmark\n";
+    std::cout << "Timestamp counter: " << tsc_per_ns << " GHz, lock: "
+      << (__cplusplus >= 202002L ? "spin_wait" : "spin") << "\n";
+    std::cout << "Transition latency in cycles and in ns, hardware events per"
+      " transition\n";
+    std::printf("%-10s %6s %7s %5s %-11s %8s %8s %8s %8s %8s %8s %8s %8s %8s"
+        " %8s %8s %8s %8s %8s\n", "alloc", "states", "threads", "hook",
+        "contention", "min", "p50", "p99", "p999", "min ns", "p50 ns",
+        "p99 ns", "p999 ns", "cycles", "instrs", "br-miss", "l1d-miss",
+        "llc-miss", "dtlb-mis");
+  }
 
-    std::cout << "CPU freq: " << fcpu_ghz << " GHz\n";
-}
+  std::vector<bench_result> results;
+  bench_alloc<alloc_type::LAZY>(options, results);
+  bench_alloc<alloc_type::PREALLOCED>(options, results);
+  bench_alloc<alloc_type::INTERNAL>(options, results);
+  bench_alloc<alloc_type::STATIC>(options, results);
+  bench_alloc<alloc_type::INPLACE>(options, results);
+
+  if (options.json) {
+    write_json(std::cout, results, tsc_per_ns);
+    return 0;
+  }
+#else
+#warning Cannot benchmark transitions for versions below C++17
+  std::cerr << "Cannot benchmark transitions for versions below C++17\n";
+#endif
 
-int main() {
-  std::cout << "Compile-time state machine benchmark\n";
-  calculate_cpu_clock_speed();
-  benchmark_state_machine_lazy(8000000);
-  benchmark_state_machine_external(8000000);
-  benchmark_state_machine_internal(8000000);
-  benchmark_state_machine_internal_static(8000000);
-  benchmark_concurrent_state_machine_lazy(8000000, 8);
+  benchmark_background_checkpoint(4000000);
+  benchmark_compressed_snapshot(4000000);
 
   return 0;
 }
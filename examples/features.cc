@@ -0,0 +1,634 @@
+/* Tests of the instrumentation enabled by the CFSM_* macros; simple.cc
+ * runs the rest of the tests with every macro off */
+#define CFSM_FLIGHT_RECORDER
+#define CFSM_FLIGHT_RECORDER_SIZE 64
+#define CFSM_STATS
+#define CFSM_LATENCY
+#define CFSM_LOCK_STATS_PER_MACHINE
+#define CFSM_TRACE
+#define CFSM_TRACE_EVENTS 16
+#define CFSM_USDT
+#define CFSM_METRICS
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <string>
+#include <memory>
+#include <sstream>
+#include <cstdio>
+#include <chrono>
+#include <cfsm.hpp>
+
+using namespace cfsm;
+
+/* States without entry/exit actions; the hooks must never be called */
+class state_quiet_1 final
+  : public state, public no_entry_action, public no_exit_action {
+public:
+  void on_enter(void *dataptr) const override {
+    assert(false);
+  }
+
+  void on_exit(void *dataptr) const override {
+    assert(false);
+  }
+};
+
+class state_quiet_2 final : public state, public no_exit_action {
+public:
+  void on_enter(void *dataptr) const override {
+    ++*reinterpret_cast<int*>(dataptr);
+  }
+
+  void on_exit(void *dataptr) const override {
+    assert(false);
+  }
+};
+
+CFSM_TRANSITION(state_quiet_1, state_quiet_2) {
+}
+
+CFSM_TRANSITION(state_quiet_2, state_quiet_1) {
+}
+
+/* Plain states with completion transitions */
+struct job_idle {
+  static void on_enter(void *dataptr) {
+    *reinterpret_cast<std::string*>(dataptr) += "i";
+  }
+};
+
+struct job_prepare {
+  static void on_enter(void *dataptr) {
+    *reinterpret_cast<std::string*>(dataptr) += "p";
+  }
+};
+
+struct job_run {
+  static void on_exit(void *dataptr) {
+    *reinterpret_cast<std::string*>(dataptr) += "r";
+  }
+};
+
+struct job_done {
+  static void on_enter(void *dataptr) {
+    *reinterpret_cast<std::string*>(dataptr) += "d";
+  }
+};
+
+CFSM_TRANSITION(job_idle, job_prepare) {
+}
+
+CFSM_COMPLETION(job_prepare, job_run) {
+  *reinterpret_cast<std::string*>(dataptr) += ">";
+}
+
+CFSM_COMPLETION(job_run, job_done) {
+  *reinterpret_cast<std::string*>(dataptr) += ">";
+}
+
+CFSM_TRANSITION(job_done, job_idle) {
+}
+
+/* Plain states with a slow completion transition */
+struct lap_start {
+};
+
+struct lap_run {
+};
+
+struct lap_end {
+};
+
+CFSM_TRANSITION(lap_start, lap_run) {
+}
+
+CFSM_COMPLETION(lap_run, lap_end) {
+  auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(50);
+  while (std::chrono::steady_clock::now() < until) {
+  }
+}
+
+CFSM_TRANSITION(lap_end, lap_start) {
+}
+
+void test_flight_recorder() {
+#if __cplusplus >= 201703L
+  using fsm_type = state_machine_inplace<
+    state,
+    nullptr,
+    state_quiet_1,
+    state_quiet_2
+  >;
+
+  cfsm::flight_recorder::clear();
+
+  int count = 0;
+  fsm_type fsm;
+  fsm.start<state_quiet_1>(&count);
+  assert((fsm.transition<state_quiet_1, state_quiet_2>(&count)));
+  fsm.stop(&count);
+
+  /* Another thread wraps its own ring */
+  fsm_type other;
+  std::thread worker([&other, &count] {
+    other.start<state_quiet_1>(&count);
+    for (int i = 0; i < 100; ++i) {
+      assert((other.transition<state_quiet_1, state_quiet_2>(&count)));
+      assert((other.transition<state_quiet_2, state_quiet_1>(&count)));
+    }
+  });
+  worker.join();
+
+  std::vector<cfsm::flight_record> mine;
+  std::vector<cfsm::flight_record> theirs;
+  cfsm::flight_recorder::for_each(
+      [&](std::size_t, const cfsm::flight_record &rec) {
+        (rec.machine == &fsm ? mine : theirs).push_back(rec);
+      });
+
+  assert(mine.size() == 3);
+  assert(mine[0].from == cfsm::journal_stopped && mine[0].to == 0);
+  assert(mine[1].from == 0 && mine[1].to == 1);
+  assert(mine[2].from == 1 && mine[2].to == cfsm::journal_stopped);
+  assert(mine[0].tsc <= mine[1].tsc && mine[1].tsc <= mine[2].tsc);
+
+  assert(theirs.size() == cfsm::flight_recorder::ring_size);
+  assert(theirs.back().machine == &other);
+  assert(theirs.back().from == 1 && theirs.back().to == 0);
+
+#if __has_include(<unistd.h>)
+  std::FILE *file = std::tmpfile();
+  assert(file != nullptr);
+  assert(cfsm::flight_recorder::dump(fileno(file)));
+  std::rewind(file);
+  char line[128];
+  std::size_t lines = 0;
+  bool found_stop = false;
+  while (std::fgets(line, sizeof(line), file)) {
+    ++lines;
+    found_stop = found_stop || std::string(line).find(" from 1 to - ") !=
+      std::string::npos;
+  }
+  std::fclose(file);
+  assert(lines == 3 + cfsm::flight_recorder::ring_size);
+  assert(found_stop);
+#endif
+
+  /* The state a completion chain comes to rest in is recorded */
+  using job_fsm_type = state_machine_inplace<
+    void,
+    nullptr,
+    job_idle,
+    job_prepare,
+    job_run,
+    job_done
+  >;
+  std::string trace;
+  job_fsm_type job_fsm;
+  job_fsm.start<job_idle>(&trace);
+  assert((job_fsm.transition<job_idle, job_prepare>(&trace)));
+  std::vector<cfsm::flight_record> jobs;
+  cfsm::flight_recorder::for_each(
+      [&](std::size_t, const cfsm::flight_record &rec) {
+        if (rec.machine == &job_fsm) {
+          jobs.push_back(rec);
+        }
+      });
+  assert(jobs.size() == 2);
+  assert(jobs[1].from == 0 && jobs[1].to == 3);
+  job_fsm.stop(&trace);
+#else
+#warning Cannot test the flight recorder for versions below C++17
+  std::cerr << "Cannot test the flight recorder for versions below C++17\n";
+#endif
+}
+
+void test_stats() {
+#if __cplusplus >= 201703L
+  using fsm_type = state_machine_inplace<
+    state,
+    nullptr,
+    state_quiet_1,
+    state_quiet_2
+  >;
+  using stats = cfsm::stats<fsm_type>;
+
+  stats::reset();
+
+  /* Threads count in their own matrices */
+  constexpr int num_threads = 4;
+  constexpr int rounds = 1000;
+  int count = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&count] {
+      int local = 0;
+      fsm_type fsm;
+      fsm.start<state_quiet_1>(&local);
+      for (int i = 0; i < rounds; ++i) {
+        assert((fsm.transition<state_quiet_1, state_quiet_2>(&local)));
+        assert((fsm.transition<state_quiet_2, state_quiet_1>(&local)));
+      }
+      fsm.stop(&local);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  fsm_type fsm;
+  fsm.start<state_quiet_2>(&count);
+  assert((fsm.go_to<state_quiet_1>(&count)));
+  assert(!(fsm.transition<state_quiet_2, state_quiet_1>(&count)));
+
+  auto counts = std::make_unique<stats::snapshot_type>();
+  stats::snapshot(*counts);
+  assert(counts->transitions[0][1] == num_threads * rounds);
+  assert(counts->transitions[1][0] == num_threads * rounds + 1);
+  assert(counts->transitions[0][0] == 0 && counts->transitions[1][1] == 0);
+  assert(counts->starts[0] == num_threads && counts->starts[1] == 1);
+  assert(counts->stops[0] == num_threads && counts->stops[1] == 0);
+  assert(counts->entries[0] == num_threads * (rounds + 1) + 1);
+  assert(counts->entries[1] == num_threads * rounds + 1);
+
+  stats::reset();
+  stats::snapshot(*counts);
+  assert(counts->entries[0] == 0 && counts->transitions[0][1] == 0);
+
+  /* Every hop of a completion chain is counted */
+  using job_fsm_type = state_machine_inplace<
+    void,
+    nullptr,
+    job_idle,
+    job_prepare,
+    job_run,
+    job_done
+  >;
+  using job_stats = cfsm::stats<job_fsm_type>;
+
+  job_stats::reset();
+  std::string trace;
+  job_fsm_type job_fsm;
+  job_fsm.start<job_idle>(&trace);
+  assert((job_fsm.transition<job_idle, job_prepare>(&trace)));
+  job_fsm.stop(&trace);
+
+  auto job_counts = std::make_unique<job_stats::snapshot_type>();
+  job_stats::snapshot(*job_counts);
+  assert(job_counts->transitions[0][1] == 1);
+  assert(job_counts->transitions[1][2] == 1);
+  assert(job_counts->transitions[2][3] == 1);
+  for (std::size_t i = 0; i < 4; ++i) {
+    assert(job_counts->entries[i] == 1);
+  }
+  assert(job_counts->starts[0] == 1 && job_counts->stops[3] == 1);
+#else
+#warning Cannot test transition statistics for versions below C++17
+  std::cerr << "Cannot test transition statistics for versions below C++17\n";
+#endif
+}
+
+void test_latency() {
+#if __cplusplus >= 201703L
+  using cfsm::latency_histogram;
+  using cfsm::latency_phase;
+
+  /* Bucket bounds */
+  for (std::uint64_t value : {0ull, 7ull, 8ull, 15ull, 16ull, 17ull, 1000ull,
+      123456789ull, ~0ull}) {
+    std::size_t bucket = latency_histogram::bucket(value);
+    assert(bucket < latency_histogram::bucket_count);
+    assert(latency_histogram::bucket_max(bucket) >= value);
+    assert(!bucket || latency_histogram::bucket_max(bucket - 1) < value);
+    assert(latency_histogram::bucket_max(bucket) - value <= value / 8);
+  }
+
+  latency_histogram histogram;
+  assert(histogram.percentile(0.5) == 0);
+  for (std::uint64_t value = 1; value <= 1000; ++value) {
+    histogram.record(value);
+  }
+  assert(histogram.count() == 1000);
+  assert(histogram.percentile(0.001) == 1);
+  assert(histogram.percentile(0.5) >= 500 && histogram.percentile(0.5) < 563);
+  assert(histogram.percentile(1.0) >= 1000);
+
+  using fsm_type = state_machine_inplace<
+    state,
+    nullptr,
+    state_quiet_1,
+    state_quiet_2
+  >;
+  using latency = cfsm::latency<fsm_type>;
+
+  latency::reset();
+
+  int count = 0;
+  fsm_type fsm;
+  fsm.start<state_quiet_1>(&count);
+  for (int i = 0; i < 1000; ++i) {
+    assert((fsm.transition<state_quiet_1, state_quiet_2>(&count)));
+    assert((fsm.transition<state_quiet_2, state_quiet_1>(&count)));
+  }
+  assert(!(fsm.transition<state_quiet_2, state_quiet_1>(&count)));
+  fsm.stop(&count);
+
+  for (std::size_t index = 0; index < 2; ++index) {
+    for (auto phase : {latency_phase::lock_wait, latency_phase::on_exit,
+        latency_phase::functor, latency_phase::on_enter,
+        latency_phase::total}) {
+      assert(latency::histogram(phase, index).count() == 1000);
+    }
+    std::uint64_t p50 = latency::percentile(latency_phase::total, index, 0.5);
+    std::uint64_t p99 = latency::percentile(latency_phase::total, index, 0.99);
+    std::uint64_t p999 = latency::percentile(latency_phase::total, index,
+        0.999);
+    assert(p50 > 0 && p50 <= p99 && p99 <= p999);
+
+    /* Entering the other state is part of leaving this one */
+    assert(latency::percentile(latency_phase::on_enter, 1 - index, 0.5) <=
+        p50);
+  }
+  assert(latency::histogram(latency_phase::total, 2).count() == 0);
+
+  latency::reset();
+  assert(latency::histogram(latency_phase::total, 0).count() == 0);
+
+  /* Phases time the transition asked for, completion hops count only in
+   * the total */
+  using lap_fsm_type = state_machine_inplace<
+    void,
+    nullptr,
+    lap_start,
+    lap_run,
+    lap_end
+  >;
+  using lap_latency = cfsm::latency<lap_fsm_type>;
+
+  lap_latency::reset();
+  lap_fsm_type lap_fsm;
+  lap_fsm.start<lap_start>(nullptr);
+  for (int i = 0; i < 100; ++i) {
+    assert((lap_fsm.transition<lap_start, lap_run>(nullptr)));
+    assert(lap_fsm.state<lap_end>() != nullptr);
+    assert((lap_fsm.transition<lap_end, lap_start>(nullptr)));
+  }
+  lap_fsm.stop(nullptr);
+
+  assert(lap_latency::histogram(latency_phase::total, 0).count() == 100);
+  assert(lap_latency::histogram(latency_phase::total, 1).count() == 0);
+  assert(lap_latency::histogram(latency_phase::on_enter, 1).count() == 100);
+  assert(lap_latency::histogram(latency_phase::on_enter, 2).count() == 0);
+  std::uint64_t lap_total =
+    lap_latency::percentile(latency_phase::total, 0, 0.5);
+  for (auto phase : {latency_phase::on_exit, latency_phase::functor}) {
+    assert(lap_latency::percentile(phase, 0, 0.99) * 10 < lap_total);
+  }
+  assert(lap_latency::percentile(latency_phase::on_enter, 1, 0.99) * 10 <
+      lap_total);
+#else
+#warning Cannot test transition latency for versions below C++17
+  std::cerr << "Cannot test transition latency for versions below C++17\n";
+#endif
+}
+
+void test_lock_stats() {
+#if __cplusplus >= 201703L
+  using fsm_type = state_machine_inplace<
+    state,
+    nullptr,
+    state_quiet_1,
+    state_quiet_2
+  >;
+  using lock_stats = cfsm::lock_stats<fsm_type>;
+
+  fsm_type hot;
+  fsm_type cold;
+  int count = 0;
+  hot.start<state_quiet_1>(&count);
+  cold.start<state_quiet_1>(&count);
+  assert(hot.lock_contention(true).acquisitions == 1);
+  cold.lock_contention(true);
+  lock_stats::reset();
+
+  /* Threads fight over one state machine */
+  constexpr int num_threads = 4;
+  constexpr int rounds = 2000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&hot] {
+      int local = 0;
+      for (int i = 0; i < rounds; ++i) {
+        if (!hot.transition<state_quiet_1, state_quiet_2>(&local)) {
+          hot.transition<state_quiet_2, state_quiet_1>(&local);
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  assert((cold.transition<state_quiet_1, state_quiet_2>(&count)));
+
+  cfsm::lock_counts hot_counts = hot.lock_contention();
+  cfsm::lock_counts cold_counts = cold.lock_contention();
+  assert(hot_counts.acquisitions >= num_threads * rounds);
+  assert(hot_counts.contended <= hot_counts.acquisitions);
+  assert(hot_counts.spins + hot_counts.parks >= hot_counts.contended);
+#if __cplusplus >= 202002L
+  assert(hot_counts.spins == 0);
+#else
+  assert(hot_counts.parks == 0);
+#endif
+  assert(hot_counts.contended || hot_counts.wait_cycles == 0);
+  assert(cold_counts.acquisitions == 1 && cold_counts.contended == 0);
+
+  /* Reading the history is not counted */
+  assert(hot.lock_contention().acquisitions == hot_counts.acquisitions);
+
+  cfsm::lock_counts counts = lock_stats::snapshot();
+  assert(counts.acquisitions ==
+      hot_counts.acquisitions + cold_counts.acquisitions);
+  assert(counts.contended == hot_counts.contended);
+  assert(counts.spins == hot_counts.spins);
+  assert(counts.parks == hot_counts.parks);
+  assert(counts.wait_cycles == hot_counts.wait_cycles);
+
+  lock_stats::reset();
+  assert(lock_stats::snapshot().acquisitions == 0);
+#else
+#warning Cannot test lock contention counters for versions below C++17
+  std::cerr << "Cannot test lock contention counters for versions below"
+    " C++17\n";
+#endif
+}
+
+void test_trace() {
+#if __cplusplus >= 201703L
+  using fsm_type = state_machine_inplace<
+    state,
+    nullptr,
+    state_quiet_1,
+    state_quiet_2
+  >;
+
+  cfsm::trace::clear();
+
+  int count = 0;
+  fsm_type fsm;
+  fsm.start<state_quiet_1>(&count);
+  assert((fsm.transition<state_quiet_1, state_quiet_2>(&count)));
+  assert(!(fsm.transition<state_quiet_1, state_quiet_2>(&count)));
+  fsm.stop(&count);
+  fsm.stop(&count);
+
+  std::ostringstream out;
+  cfsm::trace::write(out);
+  std::string json = out.str();
+  assert(json.find("\"traceEvents\":[") != std::string::npos);
+  assert(json.find("\"name\":\"start state_quiet_1\"") != std::string::npos);
+  assert(json.find("\"name\":\"state_quiet_1 -> state_quiet_2\"") !=
+      std::string::npos);
+  assert(json.find("\"name\":\"stop state_quiet_2\"") != std::string::npos);
+  assert(json.find("\"from\":0,\"to\":1}") != std::string::npos);
+
+  std::size_t events = 0;
+  for (std::size_t pos = 0; (pos = json.find("\"ph\":\"X\"", pos)) !=
+      std::string::npos; ++pos) {
+    ++events;
+  }
+  assert(events == 3);
+  assert(json.substr(json.size() - 3) == "]}\n");
+
+  /* Full buffers drop events */
+  fsm.start<state_quiet_1>(&count);
+  for (std::size_t i = 0; i < cfsm::trace::capacity; ++i) {
+    if (!fsm.transition<state_quiet_1, state_quiet_2>(&count)) {
+      assert((fsm.transition<state_quiet_2, state_quiet_1>(&count)));
+    }
+  }
+  assert(cfsm::trace::dropped() == 4);
+
+  /* Events are named after the state a completion chain comes to rest in */
+  cfsm::trace::clear();
+  using job_fsm_type = state_machine_inplace<
+    void,
+    nullptr,
+    job_idle,
+    job_prepare,
+    job_run,
+    job_done
+  >;
+  std::string trace;
+  job_fsm_type job_fsm;
+  job_fsm.start<job_idle>(&trace);
+  assert((job_fsm.transition<job_idle, job_prepare>(&trace)));
+  job_fsm.stop(&trace);
+  std::ostringstream jobs;
+  cfsm::trace::write(jobs);
+  assert(jobs.str().find("\"name\":\"job_idle -> job_done\"") !=
+      std::string::npos);
+  assert(jobs.str().find("\"from\":0,\"to\":3}") != std::string::npos);
+
+  cfsm::trace::clear();
+  std::ostringstream empty;
+  cfsm::trace::write(empty);
+  assert(empty.str().find("\"ph\"") == std::string::npos);
+#else
+#warning Cannot test trace export for versions below C++17
+  std::cerr << "Cannot test trace export for versions below C++17\n";
+#endif
+}
+
+void test_metrics() {
+#if __cplusplus >= 201703L
+  using fsm_type = state_machine_inplace<
+    state,
+    nullptr,
+    state_quiet_1,
+    state_quiet_2
+  >;
+  using population = cfsm::population<fsm_type>;
+
+  /* Earlier tests may have left state machines running */
+  std::int64_t base_1 = population::count(0);
+  std::int64_t base_2 = population::count(1);
+
+  int count = 0;
+  {
+    fsm_type machines[4];
+    for (auto &fsm : machines) {
+      fsm.start<state_quiet_1>(&count);
+    }
+    assert((machines[0].transition<state_quiet_1, state_quiet_2>(&count)));
+    assert((machines[1].transition<state_quiet_1, state_quiet_2>(&count)));
+    machines[3].stop(&count);
+    assert(population::count(0) == base_1 + 1);
+    assert(population::count(1) == base_2 + 2);
+
+    /* Restored state machines are counted */
+    char snapshot[fsm_type::snapshot_bound(1)];
+    std::size_t len = machines[0].save(snapshot, sizeof(snapshot));
+    assert(len > 0);
+    assert(machines[2].load(snapshot, len) == len);
+    assert(population::count(0) == base_1);
+    assert(population::count(1) == base_2 + 3);
+
+    cfsm::prometheus_exporter exporter;
+    exporter.add<fsm_type>("quiet");
+    char text[4096];
+    std::size_t size = exporter.write(text, sizeof(text));
+    assert(size > 0);
+    std::string metrics(text, size);
+    assert(metrics.find("# TYPE cfsm_machines gauge\n") != std::string::npos);
+    assert(metrics.find("cfsm_machines{machine=\"quiet\","
+          "state=\"state_quiet_2\"} " + std::to_string(base_2 + 3) + "\n") !=
+        std::string::npos);
+    assert(metrics.find("cfsm_transitions_total{machine=\"quiet\","
+          "from=\"state_quiet_1\",to=\"state_quiet_2\"} ") !=
+        std::string::npos);
+    assert(metrics.find("# TYPE cfsm_lock_acquisitions_total counter\n") !=
+        std::string::npos);
+
+    /* Buffer too small */
+    assert(exporter.write(text, size - 1) == 0);
+  }
+
+  /* Destroyed state machines leave their states */
+  assert(population::count(0) == base_1);
+  assert(population::count(1) == base_2);
+#else
+#warning Cannot test metrics export for versions below C++17
+  std::cerr << "Cannot test metrics export for versions below C++17\n";
+#endif
+}
+
+int main() {
+  std::cout << "Flight recorder test\n\n";
+  test_flight_recorder();
+  std::cout << "test_flight_recorder end\n";
+
+  std::cout << "\nTransition statistics test\n\n";
+  test_stats();
+  std::cout << "test_stats end\n";
+
+  std::cout << "\nTransition latency test\n\n";
+  test_latency();
+  std::cout << "test_latency end\n";
+
+  std::cout << "\nLock contention test\n\n";
+  test_lock_stats();
+  std::cout << "test_lock_stats end\n";
+
+  std::cout << "\nTrace export test\n\n";
+  test_trace();
+  std::cout << "test_trace end\n";
+
+  std::cout << "\nMetrics export test\n\n";
+  test_metrics();
+  std::cout << "test_metrics end\n";
+
+  return 0;
+}
@@ -2,6 +2,15 @@
 #include <vector>
 #include <thread>
 #include <atomic>
+#include <string>
+#include <memory>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
 #include <cfsm.hpp>
 
 using namespace cfsm;
@@ -59,6 +68,188 @@ CFSM_TRANSITION(state_a, state_c) {
   std::cout << "Transitioning from state A to state C\n";
 }
 
+/* States without entry/exit actions; the hooks must never be called */
+class state_quiet_1 final
+  : public state, public no_entry_action, public no_exit_action {
+public:
+  void on_enter(void *dataptr) const override {
+    assert(false);
+  }
+
+  void on_exit(void *dataptr) const override {
+    assert(false);
+  }
+};
+
+class state_quiet_2 final : public state, public no_exit_action {
+public:
+  void on_enter(void *dataptr) const override {
+    ++*reinterpret_cast<int*>(dataptr);
+  }
+
+  void on_exit(void *dataptr) const override {
+    assert(false);
+  }
+};
+
+CFSM_TRANSITION(state_quiet_1, state_quiet_2) {
+}
+
+CFSM_TRANSITION(state_quiet_2, state_quiet_1) {
+}
+
+/* Plain state classes observing construction and destruction */
+static int tracked_alive = 0;
+static bool fragile_throws = false;
+
+struct plain_tracked {
+  plain_tracked() {
+    ++tracked_alive;
+  }
+
+  ~plain_tracked() {
+    --tracked_alive;
+  }
+};
+
+struct plain_fragile {
+  plain_fragile() {
+    if (fragile_throws) {
+      throw std::runtime_error("State constructor failed");
+    }
+  }
+};
+
+CFSM_TRANSITION(plain_tracked, plain_fragile) {
+}
+
+CFSM_TRANSITION(plain_fragile, plain_tracked) {
+}
+
+/* A state class derived from another listed state class */
+class state_general : public state {
+public:
+  void on_enter(void *dataptr) const override {
+  }
+
+  void on_exit(void *dataptr) const override {
+  }
+};
+
+class state_special final : public state_general {
+};
+
+CFSM_TRANSITION(state_general, state_special) {
+}
+
+CFSM_TRANSITION(state_special, state_general) {
+}
+
+/* Plain state classes without the state base class */
+struct plain_idle {
+  static void on_enter(void *dataptr) {
+    ++*reinterpret_cast<int*>(dataptr);
+  }
+};
+
+struct plain_busy {
+  int jobs = 0;
+
+  void on_enter(void *dataptr) {
+    ++jobs;
+    ++*reinterpret_cast<int*>(dataptr);
+  }
+
+  void on_exit(void *dataptr) {
+    --*reinterpret_cast<int*>(dataptr);
+  }
+};
+
+CFSM_TRANSITION(plain_idle, plain_busy) {
+}
+
+CFSM_TRANSITION(plain_busy, plain_idle) {
+}
+
+/* Job count of busy state is saved in snapshots */
+CFSM_PAYLOAD(plain_busy);
+
+/* Plain state with a payload which is not trivially copyable */
+struct plain_session {
+  std::string user;
+
+  /* User name as long as the incremented counter */
+  void on_enter(void *dataptr) {
+    int &count = *reinterpret_cast<int*>(dataptr);
+    user.assign(++count, 'u');
+  }
+};
+
+CFSM_TRANSITION(plain_idle, plain_session) {
+}
+
+CFSM_TRANSITION(plain_session, plain_idle) {
+}
+
+template <>
+struct cfsm::payload<plain_session> {
+  static constexpr std::size_t max_size = 16;
+
+  static std::size_t save(const plain_session &state, char *pdata,
+      std::size_t datalen) {
+    if (state.user.empty() || state.user.size() > datalen) {
+      return 0;
+    }
+    std::memcpy(pdata, state.user.data(), state.user.size());
+    return state.user.size();
+  }
+
+  static bool load(plain_session &state, const char *pdata,
+      std::size_t datalen) {
+    state.user.assign(pdata, datalen);
+    return true;
+  }
+};
+
+/* Plain states with completion transitions */
+struct job_idle {
+  static void on_enter(void *dataptr) {
+    *reinterpret_cast<std::string*>(dataptr) += "i";
+  }
+};
+
+struct job_prepare {
+  static void on_enter(void *dataptr) {
+    *reinterpret_cast<std::string*>(dataptr) += "p";
+  }
+};
+
+struct job_run {
+  static void on_exit(void *dataptr) {
+    *reinterpret_cast<std::string*>(dataptr) += "r";
+  }
+};
+
+struct job_done {
+  static void on_enter(void *dataptr) {
+    *reinterpret_cast<std::string*>(dataptr) += "d";
+  }
+};
+
+CFSM_TRANSITION(job_idle, job_prepare) {
+}
+
+CFSM_COMPLETION(job_prepare, job_run) {
+  *reinterpret_cast<std::string*>(dataptr) += ">";
+}
+
+CFSM_COMPLETION(job_run, job_done) {
+  *reinterpret_cast<std::string*>(dataptr) += ">";
+}
+
+CFSM_TRANSITION(job_done, job_idle) {
+}
+
 /* dummy state */
 class state_foo {
   public:
@@ -576,6 +767,291 @@ void test_concurrency_internal_static() {
 #endif
 }
 
+void test_go_to() {
+#if __cplusplus >= 201703L
+  state_machine_lazy<
+    state,
+    nullptr,
+    state_a,
+    state_b,
+    state_c
+  > fsm;
+
+  fsm.start<state_b>(nullptr);
+
+  /* Already in target state */
+  assert(fsm.go_to<state_b>(nullptr));
+  assert(fsm.state<state_b>() != nullptr);
+
+  /* Route state_b -> state_a -> state_c */
+  std::cout << "* State B to state C\n";
+  assert(fsm.go_to<state_c>(nullptr));
+  assert(fsm.state<state_c>() != nullptr);
+
+  /* No transitions out of state_c */
+  assert(fsm.go_to<state_a>(nullptr) == false);
+  assert(fsm.state<state_c>() != nullptr);
+
+  fsm.stop(nullptr);
+#else
+#warning Cannot test routes for versions below C++17
+  std::cerr << "Cannot test routes for versions below C++17\n";
+#endif
+}
+
+void test_transition_by_id() {
+#if __cplusplus >= 201703L
+  using fsm_type = state_machine_lazy<
+    state,
+    nullptr,
+    state_a,
+    state_b,
+    state_c
+  >;
+  fsm_type fsm;
+
+  const std::size_t id_a = fsm_type::state_index<state_a>();
+  const std::size_t id_b = fsm_type::state_index<state_b>();
+  const std::size_t id_c = fsm_type::state_index<state_c>();
+
+  fsm.start<state_a>(nullptr);
+  assert(fsm.state_id() == id_a);
+
+  assert(fsm.transition_by_id(id_a, id_b, nullptr));
+  assert(fsm.state_id() == id_b);
+
+  /* Not in source state */
+  assert(fsm.transition_by_id(id_a, id_c, nullptr) == false);
+
+  /* No transition functor for the pair */
+  assert(fsm.transition_by_id(id_b, id_c, nullptr) == false);
+
+  /* Out of range */
+  assert(fsm.transition_by_id(id_b, 3, nullptr) == false);
+  assert(fsm.state_id() == id_b);
+
+  assert(fsm.transition_by_id(id_b, id_a, nullptr));
+  assert(fsm.state_id() == id_a);
+
+  fsm.stop(nullptr);
+  assert(fsm.state_id() == fsm_type::npos);
+#else
+#warning Cannot test transitions by state indices for versions below C++17
+  std::cerr << "Cannot test transitions by state indices for versions below"
+    "C++17\n";
+#endif
+}
+
+void test_completion() {
+#if __cplusplus >= 201703L
+  state_machine_inplace<
+    void,
+    nullptr,
+    job_idle,
+    job_prepare,
+    job_run,
+    job_done
+  > fsm;
+
+  std::string trace;
+
+  fsm.start<job_idle>(&trace);
+  assert(trace == "i");
+
+  /* Runs to completion in job_done */
+  assert((fsm.transition<job_idle, job_prepare>(&trace)));
+  assert(trace == "ip>r>d");
+  assert(fsm.state<job_done>() != nullptr);
+
+  assert(fsm.go_to<job_idle>(&trace));
+  assert(trace == "ip>r>di");
+
+  /* Route through the completion chain */
+  assert(fsm.go_to<job_done>(&trace));
+  assert(trace == "ip>r>dip>r>d");
+  assert(fsm.state<job_done>() != nullptr);
+
+  fsm.stop(&trace);
+#else
+#warning Cannot test completion transitions for versions below C++17
+  std::cerr << "Cannot test completion transitions for versions below C++17\n";
+#endif
+}
+
+void test_elided_actions() {
+#if __cplusplus >= 201402L
+  state_machine_lazy<
+    state,
+    nullptr,
+    state_quiet_1,
+    state_quiet_2
+  > fsm;
+#else
+  state_machine_lazy<
+    state,
+    nullptr,
+    2
+  > fsm;
+#endif
+
+  int entries = 0;
+
+  fsm.start<state_quiet_1>(&entries);
+
+  assert((fsm.transition<state_quiet_1, state_quiet_2>(&entries)));
+  assert((fsm.transition<state_quiet_2, state_quiet_1>(&entries)));
+  assert((fsm.transition<state_quiet_1, state_quiet_2>(&entries)));
+
+  /* Only on_enter of state_quiet_2 is called */
+  assert(entries == 2);
+
+  fsm.stop(&entries);
+}
+
+void test_exact_source_state() {
+#if __cplusplus >= 201402L
+  state_machine_lazy<
+    state,
+    nullptr,
+    state_general,
+    state_special
+  > fsm;
+
+  fsm.start<state_special>(nullptr);
+
+  /* The query matches derived state classes */
+  assert(fsm.state<state_general>() != nullptr);
+
+  /* The source state of a transition matches only its own class */
+  assert(!(fsm.transition<state_general, state_special>(nullptr)));
+  assert(fsm.state<state_special>() != nullptr);
+
+  assert((fsm.transition<state_special, state_general>(nullptr)));
+  assert(fsm.state<state_special>() == nullptr);
+  assert((fsm.transition<state_general, state_special>(nullptr)));
+
+  fsm.stop(nullptr);
+#else
+#warning Cannot test exact source states for versions below C++14
+  std::cerr << "Cannot test exact source states for versions below C++14\n";
+#endif
+}
+
+void test_inplace_plain() {
+#if __cplusplus >= 201703L
+  state_machine_inplace<
+    void,
+    nullptr,
+    plain_idle,
+    plain_busy
+  > fsm;
+
+  /* No state object pointer and no vtable pointers */
+#ifndef CFSM_LOCK_STATS_PER_MACHINE
+  static_assert(sizeof(fsm) <= 2 * sizeof(int), "In-place machine too large");
+#else
+  static_assert(sizeof(fsm) <= 2 * sizeof(int) + sizeof(cfsm::lock_counts),
+      "In-place machine too large");
+#endif
+
+  int count = 0;
+
+  fsm.start<plain_idle>(&count);
+  assert(count == 1);
+  assert(fsm.state<plain_idle>() != nullptr);
+
+  assert((fsm.transition<plain_idle, plain_busy>(&count)));
+  assert(count == 2);
+  assert(fsm.state<plain_busy>() != nullptr);
+  assert(fsm.state<plain_busy>()->jobs == 1);
+  assert(fsm.state<plain_idle>() == nullptr);
+
+  assert((fsm.transition<plain_idle, plain_busy>(&count) == false));
+
+  assert((fsm.transition<plain_busy, plain_idle>(&count)));
+  assert(count == 2);
+
+  fsm.stop(&count);
+  assert(fsm.state<>() == nullptr);
+#else
+#warning Cannot test in-place state storage for versions below C++17
+  std::cerr << "Cannot test in-place state storage for versions below C++17\n";
+#endif
+}
+
+void test_inplace_throwing_constructor() {
+#if __cplusplus >= 201703L
+  state_machine_inplace<
+    void,
+    nullptr,
+    plain_tracked,
+    plain_fragile
+  > fsm;
+
+  fsm.start<plain_tracked>(nullptr);
+  assert(tracked_alive == 1);
+
+  /* The source state object is gone, the state machine is stopped */
+  fragile_throws = true;
+  bool thrown = false;
+  try {
+    fsm.transition<plain_tracked, plain_fragile>(nullptr);
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+  assert(tracked_alive == 0);
+  assert(fsm.state<>() == nullptr);
+
+  /* Neither destroyed again nor locked */
+  fsm.stop(nullptr);
+  assert(tracked_alive == 0);
+
+  thrown = false;
+  try {
+    fsm.start<plain_fragile>(nullptr);
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+  assert(fsm.state<>() == nullptr);
+
+  fragile_throws = false;
+  fsm.start<plain_fragile>(nullptr);
+  assert((fsm.transition<plain_fragile, plain_tracked>(nullptr)));
+  assert(tracked_alive == 1);
+  fsm.stop(nullptr);
+  assert(tracked_alive == 0);
+#else
+#warning Cannot test in-place state storage for versions below C++17
+  std::cerr << "Cannot test in-place state storage for versions below C++17\n";
+#endif
+}
+
+void test_inplace_polymorphic() {
+#if __cplusplus >= 201703L
+  state_machine_inplace<
+    state,
+    nullptr,
+    state_1,
+    state_2
+  > fsm;
+
+  fsm.start<state_1>(nullptr);
+
+  assert(fsm.state<state_1>() != nullptr);
+  assert(fsm.state<>() != nullptr);
+
+  assert((fsm.transition<state_1, state_2>(nullptr)));
+  assert(fsm.state<state_2>() != nullptr);
+
+  fsm.stop(nullptr);
+#else
+#warning Cannot test in-place state storage for versions below C++17
+  std::cerr << "Cannot test in-place state storage for versions below C++17\n";
+#endif
+}
+
 void test_serialization_lazy() {
 #if __cplusplus >= 201402L
   //state_machine<
@@ -605,7 +1081,8 @@ void test_serialization_lazy() {
   > fsm_copy;
 #endif
 
-  long serialized_data;
+  char serialized_data[64];
+  std::size_t serialized_len = 0;
 
   {
 #if __cplusplus >= 201402L
@@ -646,25 +1123,22 @@ void test_serialization_lazy() {
     std::cout << "Saving state machine\n";
     /* Original state machine is unusable until load is called */
 #if __cplusplus >= 201402L
-    assert(fsm.save(reinterpret_cast<char*>(&serialized_data),
-        sizeof(serialized_data)) == sizeof(serialized_data));
+    serialized_len = fsm.save(serialized_data, sizeof(serialized_data));
 #else
-    assert(fsm.save(reinterpret_cast<char*>(&serialized_data),
-        sizeof(serialized_data), type_id_from_base_pointer) ==
-        sizeof(serialized_data));
+    serialized_len = fsm.save(serialized_data, sizeof(serialized_data),
+        type_id_from_base_pointer);
 #endif
+    assert(serialized_len > 0);
 
     /* Destroy original state machine */
   }
 
   std::cout << "Loading state machine\n";
 #if __cplusplus >= 201402L
-  assert(fsm_copy.load(reinterpret_cast<char*>(&serialized_data),
-      sizeof(serialized_data)) == sizeof(serialized_data));
+  assert(fsm_copy.load(serialized_data, serialized_len) == serialized_len);
 #else
-  assert(fsm_copy.load(reinterpret_cast<char*>(&serialized_data),
-      sizeof(serialized_data), base_pointer_from_type_id) ==
-      sizeof(serialized_data));
+  assert(fsm_copy.load(serialized_data, serialized_len,
+        base_pointer_from_type_id) == serialized_len);
 #endif
 
   /* Check if state is state_2 */
@@ -691,7 +1165,8 @@ void test_serialization_internal() {
     state_2
   > fsm_copy;
 
-  long serialized_data;
+  char serialized_data[64];
+  std::size_t serialized_len = 0;
 
   {
     //state_machine<
@@ -717,15 +1192,14 @@ void test_serialization_internal() {
 
     std::cout << "Saving state machine\n";
     /* Original state machine is unusable until load is called */
-    assert(fsm.save(reinterpret_cast<char*>(&serialized_data),
-        sizeof(serialized_data)) == sizeof(serialized_data));
+    serialized_len = fsm.save(serialized_data, sizeof(serialized_data));
+    assert(serialized_len > 0);
 
     /* Destroy original state machine */
   }
 
   std::cout << "Loading state machine\n";
-  assert(fsm_copy.load(reinterpret_cast<char*>(&serialized_data),
-      sizeof(serialized_data)) == sizeof(serialized_data));
+  assert(fsm_copy.load(serialized_data, serialized_len) == serialized_len);
 
   /* Check if state is state_2 */
   assert((fsm_copy.state<state_2>() != nullptr));
@@ -741,6 +1215,770 @@ void test_serialization_internal() {
 #endif /* __cplusplus >= 201402L */
 }
 
+void test_serialization_many() {
+#if __cplusplus >= 201703L
+  using fsm_type = state_machine_inplace<
+    void,
+    nullptr,
+    plain_idle,
+    plain_busy
+  >;
+  using other_fsm_type = state_machine_inplace<
+    void,
+    nullptr,
+    plain_busy,
+    plain_idle
+  >;
+
+  static_assert(fsm_type::schema_hash() != other_fsm_type::schema_hash(),
+      "Schema hash ignores order of states");
+
+  int count = 0;
+  fsm_type machines[8];
+  fsm_type machines_copy[8];
+
+  for (std::size_t i = 0; i < 8; ++i) {
+    machines[i].start<plain_idle>(&count);
+    if (i % 3 == 0) {
+      assert((machines[i].transition<plain_idle, plain_busy>(&count)));
+    }
+  }
+  /* Stopped state machines are saved too */
+  machines[7].stop(&count);
+
+  char snapshot[fsm_type::snapshot_bound(8)];
+  std::uint64_t before = cfsm::timestamp_now();
+  std::size_t len = fsm_type::save_many(machines, 8, snapshot,
+      sizeof(snapshot));
+  assert(len > 0);
+
+  /* Start time of the snapshot */
+  std::uint64_t saved_at = fsm_type::snapshot_time(snapshot, len);
+  assert(saved_at >= before && saved_at <= cfsm::timestamp_now());
+
+  /* Buffer too small */
+  assert(fsm_type::save_many(machines, 8, snapshot, len - 1) == 0);
+
+  assert(fsm_type::load_many(machines_copy, 8, snapshot, len) == len);
+  for (std::size_t i = 0; i < 7; ++i) {
+    assert((machines_copy[i].state<plain_busy>() != nullptr) == (i % 3 == 0));
+    assert((machines_copy[i].state<plain_idle>() != nullptr) == (i % 3 != 0));
+    /* Job count set by on_enter is restored without calling it */
+    if (i % 3 == 0) {
+      assert(machines_copy[i].state<plain_busy>()->jobs == 1);
+    }
+  }
+  assert(machines_copy[7].state<>() == nullptr);
+
+  /* Count mismatch, truncated snapshot and different schema */
+  assert(fsm_type::load_many(machines_copy, 7, snapshot, len) == 0);
+  assert(fsm_type::load_many(machines_copy, 8, snapshot, len - 1) == 0);
+
+  other_fsm_type other;
+  assert(other.load(snapshot, len) == 0);
+#else
+#warning Cannot test bulk serialization for versions below C++17
+  std::cerr << "Cannot test bulk serialization for versions below C++17\n";
+#endif
+}
+
+void test_payload_trait() {
+#if __cplusplus >= 201703L
+  using fsm_type = state_machine_inplace<
+    void,
+    nullptr,
+    plain_idle,
+    plain_session
+  >;
+
+  int count = 0;
+  fsm_type machines[2];
+  fsm_type machines_copy[2];
+  for (fsm_type &fsm : machines) {
+    fsm.start<plain_idle>(&count);
+    assert((fsm.transition<plain_idle, plain_session>(&count)));
+  }
+
+  char snapshot[fsm_type::snapshot_bound(2)];
+  std::size_t len = fsm_type::save_many(machines, 2, snapshot,
+      sizeof(snapshot));
+  assert(len > 0);
+
+  /* Every state machine gets its own payload back */
+  assert(fsm_type::load_many(machines_copy, 2, snapshot, len) == len);
+  assert(machines_copy[0].state<plain_session>()->user == "uu");
+  assert(machines_copy[1].state<plain_session>()->user == "uuuu");
+
+  /* Payload larger than max_size is not saved */
+  count = 20;
+  assert((machines[1].transition<plain_session, plain_idle>(&count)));
+  assert((machines[1].transition<plain_idle, plain_session>(&count)));
+  assert(machines[1].state<plain_session>()->user.size() == 22);
+  assert(fsm_type::save_many(machines, 2, snapshot, sizeof(snapshot)) == 0);
+#else
+#warning Cannot test payload traits for versions below C++17
+  std::cerr << "Cannot test payload traits for versions below C++17\n";
+#endif
+}
+
+void test_journal() {
+#if __cplusplus >= 201703L && defined(CFSM_HAS_JOURNAL)
+  using fsm_type = state_machine_inplace<
+    void,
+    nullptr,
+    plain_idle,
+    plain_busy
+  >;
+
+  std::FILE *file = std::tmpfile();
+  assert(file != nullptr);
+
+  int count = 0;
+  fsm_type machines[4];
+  {
+    cfsm::journal log(fileno(file), 2);
+    fsm_type::attach_journal(&log, machines, 4);
+
+    for (std::size_t i = 0; i < 4; ++i) {
+      machines[i].start<plain_idle>(&count);
+    }
+    assert((machines[1].transition<plain_idle, plain_busy>(&count)));
+    assert((machines[2].go_to<plain_busy>(&count)));
+    assert((machines[2].transition<plain_busy, plain_idle>(&count)));
+    assert((machines[3].transition_by_id(0, 1, &count)));
+    machines[0].stop(&count);
+
+    fsm_type::detach_journal();
+    assert(log.sync());
+    assert(!log.failed());
+  }
+
+  std::vector<char> data(9 * cfsm::journal_record_size + 5);
+  std::rewind(file);
+  assert(std::fread(data.data(), 1, data.size(), file) ==
+      9 * cfsm::journal_record_size);
+  std::fclose(file);
+
+  /* Without hooks, the trailing partial record is ignored */
+  int replayed_count = count;
+  fsm_type replayed[4];
+  cfsm::replay_result result = fsm_type::replay(replayed, 4, data.data(),
+      data.size());
+  assert(result.bytes == 9 * cfsm::journal_record_size);
+  assert(result.applied == 9);
+  assert(replayed_count == count);
+  for (std::size_t i = 0; i < 4; ++i) {
+    assert(replayed[i].state_id() == machines[i].state_id());
+  }
+
+  /* With hooks */
+  int hooked_count = 0;
+  fsm_type hooked[4];
+  result = fsm_type::replay(hooked, 4, data.data(), data.size(), 0,
+      &hooked_count, true);
+  assert(result.bytes == 9 * cfsm::journal_record_size);
+  assert(result.applied == 9);
+  for (std::size_t i = 0; i < 4; ++i) {
+    assert(hooked[i].state_id() == machines[i].state_id());
+  }
+  assert(hooked_count > 0);
+
+  /* Records straddling a snapshot which is not a consistent cut */
+  std::vector<char> log(7 * cfsm::journal_record_size);
+  const cfsm::journal_record records[7] = {
+    {0, cfsm::journal_stopped, 0, 1, 1},
+    {1, cfsm::journal_stopped, 0, 2, 2},
+    {0, 0, 1, 3, 3}, /* Reflected in the snapshot */
+    {1, 0, 1, 4, 4},
+    {0, 1, 0, 5, 5},
+    {1, 1, 0, 7, 7}, /* Written before an older record of another thread */
+    {0, cfsm::journal_stopped, 1, 6, 6} /* Does not match */
+  };
+  for (std::size_t i = 0; i < 7; ++i) {
+    cfsm::encode_journal_record(records[i],
+        log.data() + i * cfsm::journal_record_size);
+  }
+  fsm_type restored[2];
+  restored[0].start<plain_idle>(&count);
+  assert((restored[0].transition<plain_idle, plain_busy>(&count)));
+  restored[1].start<plain_idle>(&count);
+  result = fsm_type::replay(restored, 2, log.data(), log.size(), 3);
+  assert(result.bytes == log.size());
+  assert(result.applied == 3);
+  assert(result.skipped == 3);
+  assert(result.mismatched == 1);
+  assert(restored[0].state<plain_idle>() != nullptr);
+  assert(restored[1].state<plain_idle>() != nullptr);
+
+  /* The system clock was set back, the sequence numbers keep the order */
+  const cfsm::journal_record stepped[3] = {
+    {0, cfsm::journal_stopped, 0, 1000, 10},
+    {0, 0, 1, 400, 11},
+    {0, 1, 0, 500, 12}
+  };
+  for (std::size_t i = 0; i < 3; ++i) {
+    cfsm::encode_journal_record(stepped[i],
+        log.data() + i * cfsm::journal_record_size);
+  }
+  fsm_type stepped_back[1];
+  result = fsm_type::replay(stepped_back, 1, log.data(),
+      3 * cfsm::journal_record_size);
+  assert(result.applied == 3 && result.mismatched == 0);
+  assert(stepped_back[0].state<plain_idle>() != nullptr);
+
+  /* Threads append to batches of their own */
+  std::FILE *shared_file = std::tmpfile();
+  assert(shared_file != nullptr);
+  fsm_type threaded[4];
+  {
+    cfsm::journal log(fileno(shared_file), 16);
+    fsm_type::attach_journal(&log, threaded, 4);
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < 4; ++t) {
+      threads.emplace_back([&threaded, t] {
+        int local_count = 0;
+        threaded[t].start<plain_idle>(&local_count);
+        for (int i = 0; i < 100; ++i) {
+          assert((threaded[t].transition<plain_idle, plain_busy>(
+                  &local_count)));
+          assert((threaded[t].transition<plain_busy, plain_idle>(
+                  &local_count)));
+        }
+        assert((threaded[t].transition<plain_idle, plain_busy>(
+                &local_count)));
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    fsm_type::detach_journal();
+    assert(log.sync());
+  }
+
+  std::vector<char> shared_log(4 * 202 * cfsm::journal_record_size);
+  std::rewind(shared_file);
+  assert(std::fread(shared_log.data(), 1, shared_log.size(), shared_file) ==
+      shared_log.size());
+  std::fclose(shared_file);
+
+  fsm_type threaded_copy[4];
+  result = fsm_type::replay(threaded_copy, 4, shared_log.data(),
+      shared_log.size());
+  assert(result.applied == 4 * 202);
+  for (std::size_t t = 0; t < 4; ++t) {
+    assert(threaded_copy[t].state<plain_busy>() != nullptr);
+  }
+#else
+#warning Cannot test transition journal for versions below C++17
+  std::cerr << "Cannot test transition journal for versions below C++17\n";
+#endif
+}
+
+void test_mapped_fleet() {
+#if __cplusplus >= 201703L && __has_include(<sys/mman.h>)
+  using fsm_type = state_machine_inplace<
+    void,
+    nullptr,
+    plain_idle,
+    plain_busy
+  >;
+
+  char path[] = "/tmp/cfsm_fleet_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+
+  int count = 0;
+  fsm_type machines[5];
+  for (auto &fsm : machines) {
+    fsm.start<plain_idle>(&count);
+  }
+
+  {
+    cfsm::mapped_fleet<fsm_type> fleet;
+    assert(fleet.open(path, 5));
+    assert(fleet.generation() == 1);
+    assert(fleet.data()[0] == 0);
+
+    assert(fleet.checkpoint(machines, 5));
+    assert((machines[2].transition<plain_idle, plain_busy>(&count)));
+    machines[4].stop(&count);
+    /* Writeback is left to the kernel */
+    assert(fleet.checkpoint(machines, 5, false));
+    assert(fleet.generation() == 3);
+  }
+
+  {
+    /* Number of state machines does not match */
+    cfsm::mapped_fleet<fsm_type> fleet;
+    assert(!fleet.open(path, 4));
+  }
+
+  int restored_count = count;
+  fsm_type restored[5];
+  {
+    cfsm::mapped_fleet<fsm_type> fleet;
+    assert(fleet.open(path, 5));
+    assert(fleet.restore(restored, 5));
+    for (std::size_t i = 0; i < 5; ++i) {
+      assert(restored[i].state_id() == machines[i].state_id());
+    }
+    assert(restored_count == count);
+  }
+
+  {
+    /* A torn header falls back to the previous checkpoint */
+    std::FILE *file = std::fopen(path, "r+b");
+    assert(file != nullptr);
+    std::fputc(0, file);
+    std::fclose(file);
+
+    cfsm::mapped_fleet<fsm_type> fleet;
+    assert(fleet.open(path, 5));
+    assert(fleet.generation() == 2);
+    assert(fleet.restore(restored, 5));
+    for (auto &fsm : restored) {
+      assert(fsm.state<plain_idle>() != nullptr);
+    }
+
+    /* Overwrites the slot of the torn header */
+    assert(fleet.checkpoint(machines, 5, false));
+    assert(fleet.generation() == 3);
+  }
+
+  {
+    /* Stale records under a valid newer header fall back as well */
+    std::FILE *file = std::fopen(path, "r+b");
+    assert(file != nullptr);
+    std::fseek(file, sysconf(_SC_PAGESIZE) + 2 * sizeof(fsm_type::packed_type),
+        SEEK_SET);
+    std::fputc(1, file);
+    std::fclose(file);
+
+    cfsm::mapped_fleet<fsm_type> fleet;
+    assert(fleet.open(path, 5));
+    assert(fleet.generation() == 2);
+  }
+
+  std::remove(path);
+#else
+#warning Cannot test memory-mapped fleet for versions below C++17
+  std::cerr << "Cannot test memory-mapped fleet for versions below C++17\n";
+#endif
+}
+
+void test_checkpoint_delta() {
+#if __cplusplus >= 201703L
+  using fsm_type = state_machine_inplace<
+    void,
+    nullptr,
+    plain_idle,
+    plain_busy
+  >;
+
+  int count = 0;
+  fsm_type machines[130];
+  for (auto &fsm : machines) {
+    fsm.start<plain_idle>(&count);
+  }
+
+  std::vector<char> base(fsm_type::snapshot_bound(130));
+  std::size_t base_len = fsm_type::save_many(machines, 130, base.data(),
+      base.size());
+  assert(base_len > 0);
+
+  cfsm::dirty_set dirty(130);
+  fsm_type::attach_dirty_set(&dirty, machines);
+
+  assert((machines[3].transition<plain_idle, plain_busy>(&count)));
+  assert((machines[64].go_to<plain_busy>(&count)));
+  machines[129].stop(&count);
+  assert(dirty.test(3) && dirty.test(64) && dirty.test(129));
+  assert(!dirty.test(0));
+
+  /* Buffer too small, the marks are kept */
+  char small[24];
+  assert(fsm_type::checkpoint_delta(machines, 130, dirty, small,
+        sizeof(small)) == 0);
+  assert(dirty.test(3) && dirty.test(64) && dirty.test(129));
+
+  std::vector<char> delta(fsm_type::delta_bound(3));
+  std::size_t delta_len = fsm_type::checkpoint_delta(machines, 130, dirty,
+      delta.data(), delta.size());
+  assert(delta_len > 0 && delta_len < base_len);
+  assert(!dirty.test(3) && !dirty.test(64) && !dirty.test(129));
+
+  assert((machines[64].transition<plain_busy, plain_idle>(&count)));
+  std::vector<char> delta2(fsm_type::delta_bound(1));
+  std::size_t delta2_len = fsm_type::checkpoint_delta(machines, 130, dirty,
+      delta2.data(), delta2.size());
+  assert(delta2_len > 0);
+
+  fsm_type::detach_dirty_set();
+
+  /* Base snapshot and deltas applied in order */
+  int restored_count = count;
+  fsm_type restored[130];
+  assert(fsm_type::load_many(restored, 130, base.data(), base_len) ==
+      base_len);
+  assert(fsm_type::load_delta(restored, 130, delta.data(), delta_len) ==
+      delta_len);
+  assert(fsm_type::load_delta(restored, 130, delta2.data(), delta2_len) ==
+      delta2_len);
+  for (std::size_t i = 0; i < 130; ++i) {
+    assert(restored[i].state_id() == machines[i].state_id());
+  }
+  assert(restored_count == count);
+
+  /* Deltas compacted into the base snapshot */
+  std::vector<char> merged(fsm_type::snapshot_bound(130));
+  std::vector<char> merged2(fsm_type::snapshot_bound(130));
+  std::size_t merged_len = fsm_type::compact(base.data(), base_len,
+      delta.data(), delta_len, merged.data(), merged.size());
+  assert(merged_len > 0);
+  std::size_t merged2_len = fsm_type::compact(merged.data(), merged_len,
+      delta2.data(), delta2_len, merged2.data(), merged2.size());
+  assert(merged2_len > 0);
+
+  fsm_type compacted[130];
+  assert(fsm_type::load_many(compacted, 130, merged2.data(), merged2_len) ==
+      merged2_len);
+  for (std::size_t i = 0; i < 130; ++i) {
+    assert(compacted[i].state_id() == machines[i].state_id());
+  }
+
+  /* A delta is not a full snapshot and vice versa */
+  assert(fsm_type::load_many(compacted, 130, delta.data(), delta_len) == 0);
+  assert(fsm_type::load_delta(compacted, 130, base.data(), base_len) == 0);
+  assert(fsm_type::load_delta(compacted, 129, delta.data(), delta_len) == 0);
+#else
+#warning Cannot test incremental checkpoints for versions below C++17
+  std::cerr << "Cannot test incremental checkpoints for versions below C++17\n";
+#endif
+}
+
+void test_background_checkpoint() {
+#if __cplusplus >= 201703L && defined(CFSM_HAS_BACKGROUND_CHECKPOINT)
+  /* States without payload traits */
+  using fsm_type = state_machine_inplace<
+    state,
+    nullptr,
+    state_quiet_1,
+    state_quiet_2
+  >;
+
+  constexpr std::size_t n = 20000;
+  int count = 0;
+  std::vector<fsm_type> machines(n);
+  std::vector<std::size_t> expected(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    if (i % 5 != 0) {
+      machines[i].start<state_quiet_1>(&count);
+    }
+    expected[i] = machines[i].state_id();
+  }
+
+  std::FILE *file = std::tmpfile();
+  assert(file != nullptr);
+
+  {
+    cfsm::background_checkpoint<fsm_type> checkpoint(machines.data(), n);
+    assert(checkpoint.start(fileno(file)));
+    assert(!checkpoint.start(fileno(file)));
+
+    /* Transitions continue while the checkpoint is written, from the back
+     * so that some of them are captured by copy on write */
+    for (std::size_t i = n; i-- > 0;) {
+      if (i % 5 != 0) {
+        assert((machines[i].transition<state_quiet_1, state_quiet_2>(&count)));
+      } else {
+        machines[i].start<state_quiet_2>(&count);
+      }
+    }
+
+    assert(checkpoint.wait());
+    assert(!checkpoint.running());
+  }
+
+  std::vector<char> data(fsm_type::snapshot_bound(n));
+  std::rewind(file);
+  std::size_t len = std::fread(data.data(), 1, data.size(), file);
+  std::fclose(file);
+
+  /* The snapshot holds the states at the start of the checkpoint */
+  std::vector<fsm_type> restored(n);
+  assert(fsm_type::load_many(restored.data(), n, data.data(), len) == len);
+  for (std::size_t i = 0; i < n; ++i) {
+    assert(restored[i].state_id() == expected[i]);
+    assert(machines[i].state_id() == fsm_type::state_index<state_quiet_2>());
+  }
+#else
+#warning Cannot test background checkpoints for versions below C++17
+  std::cerr << "Cannot test background checkpoints for versions below C++17\n";
+#endif
+}
+
+void test_parallel_load() {
+#if __cplusplus >= 201703L
+  using fsm_type = state_machine_inplace<
+    void,
+    nullptr,
+    plain_idle,
+    plain_busy
+  >;
+
+  constexpr std::size_t n = 1000;
+  int count = 0;
+  std::vector<fsm_type> machines(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    if (i % 7 == 0) {
+      continue;
+    }
+    machines[i].start<plain_idle>(&count);
+    if (i % 3 == 0) {
+      assert((machines[i].transition<plain_idle, plain_busy>(&count)));
+    }
+  }
+
+  std::vector<char> snapshot(fsm_type::snapshot_bound(n));
+  std::size_t len = fsm_type::save_many(machines.data(), n, snapshot.data(),
+      snapshot.size());
+  assert(len > 0);
+
+  /* More threads than state machines, uneven ranges and the default */
+  for (std::size_t threads : {1, 3, 4, 0, 2000}) {
+    std::vector<fsm_type> restored(n);
+    assert(fsm_type::load_many_parallel(restored.data(), n, snapshot.data(),
+          len, threads) == len);
+    for (std::size_t i = 0; i < n; ++i) {
+      assert(restored[i].state_id() == machines[i].state_id());
+      if (i % 7 != 0 && i % 3 == 0) {
+        assert(restored[i].state<plain_busy>()->jobs == 1);
+      }
+    }
+  }
+
+  std::vector<fsm_type> restored(n);
+  assert(fsm_type::load_many_parallel(restored.data(), n, snapshot.data(),
+        len - 1, 4) == 0);
+  assert(fsm_type::load_many_parallel(restored.data(), n - 1,
+        snapshot.data(), len, 4) == 0);
+
+  /* Lazily allocated state objects are allocated by the threads */
+  using lazy_fsm_type = state_machine_lazy<
+    state,
+    nullptr,
+    state_1,
+    state_2
+  >;
+  std::vector<lazy_fsm_type> lazy(64);
+  for (std::size_t i = 0; i < lazy.size(); ++i) {
+    lazy[i].start<state_1>(nullptr);
+    if (i % 2) {
+      assert((lazy[i].transition<state_1, state_2>(nullptr)));
+    }
+  }
+  std::vector<char> lazy_snapshot(lazy_fsm_type::snapshot_bound(64));
+  std::size_t lazy_len = lazy_fsm_type::save_many(lazy.data(), 64,
+      lazy_snapshot.data(), lazy_snapshot.size());
+  std::vector<lazy_fsm_type> lazy_restored(64);
+  assert(lazy_fsm_type::load_many_parallel(lazy_restored.data(), 64,
+        lazy_snapshot.data(), lazy_len, 4) == lazy_len);
+  for (std::size_t i = 0; i < lazy.size(); ++i) {
+    assert((lazy_restored[i].state<state_2>() != nullptr) == (i % 2 == 1));
+  }
+#else
+#warning Cannot test parallel snapshot load for versions below C++17
+  std::cerr << "Cannot test parallel snapshot load for versions below C++17\n";
+#endif
+}
+
+void test_checksums() {
+#if __cplusplus >= 201703L
+  const char check[] = "123456789";
+  assert(cfsm::crc32c(check, 9) == 0xE3069283);
+  assert(~cfsm::crc32c_portable(~0u, check, 9) == 0xE3069283);
+  assert(cfsm::crc32c(check + 4, 5, cfsm::crc32c(check, 4)) == 0xE3069283);
+
+  std::vector<char> bytes(1000);
+  for (std::size_t i = 0; i < bytes.size(); ++i) {
+    bytes[i] = static_cast<char>(i * 31 + 7);
+  }
+  for (std::size_t len : {0, 1, 7, 8, 9, 63, 1000}) {
+    assert(cfsm::crc32c(bytes.data(), len) ==
+        ~cfsm::crc32c_portable(~0u, bytes.data(), len));
+  }
+
+  using fsm_type = state_machine_inplace<
+    void,
+    nullptr,
+    plain_idle,
+    plain_busy
+  >;
+
+  /* Several frames, every flipped byte is detected */
+  constexpr std::size_t n = 2 * cfsm::snapshot_frame_records + 100;
+  int count = 0;
+  std::vector<fsm_type> machines(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    machines[i].start<plain_idle>(&count);
+    if (i % 5 == 0) {
+      assert((machines[i].transition<plain_idle, plain_busy>(&count)));
+    }
+  }
+  std::vector<char> snapshot(fsm_type::snapshot_bound(n));
+  std::size_t len = fsm_type::save_many(machines.data(), n, snapshot.data(),
+      snapshot.size());
+  assert(len > 0);
+
+  std::vector<fsm_type> restored(n);
+  assert(fsm_type::load_many(restored.data(), n, snapshot.data(), len) == len);
+  for (std::size_t pos : {std::size_t{5}, len / 2, len - 1}) {
+    snapshot[pos] ^= 0x10;
+    assert(fsm_type::load_many(restored.data(), n, snapshot.data(), len) == 0);
+    assert(fsm_type::load_many_parallel(restored.data(), n, snapshot.data(),
+          len, 3) == 0);
+    snapshot[pos] ^= 0x10;
+  }
+
+  /* Deltas */
+  cfsm::dirty_set dirty(n);
+  fsm_type::attach_dirty_set(&dirty, machines.data());
+  assert((machines[n - 1].go_to<plain_busy>(&count)));
+  fsm_type::detach_dirty_set();
+  std::vector<char> delta(fsm_type::delta_bound(1));
+  std::size_t delta_len = fsm_type::checkpoint_delta(machines.data(), n,
+      dirty, delta.data(), delta.size());
+  assert(delta_len > 0);
+  delta[delta_len - 2] ^= 0x01;
+  assert(fsm_type::load_delta(restored.data(), n, delta.data(),
+        delta_len) == 0);
+
+  std::vector<char> merged(fsm_type::snapshot_bound(n));
+  assert(fsm_type::compact(snapshot.data(), len, delta.data(), delta_len,
+        merged.data(), merged.size()) == 0);
+
+#if defined(CFSM_HAS_JOURNAL)
+  /* Replay stops at a corrupted journal record */
+  std::vector<char> log(3 * cfsm::journal_record_size);
+  cfsm::encode_journal_record({0, cfsm::journal_stopped, 0, 1, 1}, log.data());
+  cfsm::encode_journal_record({0, 0, 1, 2, 2},
+      log.data() + cfsm::journal_record_size);
+  cfsm::encode_journal_record({0, 1, 0, 3, 3},
+      log.data() + 2 * cfsm::journal_record_size);
+  log[cfsm::journal_record_size + 12] ^= 0x01;
+  fsm_type replayed[1];
+  assert(fsm_type::replay(replayed, 1, log.data(), log.size()).bytes ==
+      cfsm::journal_record_size);
+  assert(replayed[0].state_id() == 0);
+#endif
+#else
+#warning Cannot test checksums for versions below C++17
+  std::cerr << "Cannot test checksums for versions below C++17\n";
+#endif
+}
+
+void test_compressed_snapshot() {
+#if __cplusplus >= 201703L
+  /* Every width the groups are packed with */
+  for (std::size_t width = 1; width <= 32; ++width) {
+    std::uint32_t values[cfsm::packed_group_size];
+    std::uint32_t unpacked[cfsm::packed_group_size];
+    for (std::size_t k = 0; k < cfsm::packed_group_size; ++k) {
+      values[k] = static_cast<std::uint32_t>((k * 2654435761u) &
+          ((std::uint64_t(1) << width) - 1));
+    }
+    char group[32];
+    cfsm::pack_group(values, width, group);
+    cfsm::unpack_group(group, width, unpacked);
+    assert(std::equal(values, values + cfsm::packed_group_size, unpacked));
+  }
+  assert(cfsm::packed_width(1) == 1);
+  assert(cfsm::packed_width(2) == 2);
+  assert(cfsm::packed_width(255) == 8);
+  assert(cfsm::packed_width(256) == 9);
+
+  using fsm_type = state_machine_inplace<
+    state,
+    nullptr,
+    state_quiet_1,
+    state_quiet_2
+  >;
+
+  /* Mostly idle with a few changed and stopped state machines, short runs
+   * and a partial last group */
+  constexpr std::size_t n = 100003;
+  int count = 0;
+  std::vector<fsm_type> machines(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    if (i % 1000 == 999) {
+      continue;
+    }
+    machines[i].start<state_quiet_1>(&count);
+    if (i % 997 == 0 || (i >= 5000 && i < 5100 && i % 3 == 0) ||
+        i + 3 >= n) {
+      assert((machines[i].transition<state_quiet_1, state_quiet_2>(&count)));
+    }
+  }
+
+  std::vector<char> plain(fsm_type::snapshot_bound(n));
+  std::size_t plain_len = fsm_type::save_many(machines.data(), n, plain.data(),
+      plain.size());
+  std::vector<char> compressed(fsm_type::compressed_bound(n));
+  std::size_t len = fsm_type::save_many_compressed(machines.data(), n,
+      compressed.data(), compressed.size());
+  assert(len > 0 && len * 10 < plain_len);
+
+  std::vector<fsm_type> restored(n);
+  assert(fsm_type::load_many_compressed(restored.data(), n,
+        compressed.data(), len) == len);
+  for (std::size_t i = 0; i < n; ++i) {
+    assert(restored[i].state_id() == machines[i].state_id());
+  }
+
+  /* Alternating states are bit-packed only, the bound holds */
+  for (std::size_t i = 0; i < n; ++i) {
+    machines[i].stop(&count);
+    machines[i].start<state_quiet_1>(&count);
+    if (i % 2) {
+      assert((machines[i].transition<state_quiet_1, state_quiet_2>(&count)));
+    }
+  }
+  len = fsm_type::save_many_compressed(machines.data(), n, compressed.data(),
+      compressed.size());
+  assert(len > 0);
+  assert(fsm_type::load_many_compressed(restored.data(), n,
+        compressed.data(), len) == len);
+  for (std::size_t i = 0; i < n; ++i) {
+    assert(restored[i].state_id() == machines[i].state_id());
+  }
+
+  /* Mismatches, truncation and corruption */
+  assert(fsm_type::load_many(restored.data(), n, compressed.data(), len) == 0);
+  assert(fsm_type::load_many_compressed(restored.data(), n, plain.data(),
+        plain_len) == 0);
+  assert(fsm_type::load_many_compressed(restored.data(), n - 1,
+        compressed.data(), len) == 0);
+  assert(fsm_type::load_many_compressed(restored.data(), n,
+        compressed.data(), len - 1) == 0);
+  compressed[len / 2] ^= 0x04;
+  assert(fsm_type::load_many_compressed(restored.data(), n,
+        compressed.data(), len) == 0);
+  assert(fsm_type::save_many_compressed(machines.data(), n, compressed.data(),
+        len / 2) == 0);
+
+  /* No state machines */
+  len = fsm_type::save_many_compressed(nullptr, 0, compressed.data(),
+      compressed.size());
+  assert(len > 0);
+  assert(fsm_type::load_many_compressed(nullptr, 0, compressed.data(), len) ==
+      len);
+#else
+#warning Cannot test compressed snapshots for versions below C++17
+  std::cerr << "Cannot test compressed snapshots for versions below C++17\n";
+#endif
+}
+
 int main() {
   std::cout << "Lazy allocator test\n\n";
   test_lazy_allocator();
@@ -761,6 +1999,38 @@ int main() {
   test_concurrency_lazy();
   std::cout << "test_concurrency_lazy end\n";
 
+  std::cout << "\nShortest route test\n\n";
+  test_go_to();
+  std::cout << "test_go_to end\n";
+
+  std::cout << "\nTransitions by state indices test\n\n";
+  test_transition_by_id();
+  std::cout << "test_transition_by_id end\n";
+
+  std::cout << "\nCompletion transitions test\n\n";
+  test_completion();
+  std::cout << "test_completion end\n";
+
+  std::cout << "\nElided entry and exit actions test\n\n";
+  test_elided_actions();
+  std::cout << "test_elided_actions end\n";
+
+  std::cout << "\nExact source state test\n\n";
+  test_exact_source_state();
+  std::cout << "test_exact_source_state end\n";
+
+  std::cout << "\nIn-place plain state objects test\n\n";
+  test_inplace_plain();
+  std::cout << "test_inplace_plain end\n";
+
+  std::cout << "\nIn-place throwing state constructor test\n\n";
+  test_inplace_throwing_constructor();
+  std::cout << "test_inplace_throwing_constructor end\n";
+
+  std::cout << "\nIn-place polymorphic state objects test\n\n";
+  test_inplace_polymorphic();
+  std::cout << "test_inplace_polymorphic end\n";
+
   std::cout << "\nSerialization test with lazy allocator\n\n";
   test_serialization_lazy();
   std::cout << "test_serialization_lazy end\n";
@@ -769,5 +2039,41 @@ int main() {
   test_serialization_internal();
   std::cout << "test_serialization_internal end\n";
 
+  std::cout << "\nBulk serialization test\n\n";
+  test_serialization_many();
+  std::cout << "test_serialization_many end\n";
+
+  std::cout << "\nPayload trait test\n\n";
+  test_payload_trait();
+  std::cout << "test_payload_trait end\n";
+
+  std::cout << "\nTransition journal test\n\n";
+  test_journal();
+  std::cout << "test_journal end\n";
+
+  std::cout << "\nMemory-mapped fleet test\n\n";
+  test_mapped_fleet();
+  std::cout << "test_mapped_fleet end\n";
+
+  std::cout << "\nIncremental checkpoint test\n\n";
+  test_checkpoint_delta();
+  std::cout << "test_checkpoint_delta end\n";
+
+  std::cout << "\nBackground checkpoint test\n\n";
+  test_background_checkpoint();
+  std::cout << "test_background_checkpoint end\n";
+
+  std::cout << "\nParallel snapshot load test\n\n";
+  test_parallel_load();
+  std::cout << "test_parallel_load end\n";
+
+  std::cout << "\nChecksum test\n\n";
+  test_checksums();
+  std::cout << "test_checksums end\n";
+
+  std::cout << "\nCompressed snapshot test\n\n";
+  test_compressed_snapshot();
+  std::cout << "test_compressed_snapshot end\n";
+
   return 0;
 }